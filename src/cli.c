@@ -2,7 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include "parser.h"
+#include "lower.h"
+#include "opt.h"
 #include "codegen_direct.h"
+#include "profile.h"
 
 static char *readFile(const char *path) {
     FILE *f = fopen(path,"rb");
@@ -13,20 +16,75 @@ static char *readFile(const char *path) {
 
 int main(int argc, char **argv) {
     if (argc < 3) {
-        fprintf(stderr,"usage: jcc -m <memEntries> [ -o <out> ] <source>\n");
+        fprintf(stderr,"usage: jcc -m <memEntries> [ -o <out> ] [ -dump-ir ] [ -falign-loops=<n> ] [ -falign-functions=<n> ] [ -fno-reorder-functions ] [ -finline-limit=<n> ] [ -funroll[=<n>] ] [ -funroll-budget=<n> ] [ -fno-vectorize ] [ -fno-devirtualize ] [ -mno-avx2 ] [ -fomit-frame-pointer ] [ -fno-output-buffer ] [ -fprofile-generate[=<file>] ] [ -fprofile-use[=<file>] ] <source>\n");
         return 1;
     }
     int memEntries = 0;
     char *outName = "a.out";
     char *srcPath = NULL;
+    int dumpIr = 0;
+    const char *profileGenerate = NULL;
+    const char *profileUse = NULL;
+    CodegenOptions cg;
+    memset(&cg, 0, sizeof(cg));
+    cg.avx2 = 1;
+    cg.alignFunctions = 16;
+    cg.reorderFunctions = 1;
+    cg.bufferOutput = 1;
+    OptOptions opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.inlineLimit = OPT_DEFAULT_INLINE_LIMIT;
+    opt.unrollBudget = OPT_DEFAULT_UNROLL_BUDGET;
+    opt.vectorize = 1;
+    opt.devirtualize = 1;
     // parse options
     for (int i=1;i<argc;i++) {
         if (strcmp(argv[i],"-m")==0 && i+1<argc) { memEntries = atoi(argv[++i]); continue; }
         if (strcmp(argv[i],"-o")==0 && i+1<argc) { outName = argv[++i]; continue; }
+        if (strcmp(argv[i],"-dump-ir")==0) { dumpIr = 1; continue; }
+        if (strncmp(argv[i],"-falign-loops=",14)==0) {
+            int n = atoi(argv[i]+14);
+            if (n != 0 && n != 16 && n != 32) { fprintf(stderr,"-falign-loops must be 0, 16 or 32\n"); return 1; }
+            cg.alignLoops = (unsigned)n;
+            continue;
+        }
+        if (strncmp(argv[i],"-falign-functions=",18)==0) {
+            int n = atoi(argv[i]+18);
+            if (n != 0 && n != 16 && n != 32) { fprintf(stderr,"-falign-functions must be 0, 16 or 32\n"); return 1; }
+            cg.alignFunctions = (unsigned)n;
+            continue;
+        }
+        if (strcmp(argv[i],"-fno-reorder-functions")==0) { cg.reorderFunctions = 0; continue; }
+        if (strncmp(argv[i],"-finline-limit=",15)==0) {
+            opt.inlineLimit = atoi(argv[i]+15);
+            if (opt.inlineLimit < 0) { fprintf(stderr,"-finline-limit must not be negative\n"); return 1; }
+            continue;
+        }
+        if (strcmp(argv[i],"-funroll")==0) { opt.unrollFactor = OPT_DEFAULT_UNROLL_FACTOR; continue; }
+        if (strncmp(argv[i],"-funroll=",9)==0) {
+            opt.unrollFactor = atoi(argv[i]+9);
+            if (opt.unrollFactor < 1 || opt.unrollFactor > 16) { fprintf(stderr,"-funroll must be between 1 and 16\n"); return 1; }
+            continue;
+        }
+        if (strncmp(argv[i],"-funroll-budget=",16)==0) {
+            opt.unrollBudget = atoi(argv[i]+16);
+            if (opt.unrollBudget < 1) { fprintf(stderr,"-funroll-budget must be positive\n"); return 1; }
+            continue;
+        }
+        if (strcmp(argv[i],"-fno-vectorize")==0) { opt.vectorize = 0; continue; }
+        if (strcmp(argv[i],"-fno-devirtualize")==0) { opt.devirtualize = 0; continue; }
+        if (strcmp(argv[i],"-mno-avx2")==0) { cg.avx2 = 0; continue; }
+        if (strcmp(argv[i],"-fomit-frame-pointer")==0) { cg.omitFramePointer = 1; continue; }
+        if (strcmp(argv[i],"-fno-output-buffer")==0) { cg.bufferOutput = 0; continue; }
+        if (strcmp(argv[i],"-fprofile-generate")==0) { profileGenerate = PROFILE_DEFAULT_PATH; continue; }
+        if (strncmp(argv[i],"-fprofile-generate=",19)==0) { profileGenerate = argv[i]+19; continue; }
+        if (strcmp(argv[i],"-fprofile-use")==0) { profileUse = PROFILE_DEFAULT_PATH; continue; }
+        if (strncmp(argv[i],"-fprofile-use=",14)==0) { profileUse = argv[i]+14; continue; }
         if (argv[i][0]=='-') { fprintf(stderr,"unknown option %s\n", argv[i]); return 1; }
         srcPath = argv[i];
     }
     if (!srcPath || memEntries<=0) { fprintf(stderr,"missing source or -m\n"); return 1; }
+    if (profileGenerate && profileUse) { fprintf(stderr,"-fprofile-generate and -fprofile-use are exclusive\n"); return 1; }
     char *src = readFile(srcPath);
     if (!src) return 1;
     Parser p; parserInit(&p, src);
@@ -34,7 +92,15 @@ int main(int argc, char **argv) {
     // semantic checks
     extern int semaCheck(Program *p);
     if (!semaCheck(prog)) { fprintf(stderr,"sema failed\n"); return 1; }
-    if (!emitDirectElfProgram(outName, prog, memEntries)) return 1;
+    IrModule *mod = lowerProgram(prog);
+    if (profileGenerate) {
+        instrumentModule(mod);
+        cg.profilePath = profileGenerate;
+    }
+    if (profileUse) applyProfile(mod, profileUse);
+    optimizeModule(mod, &opt);
+    if (dumpIr) irDumpModule(stdout, mod);
+    if (!emitDirectElfProgram(outName, mod, memEntries, &cg)) return 1;
     printf("built %s (direct-elf)\n", outName);
     return 0;
 }
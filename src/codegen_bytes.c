@@ -26,10 +26,14 @@ void patchListFree(PatchList *p) {
     p[0].items = NULL; p[0].count = 0; p[0].cap = 0;
 }
 void addPatch(PatchList *p, Segment seg, size_t offset, const char *symbolName, int64_t addend) {
+    addPatchKind(p, PATCH_ABS64, seg, offset, symbolName, addend);
+}
+void addPatchKind(PatchList *p, PatchKind kind, Segment seg, size_t offset, const char *symbolName, int64_t addend) {
     if (p[0].count == p[0].cap) {
         p[0].cap = p[0].cap ? p[0].cap * 2 : 64;
         p[0].items = realloc(p[0].items, sizeof(Patch) * (size_t)p[0].cap);
     }
+    p[0].items[p[0].count].kind = kind;
     p[0].items[p[0].count].seg = seg;
     p[0].items[p[0].count].offset = offset;
     p[0].items[p[0].count].symbolName = strDup(symbolName);
@@ -104,6 +108,32 @@ void emitMovRegImm64(ByteBuf *b, Reg dst, uint64_t imm) {
     emitU8(b, (uint8_t)(0xB8 + (dst & 7)));
     emitU64(b, imm);
 }
+void emitXorReg32(ByteBuf *b, Reg dst) {
+    // xor r32, r32 : [REX] 31 /r (zero-extends into the full register)
+    if (dst >= 8) emitU8(b, rexByte(0,1,0,1));
+    emitU8(b, 0x31);
+    emitModRm(b, 3, dst & 7, dst & 7);
+}
+void emitMovReg32Imm32(ByteBuf *b, Reg dst, uint32_t imm) {
+    // mov r32, imm32 : [REX] B8+r id (zero-extends into the full register)
+    if (dst >= 8) emitU8(b, rexByte(0,0,0,1));
+    emitU8(b, (uint8_t)(0xB8 + (dst & 7)));
+    emitU32(b, imm);
+}
+void emitMovRegSImm32(ByteBuf *b, Reg dst, int32_t imm) {
+    // mov r/m64, imm32 (sign-extended) : 48 C7 /0 id
+    int bb = (dst >> 3) & 1;
+    emitRexW(b, 0, 0, bb);
+    emitU8(b, 0xC7);
+    emitModRm(b, 3, 0, dst & 7);
+    emitU32(b, (uint32_t)imm);
+}
+void emitMovRegImm(ByteBuf *b, Reg dst, int64_t imm) {
+    if (imm == 0) emitXorReg32(b, dst);
+    else if (imm > 0 && imm <= (int64_t)UINT32_MAX) emitMovReg32Imm32(b, dst, (uint32_t)imm);
+    else if (imm >= INT32_MIN && imm < 0) emitMovRegSImm32(b, dst, (int32_t)imm);
+    else emitMovRegImm64(b, dst, (uint64_t)imm);
+}
 size_t emitMovRegImm64Patch(ByteBuf *b, PatchList *p, Segment seg, Reg dst, const char *symbolName, int64_t addend) {
     int bb = (dst >> 3) & 1;
     emitU8(b, rexByte(1,0,0,bb));
@@ -113,6 +143,99 @@ size_t emitMovRegImm64Patch(ByteBuf *b, PatchList *p, Segment seg, Reg dst, cons
     addPatch(p, seg, immOffset, symbolName, addend);
     return immOffset;
 }
+void emitMovReg32Imm32Patch(ByteBuf *b, PatchList *p, Reg dst, const char *symbolName, int64_t addend) {
+    // mov r32, imm32 (zero-extended); fine for addresses below 2^31
+    emitMovReg32Imm32(b, dst, 0);
+    addPatchKind(p, PATCH_ABS32, SEG_TEXT, b[0].size - 4, symbolName, addend);
+}
+void emitCallRel32Patch(ByteBuf *b, PatchList *p, const char *symbolName) {
+    // call rel32 : E8 cd
+    emitU8(b, 0xE8);
+    emitU32(b, 0);
+    addPatchKind(p, PATCH_REL32, SEG_TEXT, b[0].size - 4, symbolName, 0);
+}
+void emitJmpRel32Patch(ByteBuf *b, PatchList *p, const char *symbolName) {
+    // jmp rel32 : E9 cd
+    emitU8(b, 0xE9);
+    emitU32(b, 0);
+    addPatchKind(p, PATCH_REL32, SEG_TEXT, b[0].size - 4, symbolName, 0);
+}
+// ModRM (mod=00, rm=100) + SIB with base=101: [index*scale + disp32], or just
+// [disp32] when the SIB index is 100 (none)
+static void emitAbsIndexOperand(ByteBuf *b, PatchList *p, int reg, int index, int scale,
+                                const char *symbolName, int64_t addend) {
+    emitModRm(b, 0, reg & 7, 4);
+    emitSib(b, index < 0 ? 1 : scale, index < 0 ? 4 : index & 7, 5);
+    addPatchKind(p, PATCH_ABS32, SEG_TEXT, b[0].size, symbolName, addend);
+    emitU32(b, 0);
+}
+void emitMovRegAbsIndex(ByteBuf *b, PatchList *p, Reg dst, int index, int scale, const char *symbolName, int64_t addend) {
+    // mov r64, [index*scale + disp32] : 48 8B /r
+    emitRexW(b, (dst >> 3) & 1, index < 0 ? 0 : (index >> 3) & 1, 0);
+    emitU8(b, 0x8B);
+    emitAbsIndexOperand(b, p, dst, index, scale, symbolName, addend);
+}
+void emitMovAbsIndexReg(ByteBuf *b, PatchList *p, int index, int scale, const char *symbolName, int64_t addend, Reg src) {
+    // mov [index*scale + disp32], r64 : 48 89 /r
+    emitRexW(b, (src >> 3) & 1, index < 0 ? 0 : (index >> 3) & 1, 0);
+    emitU8(b, 0x89);
+    emitAbsIndexOperand(b, p, src, index, scale, symbolName, addend);
+}
+void emitMovAbsIndexImm32(ByteBuf *b, PatchList *p, int index, int scale, const char *symbolName, int64_t addend, int32_t imm) {
+    // mov qword [index*scale + disp32], imm32 (sign-extended) : 48 C7 /0 id
+    emitRexW(b, 0, index < 0 ? 0 : (index >> 3) & 1, 0);
+    emitU8(b, 0xC7);
+    emitAbsIndexOperand(b, p, 0, index, scale, symbolName, addend);
+    emitU32(b, (uint32_t)imm);
+}
+void emitMovzxRegWordAbsIndex(ByteBuf *b, PatchList *p, Reg dst, int index, int scale, const char *symbolName, int64_t addend) {
+    // movzx r64, word [index*scale + disp32] : 48 0F B7 /r
+    emitRexW(b, (dst >> 3) & 1, index < 0 ? 0 : (index >> 3) & 1, 0);
+    emitU8(b, 0x0F);
+    emitU8(b, 0xB7);
+    emitAbsIndexOperand(b, p, dst, index, scale, symbolName, addend);
+}
+void emitLeaRegAbsIndex(ByteBuf *b, PatchList *p, Reg dst, int index, int scale, const char *symbolName, int64_t addend) {
+    // lea r64, [index*scale + disp32] : 48 8D /r
+    emitRexW(b, (dst >> 3) & 1, index < 0 ? 0 : (index >> 3) & 1, 0);
+    emitU8(b, 0x8D);
+    emitAbsIndexOperand(b, p, dst, index, scale, symbolName, addend);
+}
+void emitMovntiAbsIndexReg(ByteBuf *b, PatchList *p, int index, int scale, const char *symbolName, int64_t addend, Reg src) {
+    // movnti [index*scale + disp32], r64 : 48 0F C3 /r
+    emitRexW(b, (src >> 3) & 1, index < 0 ? 0 : (index >> 3) & 1, 0);
+    emitU8(b, 0x0F);
+    emitU8(b, 0xC3);
+    emitAbsIndexOperand(b, p, src, index, scale, symbolName, addend);
+}
+void emitAluAbsIndexReg(ByteBuf *b, PatchList *p, AluOp op, int index, int scale, const char *symbolName, int64_t addend, Reg src) {
+    // <op> [index*scale + disp32], r64 : 48 (op*8+1) /r
+    emitRexW(b, (src >> 3) & 1, index < 0 ? 0 : (index >> 3) & 1, 0);
+    emitU8(b, (uint8_t)((int)op * 8 + 1));
+    emitAbsIndexOperand(b, p, src, index, scale, symbolName, addend);
+}
+void emitAluAbsIndexImm(ByteBuf *b, PatchList *p, AluOp op, int index, int scale, const char *symbolName, int64_t addend, int32_t imm) {
+    // <op> qword [index*scale + disp32], imm : 48 83 /op ib, or 48 81 /op id
+    int short8 = imm >= -128 && imm <= 127;
+    emitRexW(b, 0, index < 0 ? 0 : (index >> 3) & 1, 0);
+    emitU8(b, short8 ? 0x83 : 0x81);
+    emitAbsIndexOperand(b, p, (int)op, index, scale, symbolName, addend);
+    if (short8) emitU8(b, (uint8_t)(int8_t)imm);
+    else emitU32(b, (uint32_t)imm);
+}
+// [base + index*8 + disp32], the disp32 patched like emitAbsIndexOperand's;
+// base < 0: no base
+static void emitAbsBaseIndexOperand(ByteBuf *b, PatchList *p, int reg, int base, int index,
+                                    const char *symbolName, int64_t addend) {
+    if (base < 0) {
+        emitAbsIndexOperand(b, p, reg, index, 8, symbolName, addend);
+        return;
+    }
+    emitModRm(b, 2, reg & 7, 4);
+    emitSib(b, 8, index & 7, base & 7);
+    addPatchKind(p, PATCH_ABS32, SEG_TEXT, b[0].size, symbolName, addend);
+    emitU32(b, 0);
+}
 void emitMovRegMemDisp(ByteBuf *b, Reg dst, Reg base, int32_t disp) {
     // mov r64, [base+disp32] : 48 8B /r (dst is reg)
     int r = (dst >> 3) & 1;
@@ -120,6 +243,7 @@ void emitMovRegMemDisp(ByteBuf *b, Reg dst, Reg base, int32_t disp) {
     emitRexW(b, r, 0, bb);
     emitU8(b, 0x8B);
     emitModRm(b, 2, dst & 7, base & 7);
+    if ((base & 7) == 4) emitSib(b, 1, 4, 4);
     emitU32(b, (uint32_t)disp);
 }
 void emitMovMemDispReg(ByteBuf *b, Reg base, int32_t disp, Reg src) {
@@ -129,6 +253,17 @@ void emitMovMemDispReg(ByteBuf *b, Reg base, int32_t disp, Reg src) {
     emitRexW(b, r, 0, bb);
     emitU8(b, 0x89);
     emitModRm(b, 2, src & 7, base & 7);
+    if ((base & 7) == 4) emitSib(b, 1, 4, 4);
+    emitU32(b, (uint32_t)disp);
+}
+void emitLeaRegMemDisp(ByteBuf *b, Reg dst, Reg base, int32_t disp) {
+    // lea r64, [base+disp32] : 48 8D /r
+    int r = (dst >> 3) & 1;
+    int bb = (base >> 3) & 1;
+    emitRexW(b, r, 0, bb);
+    emitU8(b, 0x8D);
+    emitModRm(b, 2, dst & 7, base & 7);
+    if ((base & 7) == 4) emitSib(b, 1, 4, 4);
     emitU32(b, (uint32_t)disp);
 }
 void emitLeaRegBaseIndexScaleDisp(ByteBuf *b, Reg dst, Reg base, Reg index, int scale, int32_t disp) {
@@ -142,6 +277,146 @@ void emitLeaRegBaseIndexScaleDisp(ByteBuf *b, Reg dst, Reg base, Reg index, int
     emitSib(b, scale, index & 7, base & 7);
     emitU32(b, (uint32_t)disp);
 }
+void emitMovMemDispImm32(ByteBuf *b, Reg base, int32_t disp, int32_t imm) {
+    // mov qword [base+disp32], imm32 (sign-extended) : 48 C7 /0 id
+    int bb = (base >> 3) & 1;
+    emitRexW(b, 0, 0, bb);
+    emitU8(b, 0xC7);
+    emitModRm(b, 2, 0, base & 7);
+    if ((base & 7) == 4) emitSib(b, 1, 4, 4);
+    emitU32(b, (uint32_t)disp);
+    emitU32(b, (uint32_t)imm);
+}
+void emitPushImm32(ByteBuf *b, int32_t imm) {
+    // push imm32 (sign-extended to 64 bits) : 68 id
+    emitU8(b, 0x68);
+    emitU32(b, (uint32_t)imm);
+}
+void emitAluRegImm32(ByteBuf *b, AluOp op, Reg dst, int32_t imm) {
+    // <op> r/m64, imm32 : 48 81 /op id
+    int bb = (dst >> 3) & 1;
+    emitRexW(b, 0, 0, bb);
+    emitU8(b, 0x81);
+    emitModRm(b, 3, (int)op, dst & 7);
+    emitU32(b, (uint32_t)imm);
+}
+void emitPushImm(ByteBuf *b, int32_t imm) {
+    if (imm < -128 || imm > 127) { emitPushImm32(b, imm); return; }
+    // push imm8 (sign-extended to 64 bits) : 6A ib
+    emitU8(b, 0x6A);
+    emitU8(b, (uint8_t)(int8_t)imm);
+}
+void emitAluRegImm8(ByteBuf *b, AluOp op, Reg dst, int8_t imm) {
+    // <op> r/m64, imm8 (sign-extended) : 48 83 /op ib
+    int bb = (dst >> 3) & 1;
+    emitRexW(b, 0, 0, bb);
+    emitU8(b, 0x83);
+    emitModRm(b, 3, (int)op, dst & 7);
+    emitU8(b, (uint8_t)imm);
+}
+void emitAluRegImm(ByteBuf *b, AluOp op, Reg dst, int32_t imm) {
+    if (imm >= -128 && imm <= 127) emitAluRegImm8(b, op, dst, (int8_t)imm);
+    else emitAluRegImm32(b, op, dst, imm);
+}
+void emitAluRegMemDisp(ByteBuf *b, AluOp op, Reg dst, Reg base, int32_t disp) {
+    // <op> r64, [base+disp32] : 48 (op*8+3) /r
+    int r = (dst >> 3) & 1;
+    int bb = (base >> 3) & 1;
+    emitRexW(b, r, 0, bb);
+    emitU8(b, (uint8_t)((int)op * 8 + 3));
+    emitModRm(b, 2, dst & 7, base & 7);
+    if ((base & 7) == 4) emitSib(b, 1, 4, 4);
+    emitU32(b, (uint32_t)disp);
+}
+void emitIMulRegMemDisp(ByteBuf *b, Reg dst, Reg base, int32_t disp) {
+    // imul r64, [base+disp32] : 48 0F AF /r
+    int r = (dst >> 3) & 1;
+    int bb = (base >> 3) & 1;
+    emitRexW(b, r, 0, bb);
+    emitU8(b, 0x0F);
+    emitU8(b, 0xAF);
+    emitModRm(b, 2, dst & 7, base & 7);
+    if ((base & 7) == 4) emitSib(b, 1, 4, 4);
+    emitU32(b, (uint32_t)disp);
+}
+void emitIMulRegRegImm32(ByteBuf *b, Reg dst, Reg src, int32_t imm) {
+    // imul r64, r/m64, imm32 : 48 69 /r id
+    int r = (dst >> 3) & 1;
+    int bb = (src >> 3) & 1;
+    emitRexW(b, r, 0, bb);
+    emitU8(b, 0x69);
+    emitModRm(b, 3, dst & 7, src & 7);
+    emitU32(b, (uint32_t)imm);
+}
+void emitIMulRegRegImm(ByteBuf *b, Reg dst, Reg src, int32_t imm) {
+    if (imm < -128 || imm > 127) { emitIMulRegRegImm32(b, dst, src, imm); return; }
+    // imul r64, r/m64, imm8 : 48 6B /r ib
+    int r = (dst >> 3) & 1;
+    int bb = (src >> 3) & 1;
+    emitRexW(b, r, 0, bb);
+    emitU8(b, 0x6B);
+    emitModRm(b, 3, dst & 7, src & 7);
+    emitU8(b, (uint8_t)(int8_t)imm);
+}
+void emitIncReg(ByteBuf *b, Reg reg) {
+    // inc r/m64 : 48 FF /0
+    emitRexW(b, 0, 0, (reg >> 3) & 1);
+    emitU8(b, 0xFF);
+    emitModRm(b, 3, 0, reg & 7);
+}
+void emitDecReg(ByteBuf *b, Reg reg) {
+    // dec r/m64 : 48 FF /1
+    emitRexW(b, 0, 0, (reg >> 3) & 1);
+    emitU8(b, 0xFF);
+    emitModRm(b, 3, 1, reg & 7);
+}
+void emitNegReg(ByteBuf *b, Reg reg) {
+    // neg r/m64 : 48 F7 /3
+    emitRexW(b, 0, 0, (reg >> 3) & 1);
+    emitU8(b, 0xF7);
+    emitModRm(b, 3, 3, reg & 7);
+}
+void emitShiftRegImm(ByteBuf *b, ShiftOp op, Reg reg, uint8_t count) {
+    // <op> r/m64, 1 : 48 D1 /op    <op> r/m64, imm8 : 48 C1 /op ib
+    emitRexW(b, 0, 0, (reg >> 3) & 1);
+    emitU8(b, count == 1 ? 0xD1 : 0xC1);
+    emitModRm(b, 3, (int)op, reg & 7);
+    if (count != 1) emitU8(b, count);
+}
+void emitIMulRaxReg(ByteBuf *b, Reg src) {
+    // imul r/m64 : 48 F7 /5  (signed rdx:rax = rax * r/m64)
+    emitRexW(b, 0, 0, (src >> 3) & 1);
+    emitU8(b, 0xF7);
+    emitModRm(b, 3, 5, src & 7);
+}
+void emitMulRaxReg(ByteBuf *b, Reg src) {
+    // mul r/m64 : 48 F7 /4  (unsigned rdx:rax = rax * r/m64)
+    emitRexW(b, 0, 0, (src >> 3) & 1);
+    emitU8(b, 0xF7);
+    emitModRm(b, 3, 4, src & 7);
+}
+void emitLeaRegBaseIndexScale(ByteBuf *b, Reg dst, Reg base, Reg index, int scale) {
+    // lea r64, [base + index*scale] : 48 8D /r with SIB; rbp/r13 as base
+    // have no mod=00 form and take a zero disp8
+    int r = (dst >> 3) & 1;
+    int x = (index >> 3) & 1;
+    int bb = (base >> 3) & 1;
+    int needDisp = (base & 7) == 5;
+    emitRexW(b, r, x, bb);
+    emitU8(b, 0x8D);
+    emitModRm(b, needDisp ? 1 : 0, dst & 7, 4);
+    emitSib(b, scale, index & 7, base & 7);
+    if (needDisp) emitU8(b, 0);
+}
+void emitIDivMemDisp(ByteBuf *b, Reg base, int32_t disp) {
+    // idiv qword [base+disp32] : 48 F7 /7
+    int bb = (base >> 3) & 1;
+    emitRexW(b, 0, 0, bb);
+    emitU8(b, 0xF7);
+    emitModRm(b, 2, 7, base & 7);
+    if ((base & 7) == 4) emitSib(b, 1, 4, 4);
+    emitU32(b, (uint32_t)disp);
+}
 void emitAddRegReg(ByteBuf *b, Reg dst, Reg src) {
     // add r/m64, r64 : 48 01 /r (dst is r/m, src is reg)
     int r = (src >> 3) & 1;
@@ -182,6 +457,13 @@ void emitCallReg(ByteBuf *b, Reg reg) {
     emitU8(b, 0xFF);
     emitModRm(b, 3, 2, reg & 7);
 }
+void emitJmpReg(ByteBuf *b, Reg reg) {
+    // jmp r/m64 : FF /4
+    int bb = (reg >> 3) & 1;
+    if (bb) emitU8(b, rexByte(0,0,0,1));
+    emitU8(b, 0xFF);
+    emitModRm(b, 3, 4, reg & 7);
+}
 void emitRet(ByteBuf *b) { emitU8(b, 0xC3); }
 void emitLeave(ByteBuf *b) { emitU8(b, 0xC9); }
 void emitSubRspImm32(ByteBuf *b, uint32_t imm) {
@@ -191,6 +473,10 @@ void emitAddRspImm32(ByteBuf *b, uint32_t imm) {
     emitU8(b, 0x48); emitU8(b, 0x81); emitU8(b, 0xC4); emitU32(b, imm);
 }
 void emitSyscall(ByteBuf *b) { emitU8(b, 0x0F); emitU8(b, 0x05); }
+void emitRepMovsq(ByteBuf *b) { emitU8(b, 0xF3); emitU8(b, 0x48); emitU8(b, 0xA5); }
+void emitRepMovsb(ByteBuf *b) { emitU8(b, 0xF3); emitU8(b, 0xA4); }
+void emitRepStosq(ByteBuf *b) { emitU8(b, 0xF3); emitU8(b, 0x48); emitU8(b, 0xAB); }
+void emitSfence(ByteBuf *b) { emitU8(b, 0x0F); emitU8(b, 0xAE); emitU8(b, 0xF8); }
 
 size_t emitJmpRel32Placeholder(ByteBuf *b) {
     emitU8(b, 0xE9);
@@ -208,6 +494,140 @@ size_t emitJccRel32Placeholder(ByteBuf *b, uint8_t cc) {
 void patchRel32(ByteBuf *b, size_t atOffset, int32_t rel) {
     memcpy(&b[0].data[atOffset], &rel, 4);
 }
+// Recommended multi-byte NOP forms (0F 1F /0 with growing addressing).
+static const uint8_t nopForms[9][9] = {
+    { 0x90 },
+    { 0x66, 0x90 },
+    { 0x0F, 0x1F, 0x00 },
+    { 0x0F, 0x1F, 0x40, 0x00 },
+    { 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+    { 0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+    { 0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00 },
+    { 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    { 0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+};
+
+void emitNops(ByteBuf *b, size_t count) {
+    while (count) {
+        size_t n = count < 9 ? count : 9;
+        for (size_t i = 0; i < n; i++) emitU8(b, nopForms[n - 1][i]);
+        count -= n;
+    }
+}
+
+static size_t alignPad(size_t off, unsigned alignment) {
+    return alignment ? (size_t)((alignment - off % alignment) % alignment) : 0;
+}
+
+typedef struct {
+    size_t at;          // offset before relaxation
+    size_t oldLen;      // bytes before relaxation
+    size_t newLen;      // bytes in the current layout
+    int isAlign;        // NOP padding instead of a branch
+    size_t target;      // branch target before relaxation
+    int isJcc;
+    uint8_t cc;
+    int isShort;
+} RelaxItem;
+
+// Offset in the current layout of a pre-relaxation offset, given shift[k] =
+// growth caused by the first k items. An offset where padding starts is a
+// block start and lands after the padding.
+static size_t relaxedOffset(const RelaxItem *it, const int64_t *shift, int n, size_t off) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (it[mid].at < off || (it[mid].at == off && it[mid].isAlign)) lo = mid + 1; else hi = mid;
+    }
+    return (size_t)((int64_t)off + shift[lo]);
+}
+
+void relaxBranches(ByteBuf *b, size_t start, const size_t *sites, int count,
+                   PatchList *p, int patchStart, size_t **extra, int extraCount,
+                   const size_t *aligns, int alignCount, unsigned alignment) {
+    int n = count + alignCount;
+    if (n == 0) return;
+    RelaxItem *it = malloc(sizeof(RelaxItem) * (size_t)n);
+    int64_t *shift = malloc(sizeof(int64_t) * (size_t)(n + 1));
+    // merge branch sites and padding in offset order, padding first on ties
+    for (int i = 0, j = 0, k = 0; k < n; k++) {
+        RelaxItem *x = &it[k];
+        memset(x, 0, sizeof(*x));
+        if (j < alignCount && (i == count || aligns[j] <= sites[i])) {
+            x[0].at = aligns[j++];
+            x[0].isAlign = 1;
+            x[0].oldLen = alignPad(x[0].at, alignment);
+            continue;
+        }
+        uint8_t *op = &b[0].data[sites[i]];
+        int32_t rel;
+        x[0].at = sites[i++];
+        x[0].isJcc = op[0] == 0x0F;
+        x[0].cc = (uint8_t)(op[1] & 0x0F);
+        x[0].oldLen = x[0].isJcc ? 6 : 5;
+        memcpy(&rel, op + (x[0].isJcc ? 2 : 1), 4);
+        x[0].target = (size_t)((int64_t)(x[0].at + x[0].oldLen) + rel);
+        x[0].isShort = 1;
+    }
+    // Start with every branch short and lengthen the ones that do not reach.
+    // Branches only ever get longer, so this terminates; padding is redone
+    // from the current positions on every round.
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        shift[0] = 0;
+        for (int k = 0; k < n; k++) {
+            RelaxItem *x = &it[k];
+            if (x[0].isAlign) x[0].newLen = alignPad((size_t)((int64_t)x[0].at + shift[k]), alignment);
+            else x[0].newLen = x[0].isShort ? 2 : x[0].oldLen;
+            shift[k + 1] = shift[k] + (int64_t)x[0].newLen - (int64_t)x[0].oldLen;
+        }
+        for (int k = 0; k < n; k++) {
+            if (it[k].isAlign || !it[k].isShort) continue;
+            int64_t from = (int64_t)it[k].at + shift[k] + 2;
+            int64_t disp = (int64_t)relaxedOffset(it, shift, n, it[k].target) - from;
+            if (disp < -128 || disp > 127) { it[k].isShort = 0; changed = 1; }
+        }
+    }
+
+    ByteBuf out;
+    byteBufInit(&out);
+    byteBufReserve(&out, b[0].size - start);
+    size_t pos = start;
+    for (int k = 0; k < n; k++) {
+        RelaxItem *x = &it[k];
+        for (; pos < x[0].at; pos++) emitU8(&out, b[0].data[pos]);
+        pos = x[0].at + x[0].oldLen;
+        if (x[0].isAlign) { emitNops(&out, x[0].newLen); continue; }
+        size_t here = start + out.size;
+        int64_t target = (int64_t)relaxedOffset(it, shift, n, x[0].target);
+        if (x[0].isShort) {
+            emitU8(&out, x[0].isJcc ? (uint8_t)(0x70 | x[0].cc) : 0xEB);
+            emitU8(&out, (uint8_t)(int8_t)(target - (int64_t)(here + 2)));
+        } else {
+            if (x[0].isJcc) { emitU8(&out, 0x0F); emitU8(&out, (uint8_t)(0x80 | x[0].cc)); }
+            else emitU8(&out, 0xE9);
+            emitU32(&out, (uint32_t)(int32_t)(target - (int64_t)(here + x[0].oldLen)));
+        }
+    }
+    for (; pos < b[0].size; pos++) emitU8(&out, b[0].data[pos]);
+
+    for (int i = patchStart; i < p[0].count; i++) {
+        if (p[0].items[i].seg == SEG_TEXT && p[0].items[i].offset >= start) {
+            p[0].items[i].offset = relaxedOffset(it, shift, n, p[0].items[i].offset);
+        }
+    }
+    for (int i = 0; i < extraCount; i++) extra[i][0] = relaxedOffset(it, shift, n, extra[i][0]);
+    // padding can grow, so the result is not always shorter
+    b[0].size = start;
+    ensureCap(b, out.size);
+    memcpy(&b[0].data[start], out.data, out.size);
+    b[0].size = start + out.size;
+    byteBufFree(&out);
+    free(shift);
+    free(it);
+}
+
 void emitCmpRegImm8(ByteBuf *b, Reg reg, uint8_t imm) {
     // cmp r/m64, imm8 : 48 83 /7 ib
     int bb = (reg >> 3) & 1;
@@ -248,3 +668,112 @@ void emitMovzxRaxAl(ByteBuf *b) {
     emitU8(b, 0xC0);
 }
 
+
+// SSE2: prefix [REX] 0F opcode /r
+static void emitSsePrefix(ByteBuf *b, uint8_t prefix, int w, int r, int x, int bb, uint8_t opcode) {
+    emitU8(b, prefix);
+    if (w || r || x || bb) emitU8(b, rexByte(w, r, x, bb));
+    emitU8(b, 0x0F);
+    emitU8(b, opcode);
+}
+
+// 3-byte VEX: C4 [R X B map] [W vvvv L pp], the register fields inverted
+static void emitVex(ByteBuf *b, int r, int x, int bb, int map, int w, int vvvv, int wide, int pp) {
+    emitU8(b, 0xC4);
+    emitU8(b, (uint8_t)((r ? 0 : 0x80) | (x ? 0 : 0x40) | (bb ? 0 : 0x20) | map));
+    emitU8(b, (uint8_t)((w ? 0x80 : 0) | ((~vvvv & 15) << 3) | (wide ? 4 : 0) | pp));
+}
+
+void emitPackedXmmXmm(ByteBuf *b, PackedOp op, int dst, int src) {
+    // 66 [REX] 0F op /r
+    emitSsePrefix(b, 0x66, 0, (dst >> 3) & 1, 0, (src >> 3) & 1, (uint8_t)op);
+    emitModRm(b, 3, dst & 7, src & 7);
+}
+void emitMovdqaXmmXmm(ByteBuf *b, int dst, int src) {
+    // movdqa xmm, xmm : 66 0F 6F /r
+    emitSsePrefix(b, 0x66, 0, (dst >> 3) & 1, 0, (src >> 3) & 1, 0x6F);
+    emitModRm(b, 3, dst & 7, src & 7);
+}
+void emitPshufdXmmXmm(ByteBuf *b, int dst, int src, uint8_t order) {
+    // pshufd xmm, xmm, imm8 : 66 0F 70 /r ib
+    emitSsePrefix(b, 0x66, 0, (dst >> 3) & 1, 0, (src >> 3) & 1, 0x70);
+    emitModRm(b, 3, dst & 7, src & 7);
+    emitU8(b, order);
+}
+void emitPmovmskbRegXmm(ByteBuf *b, Reg dst, int src) {
+    // pmovmskb r32, xmm : 66 0F D7 /r
+    emitSsePrefix(b, 0x66, 0, (dst >> 3) & 1, 0, (src >> 3) & 1, 0xD7);
+    emitModRm(b, 3, dst & 7, src & 7);
+}
+void emitMovqXmmReg(ByteBuf *b, int dst, Reg src) {
+    // movq xmm, r64 : 66 REX.W 0F 6E /r
+    emitSsePrefix(b, 0x66, 1, (dst >> 3) & 1, 0, (src >> 3) & 1, 0x6E);
+    emitModRm(b, 3, dst & 7, src & 7);
+}
+void emitMovqRegXmm(ByteBuf *b, Reg dst, int src) {
+    // movq r64, xmm : 66 REX.W 0F 7E /r
+    emitSsePrefix(b, 0x66, 1, (src >> 3) & 1, 0, (dst >> 3) & 1, 0x7E);
+    emitModRm(b, 3, src & 7, dst & 7);
+}
+void emitMovdquXmmAbsIndex(ByteBuf *b, PatchList *p, int dst, int base, Reg index, const char *symbolName, int64_t addend) {
+    // movdqu xmm, m128 : F3 0F 6F /r
+    emitSsePrefix(b, 0xF3, 0, (dst >> 3) & 1, (index >> 3) & 1, base < 0 ? 0 : (base >> 3) & 1, 0x6F);
+    emitAbsBaseIndexOperand(b, p, dst, base, index, symbolName, addend);
+}
+void emitMovdquAbsIndexXmm(ByteBuf *b, PatchList *p, int base, Reg index, const char *symbolName, int64_t addend, int src) {
+    // movdqu m128, xmm : F3 0F 7F /r
+    emitSsePrefix(b, 0xF3, 0, (src >> 3) & 1, (index >> 3) & 1, base < 0 ? 0 : (base >> 3) & 1, 0x7F);
+    emitAbsBaseIndexOperand(b, p, src, base, index, symbolName, addend);
+}
+
+void emitVPacked(ByteBuf *b, PackedOp op, int wide, int dst, int left, int right) {
+    // VEX.NDS.{128,256}.66.0F op /r
+    emitVex(b, (dst >> 3) & 1, 0, (right >> 3) & 1, 1, 0, left, wide, 1);
+    emitU8(b, (uint8_t)op);
+    emitModRm(b, 3, dst & 7, right & 7);
+}
+void emitVpshufdXmmXmm(ByteBuf *b, int dst, int src, uint8_t order) {
+    // vpshufd xmm, xmm, imm8 : VEX.128.66.0F 70 /r ib
+    emitVex(b, (dst >> 3) & 1, 0, (src >> 3) & 1, 1, 0, 0, 0, 1);
+    emitU8(b, 0x70);
+    emitModRm(b, 3, dst & 7, src & 7);
+    emitU8(b, order);
+}
+void emitVmovqXmmReg(ByteBuf *b, int dst, Reg src) {
+    // vmovq xmm, r64 : VEX.128.66.0F.W1 6E /r
+    emitVex(b, (dst >> 3) & 1, 0, (src >> 3) & 1, 1, 1, 0, 0, 1);
+    emitU8(b, 0x6E);
+    emitModRm(b, 3, dst & 7, src & 7);
+}
+void emitVmovqRegXmm(ByteBuf *b, Reg dst, int src) {
+    // vmovq r64, xmm : VEX.128.66.0F.W1 7E /r
+    emitVex(b, (src >> 3) & 1, 0, (dst >> 3) & 1, 1, 1, 0, 0, 1);
+    emitU8(b, 0x7E);
+    emitModRm(b, 3, src & 7, dst & 7);
+}
+void emitVpbroadcastqYmmXmm(ByteBuf *b, int dst, int src) {
+    // vpbroadcastq ymm, xmm : VEX.256.66.0F38.W0 59 /r
+    emitVex(b, (dst >> 3) & 1, 0, (src >> 3) & 1, 2, 0, 0, 1, 1);
+    emitU8(b, 0x59);
+    emitModRm(b, 3, dst & 7, src & 7);
+}
+void emitVextracti128XmmYmm(ByteBuf *b, int dst, int src, uint8_t half) {
+    // vextracti128 xmm, ymm, imm8 : VEX.256.66.0F3A.W0 39 /r ib (ymm is reg)
+    emitVex(b, (src >> 3) & 1, 0, (dst >> 3) & 1, 3, 0, 0, 1, 1);
+    emitU8(b, 0x39);
+    emitModRm(b, 3, src & 7, dst & 7);
+    emitU8(b, half);
+}
+void emitVmovdquYmmAbsIndex(ByteBuf *b, PatchList *p, int dst, int base, Reg index, const char *symbolName, int64_t addend) {
+    // vmovdqu ymm, m256 : VEX.256.F3.0F 6F /r
+    emitVex(b, (dst >> 3) & 1, (index >> 3) & 1, base < 0 ? 0 : (base >> 3) & 1, 1, 0, 0, 1, 2);
+    emitU8(b, 0x6F);
+    emitAbsBaseIndexOperand(b, p, dst, base, index, symbolName, addend);
+}
+void emitVmovdquAbsIndexYmm(ByteBuf *b, PatchList *p, int base, Reg index, const char *symbolName, int64_t addend, int src) {
+    // vmovdqu m256, ymm : VEX.256.F3.0F 7F /r
+    emitVex(b, (src >> 3) & 1, (index >> 3) & 1, base < 0 ? 0 : (base >> 3) & 1, 1, 0, 0, 1, 2);
+    emitU8(b, 0x7F);
+    emitAbsBaseIndexOperand(b, p, src, base, index, symbolName, addend);
+}
+void emitVzeroupper(ByteBuf *b) { emitU8(b, 0xC5); emitU8(b, 0xF8); emitU8(b, 0x77); }
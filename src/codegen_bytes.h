@@ -23,6 +23,23 @@ typedef enum {
     REG_R15 = 15
 } Reg;
 
+// /digit of the 0x81 (reg, imm32) group; also selects the (reg, r/m) opcode
+typedef enum {
+    ALU_ADD = 0,
+    ALU_OR  = 1,
+    ALU_AND = 4,
+    ALU_SUB = 5,
+    ALU_XOR = 6,
+    ALU_CMP = 7
+} AluOp;
+
+// /digit of the 0xC1 (reg, imm8) shift group
+typedef enum {
+    SHIFT_SHL = 4,
+    SHIFT_SHR = 5,
+    SHIFT_SAR = 7
+} ShiftOp;
+
 typedef struct {
     uint8_t *data;
     size_t size;
@@ -31,9 +48,15 @@ typedef struct {
 
 typedef enum { SEG_TEXT = 0, SEG_DATA = 1 } Segment;
 
+// What a patch writes at its offset, with S = symbol + addend:
+// ABS64: S as 8 bytes; ABS32: S as 4 bytes (must fit a sign-extended imm32
+// or disp32); REL32: S - (address of the field + 4), for call rel32.
+typedef enum { PATCH_ABS64, PATCH_ABS32, PATCH_REL32 } PatchKind;
+
 typedef struct {
+    PatchKind kind;
     Segment seg;
-    size_t offset;      // offset within segment where imm64 starts
+    size_t offset;      // offset within segment where the field starts
     char *symbolName;   // owned
     int64_t addend;
 } Patch;
@@ -63,7 +86,8 @@ void emitU32(ByteBuf *b, uint32_t v);
 void emitU64(ByteBuf *b, uint64_t v);
 void patchListInit(PatchList *p);
 void patchListFree(PatchList *p);
-void addPatch(PatchList *p, Segment seg, size_t offset, const char *symbolName, int64_t addend);
+void addPatch(PatchList *p, Segment seg, size_t offset, const char *symbolName, int64_t addend);  // ABS64
+void addPatchKind(PatchList *p, PatchKind kind, Segment seg, size_t offset, const char *symbolName, int64_t addend);
 
 void symbolTableInit(SymbolTable *t);
 void symbolTableFree(SymbolTable *t);
@@ -75,31 +99,115 @@ void emitPushReg(ByteBuf *b, Reg reg);
 void emitPopReg(ByteBuf *b, Reg reg);
 void emitMovRegReg(ByteBuf *b, Reg dst, Reg src);
 void emitMovRegImm64(ByteBuf *b, Reg dst, uint64_t imm);
+void emitMovRegImm(ByteBuf *b, Reg dst, int64_t imm);   // shortest form; imm == 0 clobbers flags
+void emitXorReg32(ByteBuf *b, Reg dst);
+void emitMovReg32Imm32(ByteBuf *b, Reg dst, uint32_t imm);
+void emitMovRegSImm32(ByteBuf *b, Reg dst, int32_t imm);
 size_t emitMovRegImm64Patch(ByteBuf *b, PatchList *p, Segment seg, Reg dst, const char *symbolName, int64_t addend);
+void emitMovReg32Imm32Patch(ByteBuf *b, PatchList *p, Reg dst, const char *symbolName, int64_t addend);
+void emitCallRel32Patch(ByteBuf *b, PatchList *p, const char *symbolName);
+void emitJmpRel32Patch(ByteBuf *b, PatchList *p, const char *symbolName);      // tail call
+// [index*scale + symbol + addend] with no base register (index < 0: no index
+// either); the disp32 gets an ABS32 patch.
+void emitMovRegAbsIndex(ByteBuf *b, PatchList *p, Reg dst, int index, int scale, const char *symbolName, int64_t addend);
+void emitMovAbsIndexReg(ByteBuf *b, PatchList *p, int index, int scale, const char *symbolName, int64_t addend, Reg src);
+void emitMovAbsIndexImm32(ByteBuf *b, PatchList *p, int index, int scale, const char *symbolName, int64_t addend, int32_t imm);
+void emitMovzxRegWordAbsIndex(ByteBuf *b, PatchList *p, Reg dst, int index, int scale, const char *symbolName, int64_t addend);
+void emitLeaRegAbsIndex(ByteBuf *b, PatchList *p, Reg dst, int index, int scale, const char *symbolName, int64_t addend);
+void emitMovntiAbsIndexReg(ByteBuf *b, PatchList *p, int index, int scale, const char *symbolName, int64_t addend, Reg src);
+void emitAluAbsIndexReg(ByteBuf *b, PatchList *p, AluOp op, int index, int scale, const char *symbolName, int64_t addend, Reg src);
+void emitAluAbsIndexImm(ByteBuf *b, PatchList *p, AluOp op, int index, int scale, const char *symbolName, int64_t addend, int32_t imm);
 void emitMovRegMemDisp(ByteBuf *b, Reg dst, Reg base, int32_t disp);
 void emitMovMemDispReg(ByteBuf *b, Reg base, int32_t disp, Reg src);
+void emitLeaRegMemDisp(ByteBuf *b, Reg dst, Reg base, int32_t disp);
 void emitLeaRegBaseIndexScaleDisp(ByteBuf *b, Reg dst, Reg base, Reg index, int scale, int32_t disp);
+void emitMovMemDispImm32(ByteBuf *b, Reg base, int32_t disp, int32_t imm);
+void emitPushImm32(ByteBuf *b, int32_t imm);
+void emitPushImm(ByteBuf *b, int32_t imm);               // imm8 form when it fits
+void emitAluRegImm32(ByteBuf *b, AluOp op, Reg dst, int32_t imm);
+void emitAluRegImm8(ByteBuf *b, AluOp op, Reg dst, int8_t imm);
+void emitAluRegImm(ByteBuf *b, AluOp op, Reg dst, int32_t imm);   // imm8 form when it fits
+void emitAluRegMemDisp(ByteBuf *b, AluOp op, Reg dst, Reg base, int32_t disp);
+void emitIMulRegMemDisp(ByteBuf *b, Reg dst, Reg base, int32_t disp);
+void emitIMulRegRegImm32(ByteBuf *b, Reg dst, Reg src, int32_t imm);
+void emitIMulRegRegImm(ByteBuf *b, Reg dst, Reg src, int32_t imm);  // imm8 form when it fits
+void emitIncReg(ByteBuf *b, Reg reg);
+void emitDecReg(ByteBuf *b, Reg reg);
+void emitNegReg(ByteBuf *b, Reg reg);
+void emitShiftRegImm(ByteBuf *b, ShiftOp op, Reg reg, uint8_t count);
+void emitIMulRaxReg(ByteBuf *b, Reg src);                       // rdx:rax = rax * src
+void emitMulRaxReg(ByteBuf *b, Reg src);                        // unsigned rdx:rax = rax * src
+void emitLeaRegBaseIndexScale(ByteBuf *b, Reg dst, Reg base, Reg index, int scale);  // no disp when possible
+void emitIDivMemDisp(ByteBuf *b, Reg base, int32_t disp);
 void emitAddRegReg(ByteBuf *b, Reg dst, Reg src);
 void emitSubRegReg(ByteBuf *b, Reg dst, Reg src);
 void emitIMulRegReg(ByteBuf *b, Reg dst, Reg src);
 void emitCqo(ByteBuf *b);
 void emitIDivReg(ByteBuf *b, Reg divisor);
 void emitCallReg(ByteBuf *b, Reg reg);
+void emitJmpReg(ByteBuf *b, Reg reg);
 void emitRet(ByteBuf *b);
 void emitLeave(ByteBuf *b);
 void emitSubRspImm32(ByteBuf *b, uint32_t imm);
 void emitAddRspImm32(ByteBuf *b, uint32_t imm);
 void emitSyscall(ByteBuf *b);
+void emitRepMovsq(ByteBuf *b);     // rcx qwords from [rsi] to [rdi]
+void emitRepMovsb(ByteBuf *b);     // rcx bytes from [rsi] to [rdi]
+void emitRepStosq(ByteBuf *b);     // rcx copies of rax to [rdi]
+void emitSfence(ByteBuf *b);
 
 // branching helpers for runtime
 size_t emitJmpRel32Placeholder(ByteBuf *b);
 void patchRel32(ByteBuf *b, size_t atOffset, int32_t rel);
 size_t emitJccRel32Placeholder(ByteBuf *b, uint8_t cc);
+// Branch relaxation: rewrites the rel32 jmp/jcc instructions whose opcodes
+// start at sites[0..count) (ascending, already patched, with targets inside
+// [start, b->size]) into the 2-byte rel8 forms wherever the target is in
+// range, iterating to a fixed point. aligns[0..alignCount) (ascending) are
+// offsets where NOP padding up to a multiple of alignment was emitted; the
+// padding is recomputed for the final layout. Text patches from index
+// patchStart on and the offsets pointed to by extra[] move along with the code.
+void relaxBranches(ByteBuf *b, size_t start, const size_t *sites, int count,
+                   PatchList *p, int patchStart, size_t **extra, int extraCount,
+                   const size_t *aligns, int alignCount, unsigned alignment);
+void emitNops(ByteBuf *b, size_t count);        // multi-byte NOP forms
 void emitCmpRegImm8(ByteBuf *b, Reg reg, uint8_t imm);
 void emitTestRegReg(ByteBuf *b, Reg a, Reg bReg);
 void emitCmpRegReg(ByteBuf *b, Reg left, Reg right);
 void emitSetccAl(ByteBuf *b, uint8_t cc);
 void emitMovzxRaxAl(ByteBuf *b);
 
+// Vector encoders. xmm/ymm registers are numbered 0-15; memory operands are
+// [base + index*8 + disp32] with the disp32 patched to symbol + addend
+// (base < 0: none).
+// packed op, as the 66 0F xx opcode shared by the SSE2 and VEX forms
+typedef enum {
+    PACKED_PUNPCKLQDQ = 0x6C,
+    PACKED_PCMPEQD = 0x76,
+    PACKED_PADDQ = 0xD4,
+    PACKED_PAND = 0xDB,
+    PACKED_PXOR = 0xEF,
+    PACKED_PSUBQ = 0xFB
+} PackedOp;
+
+void emitPackedXmmXmm(ByteBuf *b, PackedOp op, int dst, int src);     // SSE2: dst = dst op src
+void emitMovdqaXmmXmm(ByteBuf *b, int dst, int src);
+void emitPshufdXmmXmm(ByteBuf *b, int dst, int src, uint8_t order);
+void emitPmovmskbRegXmm(ByteBuf *b, Reg dst, int src);
+void emitMovqXmmReg(ByteBuf *b, int dst, Reg src);
+void emitMovqRegXmm(ByteBuf *b, Reg dst, int src);
+void emitMovdquXmmAbsIndex(ByteBuf *b, PatchList *p, int dst, int base, Reg index, const char *symbolName, int64_t addend);
+void emitMovdquAbsIndexXmm(ByteBuf *b, PatchList *p, int base, Reg index, const char *symbolName, int64_t addend, int src);
+// AVX/AVX2 (VEX): dst = left op right, on ymm when wide, else xmm
+void emitVPacked(ByteBuf *b, PackedOp op, int wide, int dst, int left, int right);
+void emitVpshufdXmmXmm(ByteBuf *b, int dst, int src, uint8_t order);
+void emitVmovqXmmReg(ByteBuf *b, int dst, Reg src);
+void emitVmovqRegXmm(ByteBuf *b, Reg dst, int src);
+void emitVpbroadcastqYmmXmm(ByteBuf *b, int dst, int src);
+void emitVextracti128XmmYmm(ByteBuf *b, int dst, int src, uint8_t half);
+void emitVmovdquYmmAbsIndex(ByteBuf *b, PatchList *p, int dst, int base, Reg index, const char *symbolName, int64_t addend);
+void emitVmovdquAbsIndexYmm(ByteBuf *b, PatchList *p, int base, Reg index, const char *symbolName, int64_t addend, int src);
+void emitVzeroupper(ByteBuf *b);
+
 #endif
 
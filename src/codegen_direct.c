@@ -1,404 +1,1068 @@
 #include "codegen_direct.h"
 #include "codegen_bytes.h"
 #include "runtime_bytes.h"
+#include "profile.h"
+#include "layout.h"
+#include "regalloc.h"
 #include "elf.h"
 #include "utils.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
-typedef struct VarNode {
-    char *name;
-    int index;
-    struct VarNode *next;
-} VarNode;
+// Emits x86-64 bytes for the SSA IR after phis have been replaced by copies
+// (irDestructSsa) and values have been assigned registers (regalloc.h).
+// Frame layout below rbp:
+//   [rbp-8*(i+1)]                      frame slot i of an address-taken local
+//   [rbp-8*(slotCount+s+1)]            spill slot s
+//   after the spill slots              save area for callee-saved registers
+// With -fomit-frame-pointer the same layout hangs off the address rbp would
+// have, and every [rbp+disp] becomes [rsp+disp+frameBias] (frameDisp), where
+// frameBias follows the pushes of stack arguments. Leaf functions then keep
+// the frame in the red zone below rsp, and functions whose frame is empty
+// without calls or stack parameters get no prologue in either mode.
+// rax, rdx, r10 and r11 are never allocated and serve as scratch. Small
+// constants have no location and are folded into the instructions that use
+// them as imm32 operands; spilled values are used as [rbp+disp] operands.
 
-typedef struct FnSigNode {
-    char *name;
-    int paramCount;
-    struct FnSigNode *next;
-} FnSigNode;
+typedef struct {
+    size_t at;      // offset of the rel32 field
+    int block;      // target block id
+} BlockFixup;
 
-static FnSigNode *fnSigList = NULL;
-static int maxParamCount = 0;
+// Last emitted move, remembered by the peephole in emitMove/emitSpillLoad/
+// emitSpillStore. It only counts while nothing else was emitted after it.
+typedef enum { LAST_NONE, LAST_MOV, LAST_LOAD, LAST_STORE } LastMoveKind;
 
-static void addFnSig(const char *name, int paramCount) {
-    FnSigNode *n = malloc(sizeof(FnSigNode));
-    n[0].name = strDup(name);
-    n[0].paramCount = paramCount;
-    n[0].next = fnSigList;
-    fnSigList = n;
-    if (paramCount > maxParamCount) maxParamCount = paramCount;
+typedef struct {
+    LastMoveKind kind;
+    size_t end;     // text size right after the move
+    Reg reg;        // MOV: dst; LOAD: dst; STORE: src
+    Reg src;        // MOV: src
+    int32_t disp;   // LOAD/STORE: [rbp+disp]
+} LastMove;
+
+typedef struct {
+    ByteBuf *text;
+    PatchList *patches;
+    IrFunction *fn;
+    const CodegenOptions *opts;
+    LastMove last;
+    RegAlloc ra;
+    IrInst **defs;  // defining instruction per value
+    int *useCount;  // per value
+    int saveBase;   // first slot of the callee-saved save area
+    Reg frameBase;  // rbp, or rsp with the frame pointer omitted
+    int32_t frameBias;  // [rbp+disp] is [frameBase+disp+frameBias]
+    uint32_t frameSize; // rsp adjustment of the prologue (frameless: 0)
+    int hasFrame;   // rbp mode: push rbp/mov rbp, rsp ... leave
+    size_t *blockOffsets;
+    BlockFixup *fixups;
+    int fixupCount;
+    int fixupCap;
+} FnGen;
+
+// A move into a register: from srcReg, or else from value srcValue (when
+// >= 0) or [rbp+srcDisp].
+typedef struct {
+    Reg dst;
+    int srcReg;
+    int srcValue;
+    int32_t srcDisp;
+} RegMove;
+
+// Where an instruction operand lives.
+typedef enum { OPND_REG, OPND_MEM, OPND_IMM } OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    Reg reg;        // OPND_REG
+    int32_t disp;   // OPND_MEM: [rbp+disp]
+    int32_t imm;    // OPND_IMM
+} Operand;
+
+static const Reg argRegs[6] = { REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9 };
+static const Reg calleeSaved[5] = { REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15 };
+
+static int32_t frameDisp(FnGen *g, int32_t disp) { return disp + g[0].frameBias; }
+
+// rsp moved down by bytes (negative: up) inside the function body
+static void noteRspMove(FnGen *g, int32_t bytes) {
+    if (g[0].frameBase == REG_RSP) g[0].frameBias += bytes;
 }
 
-static int findFnParamCount(const char *name, int *outCount) {
-    for (FnSigNode *p = fnSigList; p; p = p[0].next) {
-        if (strcmp(p[0].name, name) == 0) { outCount[0] = p[0].paramCount; return 1; }
-    }
-    return 0;
+static int lastIs(FnGen *g, LastMoveKind kind) {
+    return g[0].last.kind == kind && g[0].last.end == g[0].text[0].size;
 }
 
-static int findVarIndex(VarNode *vars, const char *name) {
-    for (VarNode *p = vars; p; p = p[0].next) {
-        if (strcmp(p[0].name, name) == 0) return p[0].index;
-    }
-    return -1;
+static void setLast(FnGen *g, LastMoveKind kind, Reg reg, Reg src, int32_t disp) {
+    g[0].last.kind = kind;
+    g[0].last.end = g[0].text[0].size;
+    g[0].last.reg = reg;
+    g[0].last.src = src;
+    g[0].last.disp = disp;
 }
 
-static void addVarNode(VarNode **vars, const char *name, int index) {
-    VarNode *n = malloc(sizeof(VarNode));
-    n[0].name = strDup(name);
-    n[0].index = index;
-    n[0].next = vars[0];
-    vars[0] = n;
+// mov dst, src; dropped when it is a no-op or undoes the previous move
+static void emitMove(FnGen *g, Reg dst, Reg src) {
+    if (dst == src) return;
+    if (lastIs(g, LAST_MOV) && g[0].last.reg == src && g[0].last.src == dst) return;
+    emitMovRegReg(g[0].text, dst, src);
+    setLast(g, LAST_MOV, dst, src, 0);
 }
 
-static void emitLoadLocal(ByteBuf *text, int varIndex) {
-    int32_t disp = -(int32_t)(8 * (varIndex + 1));
-    emitMovRegMemDisp(text, REG_RAX, REG_RBP, disp);
+// mov dst, [rbp+disp]; reuses the register just stored there
+static void emitSpillLoad(FnGen *g, Reg dst, int32_t disp) {
+    if (lastIs(g, LAST_STORE) && g[0].last.disp == disp) {
+        emitMove(g, dst, g[0].last.reg);
+        return;
+    }
+    emitMovRegMemDisp(g[0].text, dst, g[0].frameBase, frameDisp(g, disp));
+    setLast(g, LAST_LOAD, dst, dst, disp);
 }
 
-static void emitStoreLocal(ByteBuf *text, int varIndex) {
-    int32_t disp = -(int32_t)(8 * (varIndex + 1));
-    emitMovMemDispReg(text, REG_RBP, disp, REG_RAX);
+// mov [rbp+disp], src; dropped when src was just loaded from there
+static void emitSpillStore(FnGen *g, int32_t disp, Reg src) {
+    if ((lastIs(g, LAST_LOAD) || lastIs(g, LAST_STORE)) && g[0].last.disp == disp && g[0].last.reg == src) return;
+    emitMovMemDispReg(g[0].text, g[0].frameBase, frameDisp(g, disp), src);
+    setLast(g, LAST_STORE, src, src, disp);
 }
 
-static void genExpr(ByteBuf *text, PatchList *patches, Expr *e, VarNode *locals);
+static int32_t slotDisp(int slot) { return -(int32_t)(8 * (slot + 1)); }
 
-static void genMemLoad(ByteBuf *text, PatchList *patches, Expr *indexExpr, VarNode *locals) {
-    genExpr(text, patches, indexExpr, locals);          // rax = index
-    emitMovRegImm64Patch(text, patches, SEG_TEXT, REG_R10, "mem", 0); // r10 = &mem
-    emitMovRegMemDisp(text, REG_R10, REG_R10, 0);       // r10 = mem base
-    emitLeaRegBaseIndexScaleDisp(text, REG_R11, REG_R10, REG_RAX, 8, 0); // r11 = base + index*8
-    emitMovRegMemDisp(text, REG_RAX, REG_R11, 0);       // rax = *(r11)
-}
+static int32_t spillDisp(FnGen *g, int v) { return slotDisp(g[0].fn[0].slotCount + g[0].ra.spillSlot[v]); }
+
+static int valueReg(FnGen *g, int v) { return g[0].ra.regOf[v]; }
 
-static void genMemStore(ByteBuf *text, PatchList *patches, Expr *indexExpr, Expr *valueExpr, VarNode *locals) {
-    genExpr(text, patches, indexExpr, locals);          // rax = index
-    emitPushReg(text, REG_RAX);
-    genExpr(text, patches, valueExpr, locals);          // rax = value
-    emitMovRegReg(text, REG_R11, REG_RAX);              // r11 = value
-    emitPopReg(text, REG_RAX);                          // rax = index
-    emitMovRegImm64Patch(text, patches, SEG_TEXT, REG_R10, "mem", 0); // r10 = &mem
-    emitMovRegMemDisp(text, REG_R10, REG_R10, 0);       // r10 = mem base
-    emitLeaRegBaseIndexScaleDisp(text, REG_R10, REG_R10, REG_RAX, 8, 0); // r10 = base + index*8
-    emitMovMemDispReg(text, REG_R10, 0, REG_R11);
-    emitMovRegImm64(text, REG_RAX, 0);
+static int valueIsImm(FnGen *g, int v) { return g[0].ra.remat[v]; }
+
+static int32_t valueImm(FnGen *g, int v) { return (int32_t)g[0].defs[v][0].imm; }
+
+static int valueDead(FnGen *g, int v) {
+    return g[0].ra.regOf[v] < 0 && g[0].ra.spillSlot[v] < 0 && !g[0].ra.remat[v];
 }
 
-static void genIndexLoad(ByteBuf *text, PatchList *patches, Expr *baseExpr, Expr *indexExpr, VarNode *locals) {
-    genExpr(text, patches, baseExpr, locals); // rax = base
-    emitPushReg(text, REG_RAX);
-    genExpr(text, patches, indexExpr, locals); // rax = index
-    emitPopReg(text, REG_R10); // r10 = base
-    emitLeaRegBaseIndexScaleDisp(text, REG_R11, REG_R10, REG_RAX, 8, 0);
-    emitMovRegMemDisp(text, REG_RAX, REG_R11, 0);
+static Operand valueOperand(FnGen *g, int v) {
+    Operand o;
+    memset(&o, 0, sizeof(o));
+    if (valueReg(g, v) >= 0) {
+        o.kind = OPND_REG;
+        o.reg = (Reg)valueReg(g, v);
+    } else if (valueIsImm(g, v)) {
+        o.kind = OPND_IMM;
+        o.imm = valueImm(g, v);
+    } else {
+        o.kind = OPND_MEM;
+        o.disp = spillDisp(g, v);
+    }
+    return o;
 }
 
-static void genIndexStore(ByteBuf *text, PatchList *patches, Expr *baseExpr, Expr *indexExpr, Expr *valueExpr, VarNode *locals) {
-    genExpr(text, patches, baseExpr, locals); // rax = base
-    emitPushReg(text, REG_RAX);
-    genExpr(text, patches, indexExpr, locals); // rax = index
-    emitPushReg(text, REG_RAX);
-    genExpr(text, patches, valueExpr, locals); // rax = value
-    emitMovRegReg(text, REG_R11, REG_RAX); // r11 = value
-    emitPopReg(text, REG_RAX); // rax = index
-    emitPopReg(text, REG_R10); // r10 = base
-    emitLeaRegBaseIndexScaleDisp(text, REG_R10, REG_R10, REG_RAX, 8, 0);
-    emitMovMemDispReg(text, REG_R10, 0, REG_R11);
-    emitMovRegImm64(text, REG_RAX, 0);
-}
-
-static void genBinOp(ByteBuf *text, PatchList *patches, Expr *e, VarNode *locals) {
-    genExpr(text, patches, e[0].binop.left, locals);
-    emitPushReg(text, REG_RAX);
-    genExpr(text, patches, e[0].binop.right, locals);
-    emitPopReg(text, REG_R11); // left
-    BinOpKind op = e[0].binop.op;
-    if (op == BIN_ADD) {
-        emitAddRegReg(text, REG_RAX, REG_R11);
+static void loadValue(FnGen *g, Reg dst, int v) {
+    int r = valueReg(g, v);
+    if (r >= 0) {
+        emitMove(g, dst, (Reg)r);
         return;
     }
-    if (op == BIN_MUL) {
-        emitIMulRegReg(text, REG_RAX, REG_R11);
+    if (valueIsImm(g, v)) {
+        emitMovRegImm(g[0].text, dst, valueImm(g, v));
         return;
     }
-    if (op == BIN_SUB) {
-        emitMovRegReg(text, REG_R10, REG_R11);
-        emitSubRegReg(text, REG_R10, REG_RAX);
-        emitMovRegReg(text, REG_RAX, REG_R10);
+    emitSpillLoad(g, dst, spillDisp(g, v));
+}
+
+// Stores value v to [base+disp] without going through a scratch register
+// when v is a register or a small constant.
+static void storeValueToMem(FnGen *g, Reg base, int32_t disp, int v, Reg scratch) {
+    if (valueIsImm(g, v)) {
+        emitMovMemDispImm32(g[0].text, base, disp, valueImm(g, v));
         return;
     }
-    if (op == BIN_DIV || op == BIN_MOD) {
-        emitMovRegReg(text, REG_R10, REG_RAX); // divisor
-        emitMovRegReg(text, REG_RAX, REG_R11); // dividend
-        emitCqo(text);
-        emitIDivReg(text, REG_R10);
-        if (op == BIN_MOD) emitMovRegReg(text, REG_RAX, REG_RDX);
+    Reg src = valueReg(g, v) >= 0 ? (Reg)valueReg(g, v) : scratch;
+    loadValue(g, src, v);
+    emitMovMemDispReg(g[0].text, base, disp, src);
+}
+
+static void storeValue(FnGen *g, int v, Reg src) {
+    int r = valueReg(g, v);
+    if (r >= 0) {
+        emitMove(g, (Reg)r, src);
         return;
     }
-    // comparisons: result is 0 or 1 in rax
-    if (op == BIN_EQ || op == BIN_NEQ || op == BIN_LT || op == BIN_GT || op == BIN_LE || op == BIN_GE) {
-        // left in r11, right in rax
-        emitCmpRegReg(text, REG_R11, REG_RAX);
-        // cc mapping for SETcc
-        // E=4, NE=5, L=12, G=15, LE=14, GE=13 (signed comparisons)
-        uint8_t cc = 4;
-        if (op == BIN_EQ) cc = 4;
-        else if (op == BIN_NEQ) cc = 5;
-        else if (op == BIN_LT) cc = 12;
-        else if (op == BIN_GE) cc = 13;
-        else if (op == BIN_LE) cc = 14;
-        else if (op == BIN_GT) cc = 15;
-        emitSetccAl(text, cc);
-        emitMovzxRaxAl(text);
-        return;
+    if (valueDead(g, v)) return;
+    emitSpillStore(g, spillDisp(g, v), src);
+}
+
+// Performs all moves as if in parallel. Register-to-register moves go first,
+// in an order that never overwrites a pending source (cycles are broken
+// through r11); loads from memory and constants come last, once no source
+// is pending.
+static void emitRegMoves(FnGen *g, RegMove *m, int n) {
+    ByteBuf *text = g[0].text;
+    char *done = calloc((size_t)(n ? n : 1), 1);
+    int pending = 0;
+    for (int i = 0; i < n; i++) {
+        if (m[i].srcReg < 0) { done[i] = 2; continue; }
+        if (m[i].srcReg == (int)m[i].dst) { done[i] = 1; continue; }
+        pending++;
+    }
+    while (pending) {
+        int progress = 0;
+        for (int i = 0; i < n; i++) {
+            if (done[i]) continue;
+            int blocked = 0;
+            for (int k = 0; k < n; k++) {
+                if (k != i && done[k] != 1 && m[k].srcReg == (int)m[i].dst) { blocked = 1; break; }
+            }
+            if (blocked) continue;
+            emitMove(g, m[i].dst, (Reg)m[i].srcReg);
+            done[i] = 1;
+            pending--;
+            progress = 1;
+        }
+        if (progress) continue;
+        for (int i = 0; i < n; i++) {
+            if (done[i]) continue;
+            emitMove(g, REG_R11, m[i].dst);
+            for (int k = 0; k < n; k++) {
+                if (!done[k] && m[k].srcReg == (int)m[i].dst) m[k].srcReg = REG_R11;
+            }
+            break;
+        }
     }
-    emitMovRegImm64(text, REG_RAX, 0);
+    for (int i = 0; i < n; i++) {
+        if (done[i] != 2) continue;
+        if (m[i].srcValue >= 0) loadValue(g, m[i].dst, m[i].srcValue);
+        else emitMovRegMemDisp(text, m[i].dst, g[0].frameBase, frameDisp(g, m[i].srcDisp));
+    }
+    free(done);
 }
 
-static void genCall(ByteBuf *text, PatchList *patches, Expr *e, VarNode *locals) {
-    // builtins
-    if (e[0].call.fn->kind == EX_VAR && strcmp(e[0].call.fn->varName, "__mem_store") == 0) {
-        genMemStore(text, patches, e[0].call.args[0], e[0].call.args[1], locals);
-        return;
+static void addBlockFixup(FnGen *g, size_t at, IrBlock *target) {
+    if (g[0].fixupCount == g[0].fixupCap) {
+        g[0].fixupCap = g[0].fixupCap ? g[0].fixupCap * 2 : 32;
+        g[0].fixups = realloc(g[0].fixups, sizeof(BlockFixup) * (size_t)g[0].fixupCap);
     }
-    if (e[0].call.fn->kind == EX_VAR && strcmp(e[0].call.fn->varName, "__index_store") == 0) {
-        genIndexStore(text, patches, e[0].call.args[0], e[0].call.args[1], e[0].call.args[2], locals);
-        return;
+    g[0].fixups[g[0].fixupCount].at = at;
+    g[0].fixups[g[0].fixupCount].block = target[0].id;
+    g[0].fixupCount++;
+}
+
+static void emitJmpBlock(FnGen *g, IrBlock *target) {
+    size_t at = emitJmpRel32Placeholder(g[0].text);
+    addBlockFixup(g, at, target);
+}
+
+static void emitJccBlock(FnGen *g, uint8_t cc, IrBlock *target) {
+    size_t at = emitJccRel32Placeholder(g[0].text, cc);
+    addBlockFixup(g, at, target);
+}
+
+static uint8_t condCodeFor(BinOpKind op) {
+    // E=4, NE=5, L=12, GE=13, LE=14, G=15 (signed comparisons)
+    switch (op) {
+        case BIN_EQ: return 0x4;
+        case BIN_NEQ: return 0x5;
+        case BIN_LT: return 0xC;
+        case BIN_GE: return 0xD;
+        case BIN_LE: return 0xE;
+        case BIN_GT: return 0xF;
+        default: return 0x4;
+    }
+}
+
+static uint8_t swappedCondCode(BinOpKind op) {
+    // condition for (b op a) given (a op b)
+    switch (op) {
+        case BIN_LT: return condCodeFor(BIN_GT);
+        case BIN_GT: return condCodeFor(BIN_LT);
+        case BIN_LE: return condCodeFor(BIN_GE);
+        case BIN_GE: return condCodeFor(BIN_LE);
+        default: return condCodeFor(op);
     }
-    if (e[0].call.fn->kind == EX_VAR && strcmp(e[0].call.fn->varName, "print") == 0) {
-        if (e[0].call.argCount > 0) {
-            genExpr(text, patches, e[0].call.args[0], locals);
-            emitMovRegReg(text, REG_RDI, REG_RAX);
-            emitMovRegImm64Patch(text, patches, SEG_TEXT, REG_RAX, "printInt", 0);
-            emitCallReg(text, REG_RAX);
-            emitMovRegImm64(text, REG_RAX, 0);
+}
+
+static void emitAluOperand(FnGen *g, AluOp op, Reg dst, Operand src) {
+    ByteBuf *text = g[0].text;
+    int one = src.kind == OPND_IMM && (src.imm == 1 || src.imm == -1);
+    if (one && (op == ALU_ADD || op == ALU_SUB)) {
+        if ((op == ALU_ADD) == (src.imm == 1)) emitIncReg(text, dst);
+        else emitDecReg(text, dst);
+    } else if (src.kind == OPND_IMM) emitAluRegImm(text, op, dst, src.imm);
+    else if (src.kind == OPND_MEM) emitAluRegMemDisp(text, op, dst, g[0].frameBase, frameDisp(g, src.disp));
+    else if (op == ALU_ADD) emitAddRegReg(text, dst, src.reg);
+    else if (op == ALU_SUB) emitSubRegReg(text, dst, src.reg);
+    else emitCmpRegReg(text, dst, src.reg);
+}
+
+static int isCompareOp(BinOpKind op) {
+    return op == BIN_EQ || op == BIN_NEQ || op == BIN_LT || op == BIN_GT || op == BIN_LE || op == BIN_GE;
+}
+
+// Emits the flag-setting part of a comparison and returns the condition code
+// under which it holds. A constant operand goes to the right (flipping the
+// condition) so it can be an immediate; x == 0 / x != 0 use test.
+static uint8_t genCompare(FnGen *g, IrInst *in) {
+    BinOpKind op = in[0].binop;
+    int lhs = in[0].args[0];
+    int rhs = in[0].args[1];
+    int swapped = 0;
+    if (valueIsImm(g, lhs) && !valueIsImm(g, rhs)) swapped = 1;
+    else if (valueReg(g, lhs) < 0 && valueReg(g, rhs) >= 0) swapped = 1;
+    if (swapped) { int t = lhs; lhs = rhs; rhs = t; }
+    uint8_t cc = swapped ? swappedCondCode(op) : condCodeFor(op);
+
+    Operand l = valueOperand(g, lhs);
+    Reg left = l.kind == OPND_REG ? l.reg : REG_RAX;
+    if (l.kind != OPND_REG) loadValue(g, REG_RAX, lhs);
+    Operand r = valueOperand(g, rhs);
+    if (r.kind == OPND_IMM && r.imm == 0 && (op == BIN_EQ || op == BIN_NEQ)) emitTestRegReg(g[0].text, left, left);
+    else emitAluOperand(g, ALU_CMP, left, r);
+    return cc;
+}
+
+// A comparison whose only use is the branch right after it is not
+// materialized; the branch emits cmp + jcc instead (see IR_BR).
+static int isFusedCompare(FnGen *g, IrInst *in) {
+    return in[0].op == IR_BIN && isCompareOp(in[0].binop) && in[0].next &&
+           in[0].next[0].op == IR_BR && in[0].next[0].args[0] == in[0].dst &&
+           g[0].useCount[in[0].dst] == 1;
+}
+
+// Whether v is an IR_CONST, in which case *c is its value.
+static int valueConst(FnGen *g, int v, int64_t *c) {
+    IrInst *def = g[0].defs[v];
+    if (!def || def[0].op != IR_CONST) return 0;
+    *c = def[0].imm;
+    return 1;
+}
+
+// log2(c) when c is a power of two, else -1.
+static int log2Exact(uint64_t c) {
+    if (c == 0 || (c & (c - 1))) return -1;
+    int k = 0;
+    while (c > 1) { c >>= 1; k++; }
+    return k;
+}
+
+// Magic multiplier and shift for signed division by d, 2 <= |d| < 2^63
+// (Hacker's Delight, 10-1): q = (mulhi(x, magic) [+/- x]) >> shift, plus one
+// when that is negative.
+static void signedMagic(int64_t d, int64_t *magic, int *shift) {
+    const uint64_t two63 = 1ull << 63;
+    uint64_t ad = d < 0 ? (uint64_t)0 - (uint64_t)d : (uint64_t)d;
+    uint64_t t = two63 + ((uint64_t)d >> 63);
+    uint64_t anc = t - 1 - t % ad;
+    uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;
+    uint64_t delta;
+    int p = 63;
+    do {
+        p++;
+        q1 *= 2; r1 *= 2;
+        if (r1 >= anc) { q1++; r1 -= anc; }
+        q2 *= 2; r2 *= 2;
+        if (r2 >= ad) { q2++; r2 -= ad; }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    *magic = (int64_t)(q2 + 1);
+    if (d < 0) *magic = -*magic;
+    *shift = p - 64;
+}
+
+// x / c and x % c for a constant c with 2 <= |c| < 2^63, keeping idiv's
+// truncation. Returns 0 (emitting nothing) for other divisors, which keep
+// idiv and its traps for 0 and -1.
+static int genDivConst(FnGen *g, IrInst *in, int64_t c) {
+    ByteBuf *text = g[0].text;
+    int isMod = in[0].binop == BIN_MOD;
+    if (c == INT64_MIN || (c >= -1 && c <= 1)) return 0;
+    uint64_t ac = c < 0 ? (uint64_t)0 - (uint64_t)c : (uint64_t)c;
+    int k = log2Exact(ac);
+    if (isMod && k > 31) k = -1;                    // mask would not fit an imm32
+
+    int lhs = in[0].args[0];
+    Reg x = valueReg(g, lhs) >= 0 ? (Reg)valueReg(g, lhs) : REG_R11;
+    loadValue(g, x, lhs);
+    if (k > 0) {
+        // bias = x < 0 ? 2^k - 1 : 0, so that the shift/mask truncates
+        emitMove(g, REG_RDX, x);
+        if (k > 1) emitShiftRegImm(text, SHIFT_SAR, REG_RDX, 63);
+        emitShiftRegImm(text, SHIFT_SHR, REG_RDX, (uint8_t)(64 - k));
+        if (isMod) {
+            // x % 2^k = ((x + bias) & (2^k - 1)) - bias
+            emitLeaRegBaseIndexScale(text, REG_RAX, x, REG_RDX, 1);
+            emitAluRegImm(text, ALU_AND, REG_RAX, (int32_t)(ac - 1));
+            emitSubRegReg(text, REG_RAX, REG_RDX);
+            storeValue(g, in[0].dst, REG_RAX);
+        } else {
+            emitAddRegReg(text, REG_RDX, x);
+            emitShiftRegImm(text, SHIFT_SAR, REG_RDX, (uint8_t)k);
+            if (c < 0) emitNegReg(text, REG_RDX);
+            storeValue(g, in[0].dst, REG_RDX);
         }
+        return 1;
+    }
+
+    int64_t magic;
+    int shift;
+    signedMagic(c, &magic, &shift);
+    emitMovRegImm(text, REG_RAX, magic);
+    emitIMulRaxReg(text, x);
+    if (c > 0 && magic < 0) emitAddRegReg(text, REG_RDX, x);
+    if (c < 0 && magic > 0) emitSubRegReg(text, REG_RDX, x);
+    if (shift) emitShiftRegImm(text, SHIFT_SAR, REG_RDX, (uint8_t)shift);
+    emitMovRegReg(text, REG_RAX, REG_RDX);
+    emitShiftRegImm(text, SHIFT_SHR, REG_RAX, 63);
+    emitAddRegReg(text, REG_RDX, REG_RAX);
+    if (!isMod) {
+        storeValue(g, in[0].dst, REG_RDX);
+        return 1;
+    }
+    // x % c = x - q * c
+    if (c >= INT32_MIN && c <= INT32_MAX) {
+        emitIMulRegRegImm(text, REG_RDX, REG_RDX, (int32_t)c);
+    } else {
+        emitMovRegImm(text, REG_RAX, c);
+        emitIMulRegReg(text, REG_RDX, REG_RAX);
+    }
+    emitMovRegReg(text, REG_RAX, x);
+    emitSubRegReg(text, REG_RAX, REG_RDX);
+    storeValue(g, in[0].dst, REG_RAX);
+    return 1;
+}
+
+// d = src * c with shifts and lea for c = +/-2^k and {3,5,9} * 2^k; other
+// constants use imul.
+static void genMulImm(FnGen *g, Reg d, Reg src, int32_t c) {
+    ByteBuf *text = g[0].text;
+    uint64_t ac = c < 0 ? (uint64_t)0 - (uint64_t)(int64_t)c : (uint64_t)c;
+    int k = log2Exact(ac);
+    if (k >= 0) {
+        emitMove(g, d, src);
+        if (k) emitShiftRegImm(text, SHIFT_SHL, d, (uint8_t)k);
+        if (c < 0) emitNegReg(text, d);
         return;
     }
+    if (c > 0) {
+        for (int m = 3; m <= 9; m += m - 1) {           // 3, 5, 9
+            if (c % m || (k = log2Exact((uint64_t)(c / m))) < 0) continue;
+            emitLeaRegBaseIndexScale(text, d, src, src, m - 1);
+            if (k) emitShiftRegImm(text, SHIFT_SHL, d, (uint8_t)k);
+            return;
+        }
+    }
+    emitIMulRegRegImm(text, d, src, c);
+}
 
-    Reg argRegs[6] = { REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9 };
-    int argCount = e[0].call.argCount;
+// Computes into the destination register when the value has one, with the
+// right operand folded in as a register, [rbp+disp] or imm32 operand.
+static void genBinOp(FnGen *g, IrInst *in) {
+    ByteBuf *text = g[0].text;
+    BinOpKind op = in[0].binop;
+    int lhs = in[0].args[0];
+    int rhs = in[0].args[1];
 
-    // Predictable arity behavior:
-    // - If the callee is a known direct function name, missing parameters are treated as 0 up to its paramCount.
-    // - For indirect calls (function expression not a plain name), missing parameters are treated as 0 up to maxParamCount.
-    int targetParamCount = 0;
-    if (e[0].call.fn->kind == EX_VAR) {
-        if (!findFnParamCount(e[0].call.fn->varName, &targetParamCount)) {
-            targetParamCount = maxParamCount;
+    int64_t divisor;
+    if ((op == BIN_DIV || op == BIN_MOD) && valueConst(g, rhs, &divisor) && genDivConst(g, in, divisor)) return;
+    if (op == BIN_DIV || op == BIN_MOD) {
+        loadValue(g, REG_RAX, lhs);
+        emitCqo(text);
+        Operand d = valueOperand(g, rhs);
+        if (d.kind == OPND_REG) {
+            emitIDivReg(text, d.reg);
+        } else if (d.kind == OPND_MEM) {
+            emitIDivMemDisp(text, g[0].frameBase, frameDisp(g, d.disp));
+        } else {
+            loadValue(g, REG_R11, rhs);
+            emitIDivReg(text, REG_R11);
         }
+        storeValue(g, in[0].dst, op == BIN_MOD ? REG_RDX : REG_RAX);
+        return;
+    }
+
+    if (isCompareOp(op)) {
+        // comparisons: result is 0 or 1
+        emitSetccAl(text, genCompare(g, in));
+        emitMovzxRaxAl(text);
+        storeValue(g, in[0].dst, REG_RAX);
+        return;
+    }
+
+    // prefer the constant (or the memory operand) on the right
+    int commutative = op == BIN_ADD || op == BIN_MUL;
+    if (commutative && valueIsImm(g, lhs) && !valueIsImm(g, rhs)) { int t = lhs; lhs = rhs; rhs = t; }
+    else if (commutative && valueReg(g, lhs) < 0 && valueReg(g, rhs) >= 0) { int t = lhs; lhs = rhs; rhs = t; }
+
+    Reg d = valueReg(g, in[0].dst) >= 0 ? (Reg)valueReg(g, in[0].dst) : REG_RAX;
+    if (op == BIN_SUB && valueIsImm(g, lhs) && valueImm(g, lhs) == 0) {
+        loadValue(g, d, rhs);
+        emitNegReg(text, d);
+        storeValue(g, in[0].dst, d);
+        return;
+    }
+    // loading lhs into d must not clobber rhs
+    if (valueReg(g, rhs) == (int)d && lhs != rhs) d = REG_RAX;
+    Operand r = valueOperand(g, rhs);
+    if (op == BIN_MUL && r.kind == OPND_IMM) {
+        Operand l = valueOperand(g, lhs);
+        Reg src = l.kind == OPND_REG ? l.reg : d;
+        if (l.kind != OPND_REG) loadValue(g, d, lhs);
+        genMulImm(g, d, src, r.imm);
     } else {
-        targetParamCount = maxParamCount;
+        loadValue(g, d, lhs);
+        if (op == BIN_MUL) {
+            if (r.kind == OPND_REG) emitIMulRegReg(text, d, r.reg);
+            else emitIMulRegMemDisp(text, d, g[0].frameBase, frameDisp(g, r.disp));
+        } else {
+            emitAluOperand(g, op == BIN_ADD ? ALU_ADD : ALU_SUB, d, r);
+        }
     }
-    if (targetParamCount < 0) targetParamCount = 0;
-    int effectiveArgCount = argCount;
-    if (effectiveArgCount < targetParamCount) effectiveArgCount = targetParamCount;
+    storeValue(g, in[0].dst, d);
+}
 
-    int stackArgCount = effectiveArgCount > 6 ? (effectiveArgCount - 6) : 0;
+static void genCall(FnGen *g, IrInst *in) {
+    ByteBuf *text = g[0].text;
+    int first = in[0].op == IR_CALL_IND ? 1 : 0;
+    int argCount = in[0].argCount - first;
+    int stackArgCount = argCount > 6 ? (argCount - 6) : 0;
 
-    // SysV AMD64: args 7+ are passed on the stack.
-    // Ensure stack is 16-byte aligned at call boundary.
-    // Our code generally keeps RSP 16-byte aligned inside functions; pushing an odd number of
-    // stack args would break alignment, so we add one 8-byte pad slot if needed.
+    // SysV AMD64: args 7+ are passed on the stack, and rsp must be 16-byte
+    // aligned at the call. The frame keeps rsp aligned, so an odd number of
+    // stack args needs one 8-byte pad slot.
     int needsPad = (stackArgCount & 1) ? 1 : 0;
     if (needsPad) {
-        emitMovRegImm64(text, REG_RAX, 0);
-        emitPushReg(text, REG_RAX);
+        emitAluRegImm8(text, ALU_SUB, REG_RSP, 8);
+        noteRspMove(g, 8);
     }
 
     // push args N..7 so that at callee entry:
     // [rsp+8] = arg7, [rsp+16] = arg8, ...
-    for (int i = effectiveArgCount - 1; i >= 6; --i) {
-        if (i < argCount) {
-            genExpr(text, patches, e[0].call.args[i], locals);
+    for (int i = argCount - 1; i >= 6; --i) {
+        int v = in[0].args[first + i];
+        if (valueReg(g, v) >= 0) {
+            emitPushReg(text, (Reg)valueReg(g, v));
+        } else if (valueIsImm(g, v)) {
+            emitPushImm(text, valueImm(g, v));
         } else {
-            emitMovRegImm64(text, REG_RAX, 0);
+            loadValue(g, REG_RAX, v);
+            emitPushReg(text, REG_RAX);
         }
-        emitPushReg(text, REG_RAX);
+        noteRspMove(g, 8);
     }
+    // the indirect target goes to rax before argument registers get overwritten
+    if (in[0].op == IR_CALL_IND) loadValue(g, REG_RAX, in[0].args[0]);
 
-    // first 6 args in registers
-    int regProvided = argCount < 6 ? argCount : 6;
-    for (int i = regProvided; i < 6; i++) {
-        emitMovRegImm64(text, REG_RAX, 0);
-        emitMovRegReg(text, argRegs[i], REG_RAX);
-    }
-    for (int i = 0; i < regProvided; i++) {
-        genExpr(text, patches, e[0].call.args[i], locals);
-        emitMovRegReg(text, argRegs[i], REG_RAX);
+    RegMove moves[6];
+    int regCount = argCount < 6 ? argCount : 6;
+    for (int i = 0; i < regCount; i++) {
+        int v = in[0].args[first + i];
+        moves[i].dst = argRegs[i];
+        moves[i].srcReg = valueReg(g, v);
+        moves[i].srcValue = v;
+        moves[i].srcDisp = 0;
     }
+    emitRegMoves(g, moves, regCount);
 
-    if (e[0].call.fn->kind == EX_VAR) {
-        emitMovRegImm64Patch(text, patches, SEG_TEXT, REG_RAX, e[0].call.fn->varName, 0);
-        emitCallReg(text, REG_RAX);
-    } else {
-        genExpr(text, patches, e[0].call.fn, locals);
-        emitCallReg(text, REG_RAX);
-    }
+    if (in[0].op == IR_CALL) emitCallRel32Patch(text, g[0].patches, in[0].sym);
+    else emitCallReg(text, REG_RAX);
 
     // caller stack cleanup for args 7+ and optional pad
     if (stackArgCount || needsPad) {
         uint32_t bytes = (uint32_t)(8 * (stackArgCount + needsPad));
-        emitAddRspImm32(text, bytes);
+        emitAluRegImm(text, ALU_ADD, REG_RSP, (int32_t)bytes);
+        noteRspMove(g, -(int32_t)bytes);
     }
+    if (in[0].dst >= 0) storeValue(g, in[0].dst, REG_RAX);
 }
 
-static void genExpr(ByteBuf *text, PatchList *patches, Expr *e, VarNode *locals) {
-    if (!e) { emitMovRegImm64(text, REG_RAX, 0); return; }
-    switch (e[0].kind) {
-        case EX_INT:
-            emitMovRegImm64(text, REG_RAX, (uint64_t)e[0].intValue);
-            return;
-        case EX_VAR: {
-            int idx = findVarIndex(locals, e[0].varName);
-            if (idx >= 0) { emitLoadLocal(text, idx); return; }
-            emitMovRegImm64(text, REG_RAX, 0);
-            return;
+// All IR_PARAMs sit at the top of the entry block; they are moved out of the
+// incoming argument registers together, as one parallel move.
+static void genParams(FnGen *g, IrBlock *entry) {
+    ByteBuf *text = g[0].text;
+    RegMove *moves = malloc(sizeof(RegMove) * (size_t)(g[0].fn[0].paramCount + 1));
+    int n = 0;
+    for (IrInst *in = entry[0].first; in && in[0].op == IR_PARAM; in = in[0].next) {
+        int i = (int)in[0].imm;
+        int dst = in[0].dst;
+        // params 7+ come from the caller stack:
+        // after `push rbp; mov rbp, rsp` (or where rbp would be), the layout is:
+        //   [rbp+8]  = return address
+        //   [rbp+16] = arg7
+        //   [rbp+24] = arg8
+        //   ...
+        int32_t stackDisp = 16 + 8 * (i - 6);
+        if (valueDead(g, dst)) continue;
+        if (valueReg(g, dst) < 0) {
+            // spilled params are stored right away; this never clobbers a register
+            if (i < 6) {
+                storeValue(g, dst, argRegs[i]);
+            } else {
+                emitMovRegMemDisp(text, REG_RAX, g[0].frameBase, frameDisp(g, stackDisp));
+                storeValue(g, dst, REG_RAX);
+            }
+            continue;
+        }
+        moves[n].dst = (Reg)valueReg(g, dst);
+        moves[n].srcReg = i < 6 ? (int)argRegs[i] : -1;
+        moves[n].srcValue = -1;
+        moves[n].srcDisp = i < 6 ? 0 : stackDisp;
+        n++;
+    }
+    emitRegMoves(g, moves, n);
+    free(moves);
+}
+
+// mem[i] is addressed as [memArray + i*8]: the program never changes the
+// `mem` pointer and the image is not position independent, so memArray's
+// address fits a disp32. Returns the index register (rax when the index is
+// spilled), or -1 with the byte offset in *addend when it is a constant.
+static int memIndex(FnGen *g, int indexValue, int64_t *addend) {
+    *addend = 0;
+    if (valueIsImm(g, indexValue) && valueImm(g, indexValue) >= -(1 << 26) && valueImm(g, indexValue) < (1 << 26)) {
+        *addend = (int64_t)valueImm(g, indexValue) * 8;
+        return -1;
+    }
+    if (valueReg(g, indexValue) >= 0) return valueReg(g, indexValue);
+    loadValue(g, REG_RAX, indexValue);
+    return REG_RAX;
+}
+
+static void genFrameTeardown(FnGen *g) {
+    for (int i = 0, k = 0; i < 5; i++) {
+        if (!(g[0].ra.calleeSavedUsed & (1u << calleeSaved[i]))) continue;
+        emitMovRegMemDisp(g[0].text, calleeSaved[i], g[0].frameBase, frameDisp(g, slotDisp(g[0].saveBase + k)));
+        k++;
+    }
+    if (g[0].hasFrame) emitLeave(g[0].text);
+    else if (g[0].frameSize) emitAluRegImm(g[0].text, ALU_ADD, REG_RSP, (int32_t)g[0].frameSize);
+}
+
+static void genEpilogue(FnGen *g) {
+    genFrameTeardown(g);
+    emitRet(g[0].text);
+}
+
+// `return f(...)` can leave through a jump to f when f's stack arguments fit
+// in the area our own caller reserved for ours ([rbp+16] up; every caller
+// passes at least paramCount arguments, _start passes none to main) and no
+// pointer into the frame can be among the arguments.
+static int isTailCall(FnGen *g, IrInst *in) {
+    if (in[0].op != IR_CALL && in[0].op != IR_CALL_IND) return 0;
+    IrInst *ret = in[0].next;
+    if (in[0].dst < 0 || !ret || ret[0].op != IR_RET || ret[0].args[0] != in[0].dst) return 0;
+    if (g[0].fn[0].slotCount) return 0;
+    int argCount = in[0].argCount - (in[0].op == IR_CALL_IND ? 1 : 0);
+    int incoming = strcmp(g[0].fn[0].name, "lang_main") == 0 ? 0 : g[0].fn[0].paramCount - 6;
+    return argCount - 6 <= (incoming > 0 ? incoming : 0);
+}
+
+// Stack arguments overwrite our incoming ones (the params were moved out of
+// that area in the prologue), register arguments are moved as for a call,
+// then the frame is torn down and the callee returns straight to our caller.
+static void genTailCall(FnGen *g, IrInst *in) {
+    ByteBuf *text = g[0].text;
+    int first = in[0].op == IR_CALL_IND ? 1 : 0;
+    int argCount = in[0].argCount - first;
+    for (int i = 6; i < argCount; i++) {
+        storeValueToMem(g, g[0].frameBase, frameDisp(g, 16 + 8 * (i - 6)), in[0].args[first + i], REG_RAX);
+    }
+    if (in[0].op == IR_CALL_IND) loadValue(g, REG_RAX, in[0].args[0]);
+
+    RegMove moves[6];
+    int regCount = argCount < 6 ? argCount : 6;
+    for (int i = 0; i < regCount; i++) {
+        int v = in[0].args[first + i];
+        moves[i].dst = argRegs[i];
+        moves[i].srcReg = valueReg(g, v);
+        moves[i].srcValue = v;
+        moves[i].srcDisp = 0;
+    }
+    emitRegMoves(g, moves, regCount);
+    genFrameTeardown(g);
+    if (in[0].op == IR_CALL) emitJmpRel32Patch(text, g[0].patches, in[0].sym);
+    else emitJmpReg(text, REG_RAX);
+}
+
+// IR_VEC_LOOP. Vector node n lives in xmm 2n and 2n+1 on the SSE2 path and
+// in ymm n on the AVX2 path, both covering 4 elements; the accumulator is
+// xmm14/xmm15 or ymm15. r10 counts the elements from -4*trips up to 0, so
+// each distinct offset of the loads and stores gets a register in rax, rdx
+// or r11 holding 8*(args[0] + 4*trips + offset). The sum of the accumulator
+// is left in rax.
+static void genVecPath(FnGen *g, IrInst *in, int avx) {
+    ByteBuf *text = g[0].text;
+    IrVecKernel *k = in[0].vec;
+    int *reg = malloc(sizeof(int) * (size_t)k[0].count);
+    int regCount = 0;
+    for (int i = 0; i < k[0].count; i++) {
+        IrVecOp op = k[0].nodes[i].op;
+        reg[i] = op == VEC_LOAD || op == VEC_SPLAT || op == VEC_ADD || op == VEC_SUB ? (avx ? 1 : 2) * regCount++ : -1;
+    }
+    for (int i = 0; i < k[0].count; i++) {
+        if (k[0].nodes[i].op != VEC_SPLAT) continue;
+        loadValue(g, REG_RAX, in[0].args[k[0].nodes[i].arg]);
+        if (avx) {
+            emitVmovqXmmReg(text, reg[i], REG_RAX);
+            emitVpbroadcastqYmmXmm(text, reg[i], reg[i]);
+        } else {
+            emitMovqXmmReg(text, reg[i], REG_RAX);
+            emitPackedXmmXmm(text, PACKED_PUNPCKLQDQ, reg[i], reg[i]);
+            emitMovdqaXmmXmm(text, reg[i] + 1, reg[i]);
+        }
+    }
+    loadValue(g, REG_R10, in[0].args[1]);
+    emitShiftRegImm(text, SHIFT_SHL, REG_R10, 2);
+    emitNegReg(text, REG_R10);
+    int baseArg[3];
+    const Reg baseReg[3] = { REG_RAX, REG_RDX, REG_R11 };
+    int baseCount = 0;
+    int *base = malloc(sizeof(int) * (size_t)k[0].count);
+    for (int i = 0; i < k[0].count; i++) {
+        IrVecNode *n = &k[0].nodes[i];
+        if (n[0].op != VEC_LOAD && n[0].op != VEC_STORE) continue;
+        int j = 0;
+        while (j < baseCount && baseArg[j] != n[0].arg) j++;
+        if (j == baseCount) {
+            baseArg[baseCount++] = n[0].arg;
+            loadValue(g, baseReg[j], in[0].args[0]);
+            if (n[0].arg >= 0) emitAluOperand(g, ALU_ADD, baseReg[j], valueOperand(g, in[0].args[n[0].arg]));
+            emitSubRegReg(text, baseReg[j], REG_R10);
+            emitShiftRegImm(text, SHIFT_SHL, baseReg[j], 3);
+        }
+        base[i] = baseReg[j];
+    }
+    if (in[0].dst >= 0) {
+        if (avx) {
+            emitVPacked(text, PACKED_PXOR, 1, 15, 15, 15);
+        } else {
+            emitPackedXmmXmm(text, PACKED_PXOR, 14, 14);
+            emitPackedXmmXmm(text, PACKED_PXOR, 15, 15);
         }
-        case EX_ADDR:
-            // &local or &function
-            {
-                int idx = findVarIndex(locals, e[0].addrName);
-                if (idx >= 0) {
-                    // rax = rbp - 8*(idx+1)
-                    emitMovRegReg(text, REG_RAX, REG_RBP);
-                    emitMovRegImm64(text, REG_R10, (uint64_t)(8 * (idx + 1)));
-                    emitSubRegReg(text, REG_RAX, REG_R10);
+    }
+
+    size_t loopStart = text[0].size;
+    for (int i = 0; i < k[0].count; i++) {
+        IrVecNode *n = &k[0].nodes[i];
+        int64_t addend = n[0].disp * 8;
+        int a = n[0].a >= 0 ? reg[n[0].a] : -1;
+        int b = n[0].b >= 0 ? reg[n[0].b] : -1;
+        switch (n[0].op) {
+            case VEC_SPLAT:
+                break;
+            case VEC_LOAD:
+                if (avx) {
+                    emitVmovdquYmmAbsIndex(text, g[0].patches, reg[i], base[i], REG_R10, "__rt_memArray", addend);
+                } else {
+                    emitMovdquXmmAbsIndex(text, g[0].patches, reg[i], base[i], REG_R10, "__rt_memArray", addend);
+                    emitMovdquXmmAbsIndex(text, g[0].patches, reg[i] + 1, base[i], REG_R10, "__rt_memArray", addend + 16);
+                }
+                break;
+            case VEC_STORE:
+                if (avx) {
+                    emitVmovdquAbsIndexYmm(text, g[0].patches, base[i], REG_R10, "__rt_memArray", addend, a);
                 } else {
-                    emitMovRegImm64Patch(text, patches, SEG_TEXT, REG_RAX, e[0].addrName, 0);
+                    emitMovdquAbsIndexXmm(text, g[0].patches, base[i], REG_R10, "__rt_memArray", addend, a);
+                    emitMovdquAbsIndexXmm(text, g[0].patches, base[i], REG_R10, "__rt_memArray", addend + 16, a + 1);
                 }
+                break;
+            case VEC_ADD:
+            case VEC_SUB: {
+                PackedOp op = n[0].op == VEC_ADD ? PACKED_PADDQ : PACKED_PSUBQ;
+                if (avx) {
+                    emitVPacked(text, op, 1, reg[i], a, b);
+                    break;
+                }
+                for (int h = 0; h < 2; h++) {
+                    if (reg[i] != a) emitMovdqaXmmXmm(text, reg[i] + h, a + h);
+                    emitPackedXmmXmm(text, op, reg[i] + h, b + h);
+                }
+                break;
             }
+            case VEC_ACC_ADD:
+            case VEC_ACC_SUB: {
+                PackedOp op = n[0].op == VEC_ACC_ADD ? PACKED_PADDQ : PACKED_PSUBQ;
+                if (avx) {
+                    emitVPacked(text, op, 1, 15, 15, a);
+                } else {
+                    emitPackedXmmXmm(text, op, 14, a);
+                    emitPackedXmmXmm(text, op, 15, a + 1);
+                }
+                break;
+            }
+        }
+    }
+    emitAluRegImm(text, ALU_ADD, REG_R10, 4);
+    size_t jnz = emitJccRel32Placeholder(text, 0x5);    // JNE
+    patchRel32(text, jnz, (int32_t)((int64_t)loopStart - (int64_t)(jnz + 4)));
+
+    // horizontal sum: fold the halves together, then the two lanes left
+    if (in[0].dst >= 0) {
+        if (avx) {
+            emitVextracti128XmmYmm(text, 14, 15, 1);
+            emitVPacked(text, PACKED_PADDQ, 0, 15, 15, 14);
+            emitVpshufdXmmXmm(text, 14, 15, 0x4E);
+            emitVPacked(text, PACKED_PADDQ, 0, 15, 15, 14);
+            emitVmovqRegXmm(text, REG_RAX, 15);
+        } else {
+            emitPackedXmmXmm(text, PACKED_PADDQ, 14, 15);
+            emitPshufdXmmXmm(text, 15, 14, 0x4E);
+            emitPackedXmmXmm(text, PACKED_PADDQ, 14, 15);
+            emitMovqRegXmm(text, REG_RAX, 14);
+        }
+    }
+    if (avx) emitVzeroupper(text);
+    free(reg);
+    free(base);
+}
+
+// The AVX2 version runs when _start found AVX2 usable (cpuFeatures != 0).
+static void genVecLoop(FnGen *g, IrInst *in) {
+    ByteBuf *text = g[0].text;
+    size_t jeSse = 0, jmpDone = 0;
+    if (g[0].opts[0].avx2) {
+        emitMovRegAbsIndex(text, g[0].patches, REG_RAX, -1, 1, "__rt_cpuFeatures", 0);
+        emitTestRegReg(text, REG_RAX, REG_RAX);
+        jeSse = emitJccRel32Placeholder(text, 0x4);     // JE
+        genVecPath(g, in, 1);
+        jmpDone = emitJmpRel32Placeholder(text);
+        patchRel32(text, jeSse, (int32_t)((int64_t)text[0].size - (int64_t)(jeSse + 4)));
+    }
+    genVecPath(g, in, 0);
+    if (g[0].opts[0].avx2) patchRel32(text, jmpDone, (int32_t)((int64_t)text[0].size - (int64_t)(jmpDone + 4)));
+    if (in[0].dst < 0) return;
+    loadValue(g, REG_RDX, in[0].args[2]);
+    emitAddRegReg(text, REG_RAX, REG_RDX);
+    storeValue(g, in[0].dst, REG_RAX);
+}
+
+// register an instruction computes its result into
+static Reg resultReg(FnGen *g, IrInst *in) {
+    int r = valueReg(g, in[0].dst);
+    return r >= 0 ? (Reg)r : REG_RAX;
+}
+
+static void genInst(FnGen *g, IrBlock *b, IrInst *in) {
+    ByteBuf *text = g[0].text;
+    switch (in[0].op) {
+        case IR_NOP:
+        case IR_PHI:
+        case IR_PARAM:
             return;
-        case EX_INDEX:
-            if (e[0].index.arr->kind == EX_VAR && strcmp(e[0].index.arr->varName, "mem") == 0) {
-                genMemLoad(text, patches, e[0].index.index, locals);
+        case IR_CONST:
+            if (valueDead(g, in[0].dst) || valueIsImm(g, in[0].dst)) return;
+            if (valueReg(g, in[0].dst) >= 0) {
+                emitMovRegImm(text, (Reg)valueReg(g, in[0].dst), in[0].imm);
                 return;
             }
-            genIndexLoad(text, patches, e[0].index.arr, e[0].index.index, locals);
+            emitMovRegImm(text, REG_RAX, in[0].imm);
+            storeValue(g, in[0].dst, REG_RAX);
             return;
-        case EX_CALL:
-            genCall(text, patches, e, locals);
+        case IR_COPY:
+            if (valueReg(g, in[0].dst) >= 0) {
+                loadValue(g, (Reg)valueReg(g, in[0].dst), in[0].args[0]);
+                return;
+            }
+            loadValue(g, REG_RAX, in[0].args[0]);
+            storeValue(g, in[0].dst, REG_RAX);
             return;
-        case EX_BINOP:
-            genBinOp(text, patches, e, locals);
+        case IR_BIN:
+            if (isFusedCompare(g, in)) return;
+            genBinOp(g, in);
             return;
-    }
-    emitMovRegImm64(text, REG_RAX, 0);
-}
-
-static void genStmtListInternal(ByteBuf *text, PatchList *patches, Stmt *s, VarNode *locals, uint32_t stackAlloc, int emitDefaultReturn) {
-    for (Stmt *p = s; p; p = p[0].next) {
-        if (p[0].kind == NODE_STMT_ASSIGN) {
-            genExpr(text, patches, p[0].assign.rhs, locals);
-            int idx = findVarIndex(locals, p[0].assign.lhs);
-            if (idx >= 0) emitStoreLocal(text, idx);
-        } else if (p[0].kind == NODE_STMT_RETURN) {
-            genExpr(text, patches, p[0].retExpr, locals);
-            emitLeave(text);
-            emitRet(text);
+        case IR_FUNC_ADDR:
+            emitMovReg32Imm32Patch(text, g[0].patches, resultReg(g, in), in[0].sym, 0);
+            storeValue(g, in[0].dst, resultReg(g, in));
+            return;
+        case IR_LOCAL_ADDR:
+            emitLeaRegMemDisp(text, resultReg(g, in), g[0].frameBase, frameDisp(g, slotDisp((int)in[0].imm)));
+            storeValue(g, in[0].dst, resultReg(g, in));
+            return;
+        case IR_LOAD_LOCAL:
+            emitSpillLoad(g, resultReg(g, in), slotDisp((int)in[0].imm));
+            storeValue(g, in[0].dst, resultReg(g, in));
+            return;
+        case IR_STORE_LOCAL:
+            storeValueToMem(g, g[0].frameBase, frameDisp(g, slotDisp((int)in[0].imm)), in[0].args[0], REG_RAX);
+            return;
+        case IR_LOAD_MEM: {
+            int64_t addend;
+            int index = memIndex(g, in[0].args[0], &addend);
+            emitMovRegAbsIndex(text, g[0].patches, resultReg(g, in), index, 8, "__rt_memArray", addend);
+            storeValue(g, in[0].dst, resultReg(g, in));
+            return;
+        }
+        case IR_STORE_MEM: {
+            int64_t addend;
+            int index = memIndex(g, in[0].args[0], &addend);
+            int v = in[0].args[1];
+            if (valueIsImm(g, v)) {
+                emitMovAbsIndexImm32(text, g[0].patches, index, 8, "__rt_memArray", addend, valueImm(g, v));
+                return;
+            }
+            Reg src = valueReg(g, v) >= 0 ? (Reg)valueReg(g, v) : REG_R11;
+            loadValue(g, src, v);
+            emitMovAbsIndexReg(text, g[0].patches, index, 8, "__rt_memArray", addend, src);
+            return;
+        }
+        case IR_LOAD:
+            loadValue(g, REG_R10, in[0].args[0]);
+            loadValue(g, REG_RAX, in[0].args[1]);
+            emitLeaRegBaseIndexScaleDisp(text, REG_R11, REG_R10, REG_RAX, 8, 0);
+            emitMovRegMemDisp(text, resultReg(g, in), REG_R11, 0);
+            storeValue(g, in[0].dst, resultReg(g, in));
+            return;
+        case IR_STORE:
+            loadValue(g, REG_R10, in[0].args[0]);
+            loadValue(g, REG_RAX, in[0].args[1]);
+            emitLeaRegBaseIndexScaleDisp(text, REG_R10, REG_R10, REG_RAX, 8, 0);
+            storeValueToMem(g, REG_R10, 0, in[0].args[2], REG_R11);
             return;
-        } else if (p[0].kind == NODE_STMT_EXPR) {
-            genExpr(text, patches, p[0].exprStmt, locals);
-        } else if (p[0].kind == NODE_STMT_BLOCK) {
-            genStmtListInternal(text, patches, p[0].blockBody, locals, stackAlloc, 0);
-        } else if (p[0].kind == NODE_STMT_IF) {
-            genExpr(text, patches, p[0].ifStmt.cond, locals);
-            emitTestRegReg(text, REG_RAX, REG_RAX);
-            size_t jeElse = emitJccRel32Placeholder(text, 0x4); // JE
-            // then
-            genStmtListInternal(text, patches, p[0].ifStmt.thenBranch, locals, stackAlloc, 0);
-            if (p[0].ifStmt.elseBranch) {
-                size_t jmpEnd = emitJmpRel32Placeholder(text);
-                int32_t relElse = (int32_t)((int64_t)text[0].size - (int64_t)(jeElse + 4));
-                patchRel32(text, jeElse, relElse);
-                genStmtListInternal(text, patches, p[0].ifStmt.elseBranch, locals, stackAlloc, 0);
-                int32_t relEnd = (int32_t)((int64_t)text[0].size - (int64_t)(jmpEnd + 4));
-                patchRel32(text, jmpEnd, relEnd);
+        case IR_CALL:
+        case IR_CALL_IND:
+            if (isTailCall(g, in)) genTailCall(g, in);
+            else genCall(g, in);
+            return;
+        case IR_JMP:
+            if (in[0].target[0].id != b[0].id + 1) emitJmpBlock(g, in[0].target);
+            return;
+        case IR_BR: {
+            IrInst *def = g[0].defs[in[0].args[0]];
+            uint8_t cc = 0x5;                               // JNE
+            if (def && isFusedCompare(g, def)) {
+                cc = genCompare(g, def);
+            } else {
+                int r = valueReg(g, in[0].args[0]);
+                Reg cond = r >= 0 ? (Reg)r : REG_RAX;
+                if (r < 0) loadValue(g, REG_RAX, in[0].args[0]);
+                emitTestRegReg(text, cond, cond);
+            }
+            if (in[0].target[0].id == b[0].id + 1) {
+                emitJccBlock(g, (uint8_t)(cc ^ 1), in[0].elseTarget);   // inverted condition
             } else {
-                int32_t relElse = (int32_t)((int64_t)text[0].size - (int64_t)(jeElse + 4));
-                patchRel32(text, jeElse, relElse);
+                emitJccBlock(g, cc, in[0].target);
+                if (in[0].elseTarget[0].id != b[0].id + 1) emitJmpBlock(g, in[0].elseTarget);
             }
-        } else if (p[0].kind == NODE_STMT_WHILE) {
-            size_t loopStart = text[0].size;
-            genExpr(text, patches, p[0].whileStmt.cond, locals);
-            emitTestRegReg(text, REG_RAX, REG_RAX);
-            size_t jeEnd = emitJccRel32Placeholder(text, 0x4); // JE
-            genStmtListInternal(text, patches, p[0].whileStmt.body, locals, stackAlloc, 0);
-            // jmp back
-            size_t jmpBack = emitJmpRel32Placeholder(text);
-            int32_t relBack = (int32_t)((int64_t)loopStart - (int64_t)(jmpBack + 4));
-            patchRel32(text, jmpBack, relBack);
-            int32_t relEnd = (int32_t)((int64_t)text[0].size - (int64_t)(jeEnd + 4));
-            patchRel32(text, jeEnd, relEnd);
+            return;
+        }
+        case IR_VEC_LOOP:
+            genVecLoop(g, in);
+            return;
+        case IR_COUNT: {
+            if (in[0].argCount == 0) {
+                emitAluAbsIndexImm(text, g[0].patches, ALU_ADD, -1, 1, "__rt_profCounters", in[0].imm * 8, 1);
+                return;
+            }
+            int r = valueReg(g, in[0].args[0]);
+            Reg src = r >= 0 ? (Reg)r : REG_RAX;
+            if (r < 0) loadValue(g, REG_RAX, in[0].args[0]);
+            emitAluAbsIndexReg(text, g[0].patches, ALU_ADD, -1, 1, "__rt_profCounters", in[0].imm * 8, src);
+            return;
+        }
+        case IR_RET: {
+            IrInst *def = g[0].defs[in[0].args[0]];
+            if (def && def[0].next == in && isTailCall(g, def)) return;   // left through the jump
+            loadValue(g, REG_RAX, in[0].args[0]);
+            genEpilogue(g);
+            return;
         }
     }
-    if (emitDefaultReturn) {
-        emitMovRegImm64(text, REG_RAX, 0);
-        emitLeave(text);
-        emitRet(text);
-    }
-    (void)stackAlloc;
 }
 
 static uint32_t align16(uint32_t x) { return (x + 15u) & ~15u; }
 
-static void collectAssignedVars(Stmt *s, VarNode **locals, int *localCount) {
-    for (Stmt *p = s; p; p = p[0].next) {
-        if (p[0].kind == NODE_STMT_ASSIGN) {
-            if (findVarIndex(locals[0], p[0].assign.lhs) < 0) {
-                addVarNode(locals, p[0].assign.lhs, localCount[0]);
-                localCount[0] += 1;
-            }
-        } else if (p[0].kind == NODE_STMT_BLOCK) {
-            collectAssignedVars(p[0].blockBody, locals, localCount);
-        } else if (p[0].kind == NODE_STMT_IF) {
-            collectAssignedVars(p[0].ifStmt.thenBranch, locals, localCount);
-            if (p[0].ifStmt.elseBranch) collectAssignedVars(p[0].ifStmt.elseBranch, locals, localCount);
-        } else if (p[0].kind == NODE_STMT_WHILE) {
-            collectAssignedVars(p[0].whileStmt.body, locals, localCount);
+static void genFunctionBytes(ByteBuf *text, PatchList *patches, IrFunction *fn, const CodegenOptions *opts) {
+    irDestructSsa(fn);
+    irRenumberBlocks(fn);
+
+    FnGen g;
+    memset(&g, 0, sizeof(g));
+    size_t fnStart = text[0].size;
+    int patchStart = patches[0].count;
+    g.text = text;
+    g.patches = patches;
+    g.fn = fn;
+    g.opts = opts;
+    g.blockOffsets = calloc((size_t)(fn[0].blockCount ? fn[0].blockCount : 1), sizeof(size_t));
+    allocateRegisters(fn, &g.ra);
+    g.defs = calloc((size_t)(fn[0].valueCount ? fn[0].valueCount : 1), sizeof(IrInst*));
+    g.useCount = calloc((size_t)(fn[0].valueCount ? fn[0].valueCount : 1), sizeof(int));
+    for (int i = 0; i < fn[0].blockCount; i++) {
+        for (IrInst *in = fn[0].blocks[i][0].first; in; in = in[0].next) {
+            if (in[0].dst >= 0) g.defs[in[0].dst] = in;
+            for (int k = 0; k < in[0].argCount; k++) g.useCount[in[0].args[k]]++;
         }
     }
-}
 
-static void genFunctionBytes(ByteBuf *text, PatchList *patches, Function *fn) {
-    VarNode *locals = NULL;
-    for (int i=0;i<fn[0].paramCount;i++) addVarNode(&locals, fn[0].params[i], i);
-    int localCount = fn[0].paramCount;
-    collectAssignedVars(fn[0].body, &locals, &localCount);
-    uint32_t stackAlloc = align16((uint32_t)(localCount * 8));
-
-    // prologue
-    emitPushReg(text, REG_RBP);
-    emitMovRegReg(text, REG_RBP, REG_RSP);
-    if (stackAlloc) emitSubRspImm32(text, stackAlloc);
+    int saveCount = 0;
+    for (int i = 0; i < 5; i++) if (g.ra.calleeSavedUsed & (1u << calleeSaved[i])) saveCount++;
+    g.saveBase = fn[0].slotCount + g.ra.spillCount;
+    uint32_t stackAlloc = align16((uint32_t)((g.saveBase + saveCount) * 8));
+    int leaf = 1;
+    for (int i = 0; i < fn[0].blockCount; i++) {
+        for (IrInst *in = fn[0].blocks[i][0].first; in; in = in[0].next) {
+            if (in[0].op == IR_CALL || in[0].op == IR_CALL_IND) leaf = 0;
+        }
+    }
 
-    // store params to locals
-    Reg argRegs[6] = { REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9 };
-    int n = fn[0].paramCount < 6 ? fn[0].paramCount : 6;
-    for (int i=0;i<n;i++) {
-        int32_t disp = -(int32_t)(8 * (i + 1));
-        emitMovMemDispReg(text, REG_RBP, disp, argRegs[i]);
+    // prologue. Calls need rsp 16-byte aligned, and it is 8 off at entry:
+    // push rbp or an extra 8 bytes in the rsp adjustment make up for it.
+    g.frameBase = REG_RBP;
+    if (opts[0].omitFramePointer) {
+        g.frameBase = REG_RSP;
+        // leaves may use the 128 bytes below rsp (red zone), which nothing
+        // else writes to while they run
+        g.frameSize = leaf && stackAlloc + 8 <= 128 ? 0 : stackAlloc + 8;
+        g.frameBias = (int32_t)g.frameSize - 8;
+        if (g.frameSize) emitAluRegImm(text, ALU_SUB, REG_RSP, (int32_t)g.frameSize);
+    } else if (!leaf || stackAlloc || fn[0].paramCount > 6) {
+        g.hasFrame = 1;
+        emitPushReg(text, REG_RBP);
+        emitMovRegReg(text, REG_RBP, REG_RSP);
+        if (stackAlloc) emitAluRegImm(text, ALU_SUB, REG_RSP, (int32_t)stackAlloc);
     }
-    // params 7+ come from the caller stack:
-    // after `push rbp; mov rbp, rsp`, the layout is:
-    //   [rbp+8]  = return address
-    //   [rbp+16] = arg7
-    //   [rbp+24] = arg8
-    //   ...
-    for (int i = 6; i < fn[0].paramCount; i++) {
-        int32_t srcDisp = 16 + 8 * (i - 6);
-        emitMovRegMemDisp(text, REG_RAX, REG_RBP, srcDisp);
-        emitStoreLocal(text, i);
+    for (int i = 0, k = 0; i < 5; i++) {
+        if (!(g.ra.calleeSavedUsed & (1u << calleeSaved[i]))) continue;
+        emitMovMemDispReg(text, g.frameBase, frameDisp(&g, slotDisp(g.saveBase + k)), calleeSaved[i]);
+        k++;
     }
-    // zero non-parameter locals (parameters must keep passed values)
-    for (int i = fn[0].paramCount; i < localCount; i++) {
-        emitMovRegImm64(text, REG_RAX, 0);
-        emitStoreLocal(text, i);
+    genParams(&g, fn[0].blocks[0]);
+
+    size_t *aligns = malloc(sizeof(size_t) * (size_t)(fn[0].blockCount ? fn[0].blockCount : 1));
+    int alignCount = 0;
+    for (int i = 0; i < fn[0].blockCount; i++) {
+        IrBlock *b = fn[0].blocks[i];
+        // a block entered by a backward jump is a loop head
+        int loopHead = 0;
+        for (int k = 0; k < b[0].predCount; k++) if (b[0].preds[k][0].id >= i) loopHead = 1;
+        if (loopHead && opts[0].alignLoops) {
+            aligns[alignCount++] = text[0].size;
+            emitNops(text, (opts[0].alignLoops - text[0].size % opts[0].alignLoops) % opts[0].alignLoops);
+        }
+        g.blockOffsets[i] = text[0].size;
+        g.last.kind = LAST_NONE;    // other predecessors may enter here
+        for (IrInst *in = b[0].first; in; in = in[0].next) genInst(&g, b, in);
     }
 
-    genStmtListInternal(text, patches, fn[0].body, locals, stackAlloc, 1);
+    size_t *sites = malloc(sizeof(size_t) * (size_t)(g.fixupCount ? g.fixupCount : 1));
+    for (int i = 0; i < g.fixupCount; i++) {
+        size_t target = g.blockOffsets[g.fixups[i].block];
+        int32_t rel = (int32_t)((int64_t)target - (int64_t)(g.fixups[i].at + 4));
+        patchRel32(text, g.fixups[i].at, rel);
+        // opcode is E9 for jmp, 0F 8x for jcc
+        sites[i] = g.fixups[i].at - (text[0].data[g.fixups[i].at - 1] == 0xE9 ? 1 : 2);
+    }
+    // shrink jumps to rel8 where they reach; later functions get their
+    // symbol addresses from the relaxed size
+    relaxBranches(text, fnStart, sites, g.fixupCount, patches, patchStart, NULL, 0,
+                  aligns, alignCount, opts[0].alignLoops);
+    free(sites);
+    free(aligns);
+    freeRegAlloc(&g.ra);
+    free(g.defs);
+    free(g.useCount);
+    free(g.blockOffsets);
+    free(g.fixups);
 }
 
 static uint64_t computeDataVaddr(uint64_t textSize) {
@@ -419,56 +1083,123 @@ static void applyPatches(ByteBuf *text, ByteBuf *data, PatchList *patches, Symbo
             exit(1);
         }
         uint64_t val = sym + (uint64_t)p[0].addend;
-        if (p[0].seg == SEG_TEXT) {
-            memcpy(&text[0].data[p[0].offset], &val, 8);
-        } else {
-            memcpy(&data[0].data[p[0].offset], &val, 8);
+        uint8_t *at = p[0].seg == SEG_TEXT ? &text[0].data[p[0].offset] : &data[0].data[p[0].offset];
+        if (p[0].kind == PATCH_ABS64) {
+            memcpy(at, &val, 8);
+            continue;
+        }
+        int64_t field = (int64_t)val;
+        if (p[0].kind == PATCH_REL32) field -= (int64_t)((0x400000 + 0x1000) + p[0].offset + 4);
+        if (field < INT32_MIN || field > INT32_MAX) {
+            fprintf(stderr, "patch error: %s out of 32-bit range\n", p[0].symbolName);
+            exit(1);
         }
+        int32_t v32 = (int32_t)field;
+        memcpy(at, &v32, 4);
     }
 }
 
-int emitDirectElfProgram(const char *outPath, Program *prog, int memEntries) {
+int emitDirectElfProgram(const char *outPath, IrModule *mod, int memEntries, const CodegenOptions *opts) {
     ByteBuf text; byteBufInit(&text);
     ByteBuf data; byteBufInit(&data);
     PatchList patches; patchListInit(&patches);
     SymbolTable symbols; symbolTableInit(&symbols);
 
+    int profile = mod[0].profileCounters > 0;
+    int input = 0;
+    for (IrFunction *f = mod[0].functions; f; f = f[0].next) {
+        for (int i = 0; i < f[0].blockCount; i++) {
+            for (IrInst *in = f[0].blocks[i][0].first; in; in = in[0].next) {
+                if (in[0].op != IR_CALL) continue;
+                if (strcmp(in[0].sym, "__rt_readInt") == 0 || strcmp(in[0].sym, "__rt_readInts") == 0) input = 1;
+            }
+        }
+    }
     RuntimeOffsets rtOff;
-    emitRuntime(&text, &patches, &rtOff);
+    emitRuntime(&text, &patches, &rtOff, profile, opts[0].bufferOutput, input);
     symbolSet(&symbols, "_start", (0x400000 + 0x1000) + rtOff.startOffset);
-    symbolSet(&symbols, "printInt", (0x400000 + 0x1000) + rtOff.printIntOffset);
-
-    // collect function signatures for arity padding
-    fnSigList = NULL;
-    maxParamCount = 0;
-    for (Function *f = prog[0].functions; f; f = f[0].next) {
-        const char *symName = (strcmp(f[0].name, "main") == 0) ? "lang_main" : f[0].name;
-        addFnSig(symName, f[0].paramCount);
-        // also allow looking up by original name for &main or direct call style, if used
-        addFnSig(f[0].name, f[0].paramCount);
+    symbolSet(&symbols, "__rt_printInt", (0x400000 + 0x1000) + rtOff.printIntOffset);
+    symbolSet(&symbols, "__rt_memFill", (0x400000 + 0x1000) + rtOff.memFillOffset);
+    symbolSet(&symbols, "__rt_memCopy", (0x400000 + 0x1000) + rtOff.memCopyOffset);
+    symbolSet(&symbols, "__rt_memSum", (0x400000 + 0x1000) + rtOff.memSumOffset);
+    symbolSet(&symbols, "__rt_memCmp64", (0x400000 + 0x1000) + rtOff.memCmp64Offset);
+    symbolSet(&symbols, "__rt_outFlush", (0x400000 + 0x1000) + rtOff.outFlushOffset);
+    if (profile) symbolSet(&symbols, "__rt_profileWrite", (0x400000 + 0x1000) + rtOff.profileWriteOffset);
+    if (input) {
+        symbolSet(&symbols, "__rt_readInt", (0x400000 + 0x1000) + rtOff.readIntOffset);
+        symbolSet(&symbols, "__rt_readInts", (0x400000 + 0x1000) + rtOff.readIntsOffset);
     }
 
-    // functions: emit in list order
-    for (Function *f = prog[0].functions; f; f = f[0].next) {
-        const char *name = (strcmp(f[0].name, "main") == 0) ? "lang_main" : f[0].name;
+    // functions: in layout order (layout.c) unless -fno-reorder-functions,
+    // each entry padded to the alignment; the padding is never executed
+    int fnCount = 0;
+    for (IrFunction *f = mod[0].functions; f; f = f[0].next) fnCount++;
+    IrFunction **order;
+    if (opts[0].reorderFunctions) {
+        order = layoutFunctions(mod);
+    } else {
+        order = malloc(sizeof(IrFunction*) * (size_t)(fnCount ? fnCount : 1));
+        fnCount = 0;
+        for (IrFunction *f = mod[0].functions; f; f = f[0].next) order[fnCount++] = f;
+    }
+    for (int i = 0; i < fnCount; i++) {
+        if (opts[0].alignFunctions) {
+            emitNops(&text, (opts[0].alignFunctions - text.size % opts[0].alignFunctions) % opts[0].alignFunctions);
+        }
         uint64_t funcVaddr = (0x400000 + 0x1000) + text.size;
-        symbolSet(&symbols, name, funcVaddr);
-        genFunctionBytes(&text, &patches, f);
+        symbolSet(&symbols, order[i][0].name, funcVaddr);
+        genFunctionBytes(&text, &patches, order[i], opts);
     }
+    free(order);
 
-    // data: [mem (u64)] [memArray (i64[memEntries])]
-    uint64_t dataSize = 8ull + (uint64_t)memEntries * 8ull;
+    // data: [mem (u64)] [cpuFeatures (u64)] [memArray (i64[memEntries])]
+    // [digitPairs ("00".."99", padded to 208 bytes)]
+    // then, with output buffering, [outLen (u64)] [outBuf + slack]
+    // when the program reads input, [inPos, inEnd (u64)] [inBuf]
+    // and with -fprofile-generate
+    //   [magic, checksum, counter count (u64)] [counters (u64[])] [path]
+    uint64_t arrayEnd = 16ull + (uint64_t)memEntries * 8ull;
+    uint64_t outLenAt = arrayEnd + 208;
+    uint64_t inPosAt = outLenAt + (opts[0].bufferOutput ? 8ull + OUTPUT_BUFFER_BYTES + OUTPUT_BUFFER_SLACK : 0);
+    uint64_t memEnd = inPosAt + (input ? 16ull + INPUT_BUFFER_BYTES : 0);
+    uint64_t profBytes = profile ? 8ull * (PROFILE_HEADER_WORDS + (uint64_t)mod[0].profileCounters) : 0;
+    const char *profPath = opts[0].profilePath ? opts[0].profilePath : PROFILE_DEFAULT_PATH;
+    uint64_t dataSize = memEnd + (profile ? profBytes + strlen(profPath) + 1 : 0);
     byteBufReserve(&data, dataSize);
     for (uint64_t i=0;i<dataSize;i++) emitU8(&data, 0);
 
     uint64_t dataVaddr = computeDataVaddr(text.size);
     uint64_t memVaddr = dataVaddr;
-    uint64_t memArrayVaddr = dataVaddr + 8;
-    symbolSet(&symbols, "mem", memVaddr);
-    symbolSet(&symbols, "memArray", memArrayVaddr);
+    uint64_t memArrayVaddr = dataVaddr + 16;
+    symbolSet(&symbols, "__rt_mem", memVaddr);
+    symbolSet(&symbols, "__rt_cpuFeatures", dataVaddr + 8);
+    symbolSet(&symbols, "__rt_memArray", memArrayVaddr);
+    symbolSet(&symbols, "__rt_digitPairs", dataVaddr + arrayEnd);
+    for (int i = 0; i < 100; i++) {
+        data.data[arrayEnd + 2 * i] = (uint8_t)('0' + i / 10);
+        data.data[arrayEnd + 2 * i + 1] = (uint8_t)('0' + i % 10);
+    }
+    if (opts[0].bufferOutput) {
+        symbolSet(&symbols, "__rt_outLen", dataVaddr + outLenAt);
+        symbolSet(&symbols, "__rt_outBuf", dataVaddr + outLenAt + 8);
+    }
+    if (input) {
+        symbolSet(&symbols, "__rt_inPos", dataVaddr + inPosAt);
+        symbolSet(&symbols, "__rt_inEnd", dataVaddr + inPosAt + 8);
+        symbolSet(&symbols, "__rt_inBuf", dataVaddr + inPosAt + 16);
+    }
 
     // initialize mem = memArrayVaddr
     memcpy(&data.data[0], &memArrayVaddr, 8);
+    if (profile) {
+        uint64_t header[PROFILE_HEADER_WORDS] = { PROFILE_MAGIC, mod[0].profileChecksum, (uint64_t)mod[0].profileCounters };
+        memcpy(&data.data[memEnd], header, sizeof(header));
+        memcpy(&data.data[memEnd + profBytes], profPath, strlen(profPath));
+        symbolSet(&symbols, "__rt_profData", dataVaddr + memEnd);
+        symbolSet(&symbols, "__rt_profCounters", dataVaddr + memEnd + sizeof(header));
+        symbolSet(&symbols, "__rt_profBytes", profBytes);
+        symbolSet(&symbols, "__rt_profPath", dataVaddr + memEnd + profBytes);
+    }
 
     applyPatches(&text, &data, &patches, &symbols);
 
@@ -479,4 +1210,3 @@ int emitDirectElfProgram(const char *outPath, Program *prog, int memEntries) {
     }
     return 1;
 }
-
@@ -1,9 +1,18 @@
 #ifndef CODEGEN_DIRECT_H
 #define CODEGEN_DIRECT_H
 
-#include "ast.h"
+#include "ir.h"
 
-int emitDirectElfProgram(const char *outPath, Program *prog, int memEntries);
+typedef struct {
+    unsigned alignLoops;    // loop heads start on this boundary (0: no padding)
+    unsigned alignFunctions;    // function entries start on this boundary (0: no padding)
+    int reorderFunctions;   // emit functions in call graph order (layout.c)
+    int avx2;               // vector loops also get an AVX2 version, picked at runtime
+    int omitFramePointer;   // address the frame off rsp; rbp is not set up
+    int bufferOutput;       // print() appends to a buffer that is written out when full
+    const char *profilePath;    // where an instrumented program writes its counters
+} CodegenOptions;
 
-#endif
+int emitDirectElfProgram(const char *outPath, IrModule *mod, int memEntries, const CodegenOptions *opts);
 
+#endif
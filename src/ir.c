@@ -1,8 +1,620 @@
 #include "ir.h"
+#include "utils.h"
 #include <stdlib.h>
+#include <string.h>
 
 IrModule *newIrModule(void) {
     IrModule *m = calloc(1, sizeof(IrModule));
     return m;
 }
 
+IrFunction *newIrFunction(const char *name, int paramCount) {
+    IrFunction *fn = calloc(1, sizeof(IrFunction));
+    fn->name = strDup(name);
+    fn->paramCount = paramCount;
+    return fn;
+}
+
+IrBlock *irNewBlock(IrFunction *fn) {
+    IrBlock *b = calloc(1, sizeof(IrBlock));
+    if (fn->blockCount == fn->blockCap) {
+        fn->blockCap = fn->blockCap ? fn->blockCap * 2 : 16;
+        fn->blocks = realloc(fn->blocks, sizeof(IrBlock*) * (size_t)fn->blockCap);
+    }
+    b->id = fn->blockCount;
+    fn->blocks[fn->blockCount++] = b;
+    return b;
+}
+
+int irNewValue(IrFunction *fn) { return fn->valueCount++; }
+
+IrInst *irNewInst(IrOp op) {
+    IrInst *in = calloc(1, sizeof(IrInst));
+    in->op = op;
+    in->dst = -1;
+    return in;
+}
+
+void irAddArg(IrInst *in, int value) {
+    if (in->argCount == in->argCap) {
+        in->argCap = in->argCap ? in->argCap * 2 : 4;
+        in->args = realloc(in->args, sizeof(int) * (size_t)in->argCap);
+    }
+    in->args[in->argCount++] = value;
+}
+
+void irAddPred(IrBlock *b, IrBlock *pred) {
+    if (b->predCount == b->predCap) {
+        b->predCap = b->predCap ? b->predCap * 2 : 4;
+        b->preds = realloc(b->preds, sizeof(IrBlock*) * (size_t)b->predCap);
+    }
+    b->preds[b->predCount++] = pred;
+}
+
+int irPredIndex(IrBlock *b, IrBlock *pred) {
+    for (int i = 0; i < b->predCount; i++) if (b->preds[i] == pred) return i;
+    return -1;
+}
+
+void irAppend(IrBlock *b, IrInst *in) {
+    in->next = NULL;
+    if (!b->first) { b->first = b->last = in; return; }
+    b->last->next = in;
+    b->last = in;
+}
+
+void irPrepend(IrBlock *b, IrInst *in) {
+    in->next = b->first;
+    b->first = in;
+    if (!b->last) b->last = in;
+}
+
+void irInsertAfter(IrBlock *b, IrInst *pos, IrInst *in) {
+    if (!pos) { irPrepend(b, in); return; }
+    in->next = pos->next;
+    pos->next = in;
+    if (b->last == pos) b->last = in;
+}
+
+void irInsertBeforeTerminator(IrBlock *b, IrInst *in) {
+    IrInst *term = irTerminator(b);
+    if (!term) { irAppend(b, in); return; }
+    IrInst *prev = NULL;
+    for (IrInst *p = b->first; p != term; p = p->next) prev = p;
+    irInsertAfter(b, prev, in);
+}
+
+static uint32_t nameHash(const char *s) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (; *s; s++) h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+// Open addressing with linear probing, at most half full.
+void irBuildFunctionTable(IrModule *m, IrFunctionTable *t) {
+    t->count = 0;
+    for (IrFunction *f = m->functions; f; f = f->next) t->count++;
+    t->fns = malloc(sizeof(IrFunction*) * (size_t)(t->count ? t->count : 1));
+    int size = 16;
+    while (size < 2 * t->count) size *= 2;
+    t->slots = calloc((size_t)size, sizeof(int));
+    t->slotMask = size - 1;
+    int i = 0;
+    for (IrFunction *f = m->functions; f; f = f->next, i++) {
+        t->fns[i] = f;
+        if (irFindFunction(t, f->name) >= 0) continue;     // the first one wins
+        uint32_t h = nameHash(f->name) & (uint32_t)t->slotMask;
+        while (t->slots[h]) h = (h + 1) & (uint32_t)t->slotMask;
+        t->slots[h] = i + 1;
+    }
+}
+
+int irFindFunction(const IrFunctionTable *t, const char *sym) {
+    uint32_t h = nameHash(sym) & (uint32_t)t->slotMask;
+    for (; t->slots[h]; h = (h + 1) & (uint32_t)t->slotMask) {
+        int i = t->slots[h] - 1;
+        if (strcmp(t->fns[i]->name, sym) == 0) return i;
+    }
+    return -1;
+}
+
+void irFreeFunctionTable(IrFunctionTable *t) {
+    free(t->fns);
+    free(t->slots);
+    t->fns = NULL;
+    t->slots = NULL;
+    t->count = 0;
+}
+
+int irIsTerminator(IrOp op) { return op == IR_JMP || op == IR_BR || op == IR_RET; }
+
+IrInst *irTerminator(IrBlock *b) {
+    if (b->last && irIsTerminator(b->last->op)) return b->last;
+    return NULL;
+}
+
+int irSuccessors(IrBlock *b, IrBlock **out) {
+    IrInst *t = irTerminator(b);
+    if (!t) return 0;
+    if (t->op == IR_JMP) { out[0] = t->target; return 1; }
+    if (t->op == IR_BR) { out[0] = t->target; out[1] = t->elseTarget; return 2; }
+    return 0;
+}
+
+int irHasSideEffects(IrInst *in) {
+    switch (in->op) {
+        case IR_STORE_LOCAL: case IR_STORE_MEM: case IR_STORE:
+        case IR_CALL: case IR_CALL_IND: case IR_VEC_LOOP: case IR_COUNT:
+        case IR_JMP: case IR_BR: case IR_RET:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+void irRemoveNops(IrFunction *fn) {
+    for (int i = 0; i < fn->blockCount; i++) {
+        IrBlock *b = fn->blocks[i];
+        IrInst *prev = NULL;
+        IrInst *p = b->first;
+        while (p) {
+            IrInst *nx = p->next;
+            if (p->op == IR_NOP) {
+                if (prev) prev->next = nx; else b->first = nx;
+                if (b->last == p) b->last = prev;
+                if (p->vec) free(p->vec->nodes);
+                free(p->args); free(p->sym); free(p->vec); free(p);
+            } else {
+                prev = p;
+            }
+            p = nx;
+        }
+    }
+}
+
+void irRenumberBlocks(IrFunction *fn) {
+    for (int i = 0; i < fn->blockCount; i++) fn->blocks[i]->id = i;
+}
+
+// Drops a predecessor edge, together with the matching phi operand.
+static void removePredAt(IrBlock *b, int idx) {
+    for (IrInst *p = b->first; p && p->op == IR_PHI; p = p->next) {
+        for (int k = idx; k + 1 < p->argCount; k++) p->args[k] = p->args[k + 1];
+        p->argCount--;
+    }
+    for (int k = idx; k + 1 < b->predCount; k++) b->preds[k] = b->preds[k + 1];
+    b->predCount--;
+}
+
+void irRemovePred(IrBlock *b, IrBlock *pred) {
+    int idx = irPredIndex(b, pred);
+    if (idx >= 0) removePredAt(b, idx);
+}
+
+void irRemoveUnreachable(IrFunction *fn) {
+    if (fn->blockCount == 0) return;
+    irRenumberBlocks(fn);
+    char *seen = calloc((size_t)fn->blockCount, 1);
+    IrBlock **stack = malloc(sizeof(IrBlock*) * (size_t)fn->blockCount);
+    int sp = 0;
+    stack[sp++] = fn->blocks[0];
+    seen[0] = 1;
+    while (sp) {
+        IrBlock *b = stack[--sp];
+        IrBlock *succ[2];
+        int n = irSuccessors(b, succ);
+        for (int i = 0; i < n; i++) {
+            if (!seen[succ[i]->id]) { seen[succ[i]->id] = 1; stack[sp++] = succ[i]; }
+        }
+    }
+    for (int i = 0; i < fn->blockCount; i++) {
+        IrBlock *b = fn->blocks[i];
+        if (!seen[i]) continue;
+        for (int k = b->predCount - 1; k >= 0; k--) {
+            if (!seen[b->preds[k]->id]) removePredAt(b, k);
+        }
+    }
+    int w = 0;
+    for (int i = 0; i < fn->blockCount; i++) {
+        if (seen[i]) fn->blocks[w++] = fn->blocks[i];
+    }
+    fn->blockCount = w;
+    irRenumberBlocks(fn);
+    free(seen);
+    free(stack);
+}
+
+// Reorders blocks into reverse postorder. Taken targets are visited last so
+// they come first in the result, which keeps then-branches and loop bodies
+// right after the branch that enters them.
+// The successor visited last ends up right after b in reverse postorder, and
+// codegen lets a branch fall through to the next block. That is the taken
+// target unless a profile says the other side runs more often.
+static int laidOutSuccessors(IrBlock *b, IrBlock **out) {
+    int sc = irSuccessors(b, out);
+    IrInst *t = irTerminator(b);
+    if (sc == 2 && t->count[1] > t->count[0]) {
+        IrBlock *tmp = out[0];
+        out[0] = out[1];
+        out[1] = tmp;
+    }
+    return sc;
+}
+
+void irSortRpo(IrFunction *fn) {
+    int n = fn->blockCount;
+    if (n == 0) return;
+    irRenumberBlocks(fn);
+    char *seen = calloc((size_t)n, 1);
+    IrBlock **order = malloc(sizeof(IrBlock*) * (size_t)n);
+    IrBlock **stack = malloc(sizeof(IrBlock*) * (size_t)n);
+    int *next = calloc((size_t)n, sizeof(int));
+    int sp = 0, count = 0;
+    stack[sp++] = fn->blocks[0];
+    seen[0] = 1;
+    while (sp) {
+        IrBlock *b = stack[sp - 1];
+        IrBlock *succ[2];
+        int sc = laidOutSuccessors(b, succ);
+        if (next[b->id] < sc) {
+            IrBlock *s = succ[sc - 1 - next[b->id]];
+            next[b->id]++;
+            if (!seen[s->id]) { seen[s->id] = 1; stack[sp++] = s; }
+            continue;
+        }
+        order[count++] = b;
+        sp--;
+    }
+    for (int i = 0; i < count; i++) fn->blocks[i] = order[count - 1 - i];
+    fn->blockCount = count;
+    irRenumberBlocks(fn);
+    free(seen);
+    free(order);
+    free(stack);
+    free(next);
+}
+
+static int resolveValue(int *repl, int v) {
+    while (repl[v] != v) v = repl[v];
+    return v;
+}
+
+void irReplaceValues(IrFunction *fn, int *repl) {
+    for (int i = 0; i < fn->blockCount; i++) {
+        for (IrInst *p = fn->blocks[i]->first; p; p = p->next) {
+            for (int k = 0; k < p->argCount; k++) p->args[k] = resolveValue(repl, p->args[k]);
+        }
+    }
+}
+
+int irSimplifyPhis(IrFunction *fn) {
+    int removed = 0;
+    int *repl = malloc(sizeof(int) * (size_t)(fn->valueCount ? fn->valueCount : 1));
+    for (;;) {
+        for (int v = 0; v < fn->valueCount; v++) repl[v] = v;
+        int changed = 0;
+        for (int i = 0; i < fn->blockCount; i++) {
+            for (IrInst *p = fn->blocks[i]->first; p && p->op == IR_PHI; p = p->next) {
+                int same = -1;
+                int trivial = 1;
+                for (int k = 0; k < p->argCount; k++) {
+                    int a = resolveValue(repl, p->args[k]);
+                    if (a == p->dst || a == same) continue;
+                    if (same >= 0) { trivial = 0; break; }
+                    same = a;
+                }
+                if (!trivial || same < 0) continue;
+                repl[p->dst] = same;
+                p->op = IR_NOP;
+                changed = 1;
+                removed++;
+            }
+        }
+        if (!changed) break;
+        irReplaceValues(fn, repl);
+        irRemoveNops(fn);
+    }
+    free(repl);
+    return removed;
+}
+
+static void retarget(IrInst *term, IrBlock *from, IrBlock *to) {
+    if (term->target == from) term->target = to;
+    if (term->op == IR_BR && term->elseTarget == from) term->elseTarget = to;
+}
+
+static void insertBlockAfter(IrFunction *fn, IrBlock *pos, IrBlock *b) {
+    // irNewBlock appended b at the end; move it right after pos
+    int at = pos->id + 1;
+    for (int k = fn->blockCount - 1; k > at; k--) fn->blocks[k] = fn->blocks[k - 1];
+    fn->blocks[at] = b;
+    irRenumberBlocks(fn);
+}
+
+void irSplitCriticalEdges(IrFunction *fn) {
+    irRenumberBlocks(fn);
+    int n = fn->blockCount;
+    for (int i = 0; i < n; i++) {
+        IrBlock *s = fn->blocks[i];
+        if (s->predCount < 2 || !s->first || s->first->op != IR_PHI) continue;
+        for (int k = 0; k < s->predCount; k++) {
+            IrBlock *p = s->preds[k];
+            IrInst *term = irTerminator(p);
+            if (!term || term->op != IR_BR) continue;
+            IrBlock *mid = irNewBlock(fn);
+            IrInst *j = irNewInst(IR_JMP);
+            j->target = s;
+            irAppend(mid, j);
+            irAddPred(mid, p);
+            retarget(term, s, mid);
+            s->preds[k] = mid;
+            insertBlockAfter(fn, p, mid);
+            if (p->id < i) i++;
+            n++;
+        }
+    }
+}
+
+typedef struct { int dst; int src; } ParCopy;
+
+static void emitCopy(IrBlock *b, int dst, int src) {
+    IrInst *c = irNewInst(IR_COPY);
+    c->dst = dst;
+    irAddArg(c, src);
+    irInsertBeforeTerminator(b, c);
+}
+
+// Sequentializes a parallel copy. A copy is emitted once its destination is
+// no longer read by a pending copy; cycles are broken through a fresh value.
+static void sequentializeCopies(IrFunction *fn, IrBlock *b, ParCopy *pc, int n) {
+    int pending = n;
+    char *done = calloc((size_t)(n ? n : 1), 1);
+    for (int i = 0; i < n; i++) {
+        if (pc[i].dst == pc[i].src) { done[i] = 1; pending--; }
+    }
+    while (pending) {
+        int progress = 0;
+        for (int i = 0; i < n; i++) {
+            if (done[i]) continue;
+            int blocked = 0;
+            for (int k = 0; k < n; k++) {
+                if (!done[k] && k != i && pc[k].src == pc[i].dst) { blocked = 1; break; }
+            }
+            if (blocked) continue;
+            emitCopy(b, pc[i].dst, pc[i].src);
+            done[i] = 1;
+            pending--;
+            progress = 1;
+        }
+        if (progress) continue;
+        for (int i = 0; i < n; i++) {
+            if (done[i]) continue;
+            int tmp = irNewValue(fn);
+            emitCopy(b, tmp, pc[i].dst);
+            for (int k = 0; k < n; k++) {
+                if (!done[k] && pc[k].src == pc[i].dst) pc[k].src = tmp;
+            }
+            break;
+        }
+    }
+    free(done);
+}
+
+// Whether v may be read on a path from the top of b before being redefined.
+static int liveAtBlock(IrFunction *fn, IrBlock *b, int v, char *seen, IrBlock **stack) {
+    memset(seen, 0, (size_t)fn->blockCount);
+    int sp = 0;
+    stack[sp++] = b;
+    seen[b->id] = 1;
+    while (sp) {
+        IrBlock *x = stack[--sp];
+        int killed = 0;
+        for (IrInst *p = x->first; p && !killed; p = p->next) {
+            for (int k = 0; k < p->argCount; k++) if (p->args[k] == v) return 1;
+            if (p->dst == v) killed = 1;
+        }
+        if (killed) continue;
+        IrBlock *succ[2];
+        int n = irSuccessors(x, succ);
+        for (int i = 0; i < n; i++) {
+            if (!seen[succ[i]->id]) { seen[succ[i]->id] = 1; stack[sp++] = succ[i]; }
+        }
+    }
+    return 0;
+}
+
+// A block that only holds the copies of a split critical edge costs a taken
+// jump each time the edge is used, which for a rotated loop is every
+// iteration. When the copied values are dead along the branch's other edge,
+// the copies can run before the branch instead (ahead of the comparison
+// feeding it, so the two stay adjacent) and the block goes away. Only one
+// edge per branch is treated this way.
+static void hoistEdgeCopies(IrFunction *fn) {
+    irRenumberBlocks(fn);
+    int n = fn->blockCount;
+    if (n <= 0) return;
+    char *hoisted = calloc((size_t)n, 1);
+    char *removed = calloc((size_t)n, 1);
+    char *seen = malloc((size_t)n);
+    IrBlock **stack = malloc(sizeof(IrBlock*) * (size_t)n);
+    for (int i = 0; i < n; i++) {
+        IrBlock *m = fn->blocks[i];
+        IrInst *jmp = irTerminator(m);
+        if (m->predCount != 1 || !jmp || jmp->op != IR_JMP || m->first == jmp) continue;
+        int onlyCopies = 1;
+        for (IrInst *c = m->first; c != jmp; c = c->next) if (c->op != IR_COPY) onlyCopies = 0;
+        IrBlock *p = m->preds[0];
+        IrInst *br = irTerminator(p);
+        if (!onlyCopies || !br || br->op != IR_BR || hoisted[p->id]) continue;
+        IrBlock *other = br->target == m ? br->elseTarget : br->target;
+
+        IrInst *anchor = br, *before = NULL, *prev = NULL;
+        for (IrInst *q = p->first; q != br; q = q->next) { before = prev; prev = q; }
+        if (prev && prev->op == IR_BIN && prev->dst == br->args[0]) anchor = prev;
+        else before = prev;
+
+        int ok = 1;
+        for (IrInst *c = m->first; ok && c != jmp; c = c->next) {
+            for (IrInst *a = anchor; a; a = a->next) {
+                for (int k = 0; k < a->argCount; k++) if (a->args[k] == c->dst) ok = 0;
+                if (a->dst >= 0 && a->dst == c->args[0]) ok = 0;
+            }
+            if (ok && liveAtBlock(fn, other, c->dst, seen, stack)) ok = 0;
+        }
+        if (!ok) continue;
+        // Operands of the anchor that are copied are read back from the copy,
+        // so the original value can die there and share its register.
+        for (int k = 0; k < anchor->argCount; k++) {
+            for (IrInst *c = m->first; c != jmp; c = c->next) {
+                if (c->args[0] == anchor->args[k]) { anchor->args[k] = c->dst; break; }
+            }
+        }
+
+        IrInst *lastCopy = m->first;
+        while (lastCopy->next != jmp) lastCopy = lastCopy->next;
+        lastCopy->next = anchor;
+        if (before) before->next = m->first; else p->first = m->first;
+        retarget(br, m, jmp->target);
+        jmp->target->preds[irPredIndex(jmp->target, m)] = p;
+        m->first = m->last = jmp;
+        hoisted[p->id] = 1;
+        removed[i] = 1;
+    }
+    int w = 0;
+    for (int i = 0; i < n; i++) {
+        if (removed[i]) free(fn->blocks[i]->first); else fn->blocks[w++] = fn->blocks[i];
+    }
+    fn->blockCount = w;
+    irRenumberBlocks(fn);
+    free(hoisted);
+    free(removed);
+    free(seen);
+    free(stack);
+}
+
+void irDestructSsa(IrFunction *fn) {
+    irSplitCriticalEdges(fn);
+    for (int i = 0; i < fn->blockCount; i++) {
+        IrBlock *s = fn->blocks[i];
+        if (!s->first || s->first->op != IR_PHI) continue;
+        int phiCount = 0;
+        for (IrInst *p = s->first; p && p->op == IR_PHI; p = p->next) phiCount++;
+        ParCopy *pc = malloc(sizeof(ParCopy) * (size_t)phiCount);
+        for (int k = 0; k < s->predCount; k++) {
+            int n = 0;
+            for (IrInst *p = s->first; p && p->op == IR_PHI; p = p->next) {
+                pc[n].dst = p->dst;
+                pc[n].src = p->args[k];
+                n++;
+            }
+            sequentializeCopies(fn, s->preds[k], pc, n);
+        }
+        free(pc);
+        for (IrInst *p = s->first; p && p->op == IR_PHI; p = p->next) p->op = IR_NOP;
+    }
+    irRemoveNops(fn);
+    hoistEdgeCopies(fn);
+}
+
+static const char *binOpName(BinOpKind op) {
+    switch (op) {
+        case BIN_ADD: return "add";
+        case BIN_SUB: return "sub";
+        case BIN_MUL: return "mul";
+        case BIN_DIV: return "div";
+        case BIN_MOD: return "mod";
+        case BIN_EQ: return "eq";
+        case BIN_NEQ: return "ne";
+        case BIN_LT: return "lt";
+        case BIN_GT: return "gt";
+        case BIN_LE: return "le";
+        case BIN_GE: return "ge";
+    }
+    return "?";
+}
+
+static const char *opName(IrOp op) {
+    switch (op) {
+        case IR_NOP: return "nop";
+        case IR_CONST: return "const";
+        case IR_PARAM: return "param";
+        case IR_COPY: return "copy";
+        case IR_BIN: return "bin";
+        case IR_PHI: return "phi";
+        case IR_FUNC_ADDR: return "funcaddr";
+        case IR_LOCAL_ADDR: return "localaddr";
+        case IR_LOAD_LOCAL: return "loadlocal";
+        case IR_STORE_LOCAL: return "storelocal";
+        case IR_LOAD_MEM: return "loadmem";
+        case IR_STORE_MEM: return "storemem";
+        case IR_LOAD: return "load";
+        case IR_STORE: return "store";
+        case IR_CALL: return "call";
+        case IR_CALL_IND: return "callind";
+        case IR_JMP: return "jmp";
+        case IR_BR: return "br";
+        case IR_RET: return "ret";
+        case IR_VEC_LOOP: return "vecloop";
+        case IR_COUNT: return "count";
+    }
+    return "?";
+}
+
+// one node per entry: "n2 = n0 + n1", "n0 = mem[i+8+a3]", "acc += n2"
+static void dumpVecKernel(FILE *out, IrVecKernel *k) {
+    fprintf(out, " {");
+    for (int i = 0; i < k->count; i++) {
+        IrVecNode *n = &k->nodes[i];
+        fprintf(out, "%s", i ? "; " : " ");
+        if (n->op == VEC_LOAD || n->op == VEC_STORE) {
+            if (n->op == VEC_LOAD) fprintf(out, "n%d = ", i);
+            fprintf(out, "mem[i%+lld", (long long)n->disp);
+            if (n->arg >= 0) fprintf(out, "+a%d", n->arg);
+            fprintf(out, "]");
+            if (n->op == VEC_STORE) fprintf(out, " = n%d", n->a);
+        } else if (n->op == VEC_SPLAT) {
+            fprintf(out, "n%d = a%d", i, n->arg);
+        } else if (n->op == VEC_ADD || n->op == VEC_SUB) {
+            fprintf(out, "n%d = n%d %c n%d", i, n->a, n->op == VEC_ADD ? '+' : '-', n->b);
+        } else {
+            fprintf(out, "acc %c= n%d", n->op == VEC_ACC_ADD ? '+' : '-', n->a);
+        }
+    }
+    fprintf(out, " }");
+}
+
+void irDumpFunction(FILE *out, IrFunction *fn) {
+    fprintf(out, "func %s(%d params, %d slots)\n", fn->name, fn->paramCount, fn->slotCount);
+    for (int i = 0; i < fn->blockCount; i++) {
+        IrBlock *b = fn->blocks[i];
+        fprintf(out, "b%d:", b->id);
+        if (b->predCount) {
+            fprintf(out, "  ; preds");
+            for (int k = 0; k < b->predCount; k++) fprintf(out, " b%d", b->preds[k]->id);
+        }
+        fprintf(out, "\n");
+        for (IrInst *p = b->first; p; p = p->next) {
+            fprintf(out, "    ");
+            if (p->dst >= 0) fprintf(out, "v%d = ", p->dst);
+            fprintf(out, "%s", p->op == IR_BIN ? binOpName(p->binop) : opName(p->op));
+            if (p->op == IR_CONST || p->op == IR_PARAM || p->op == IR_LOCAL_ADDR ||
+                p->op == IR_LOAD_LOCAL || p->op == IR_STORE_LOCAL || p->op == IR_COUNT) {
+                fprintf(out, " #%lld", (long long)p->imm);
+            }
+            if (p->sym) fprintf(out, " %s", p->sym);
+            for (int k = 0; k < p->argCount; k++) fprintf(out, "%s v%d", k ? "," : "", p->args[k]);
+            if (p->op == IR_JMP) fprintf(out, " b%d", p->target->id);
+            if (p->op == IR_BR) fprintf(out, ", b%d, b%d", p->target->id, p->elseTarget->id);
+            if (p->op == IR_VEC_LOOP) dumpVecKernel(out, p->vec);
+            if ((p->op == IR_BR || p->op == IR_CALL_IND) && (p->count[0] || p->count[1])) {
+                fprintf(out, "  ; profile %lld/%lld", (long long)p->count[0], (long long)p->count[1]);
+            }
+            fprintf(out, "\n");
+        }
+    }
+}
+
+void irDumpModule(FILE *out, IrModule *m) {
+    for (IrFunction *fn = m->functions; fn; fn = fn->next) irDumpFunction(out, fn);
+}
@@ -1,25 +1,166 @@
 #ifndef IR_H
 #define IR_H
 
-// Minimal IR placeholder for future passes
-typedef enum { IR_NOP } IrKind;
+#include <stdint.h>
+#include <stdio.h>
+#include "ast.h"
+
+// SSA three-address IR produced by lowerProgram.
+//
+// Every instruction defines at most one virtual value (dst, -1 if none) and
+// reads its operands by value number from args[]. A function is an array of
+// basic blocks in layout order; blocks[0] is the entry block and every block
+// ends in exactly one terminator (IR_JMP, IR_BR or IR_RET).
+//
+// Invariants kept by lowering and by every pass:
+// - IR_PARAM instructions only appear at the top of the entry block.
+// - IR_PHI instructions only appear at the top of a block, and their
+//   operands are parallel to the owning block's preds[].
+// - IR_BR always has two distinct targets.
+typedef enum {
+    IR_NOP,
+    IR_CONST,        // dst = imm
+    IR_PARAM,        // dst = incoming parameter #imm
+    IR_COPY,         // dst = args[0]
+    IR_BIN,          // dst = args[0] <binop> args[1]
+    IR_PHI,          // dst = phi(args[i] along preds[i])
+    IR_FUNC_ADDR,    // dst = &sym
+    IR_LOCAL_ADDR,   // dst = address of frame slot imm
+    IR_LOAD_LOCAL,   // dst = frame slot imm
+    IR_STORE_LOCAL,  // frame slot imm = args[0]
+    IR_LOAD_MEM,     // dst = mem[args[0]]
+    IR_STORE_MEM,    // mem[args[0]] = args[1]
+    IR_LOAD,         // dst = args[0][args[1]]  (8-byte elements)
+    IR_STORE,        // args[0][args[1]] = args[2]
+    IR_CALL,         // dst = sym(args...)
+    IR_CALL_IND,     // dst = (*args[0])(args[1..])
+    IR_JMP,          // goto target
+    IR_BR,           // if (args[0] != 0) goto target else goto elseTarget
+    IR_RET,          // return args[0]
+    IR_VEC_LOOP,     // runs vec over mem; dst = args[2] + accumulator (see IrVecKernel)
+    IR_COUNT         // profile counter imm += args[0], or += 1 without args
+} IrOp;
+
+// Body of an IR_VEC_LOOP, built by opt_vectorize.c. The loop runs args[1]
+// times starting at element index i = args[0]; each trip evaluates the
+// nodes in order on the 4 lanes i..i+3, then adds 4 to i. Node operands
+// a and b name earlier nodes, arg names an operand of the instruction. When
+// the instruction has a dst, the accumulator starts at 0 in every lane and
+// dst is args[2] plus the sum of its lanes.
+typedef enum {
+    VEC_LOAD,       // mem[i + disp (+ args[arg])]
+    VEC_STORE,      // mem[i + disp (+ args[arg])] = a
+    VEC_SPLAT,      // args[arg] in every lane
+    VEC_ADD,        // a + b
+    VEC_SUB,        // a - b
+    VEC_ACC_ADD,    // accumulator += a
+    VEC_ACC_SUB     // accumulator -= a
+} IrVecOp;
+
+typedef struct {
+    IrVecOp op;
+    int a, b;
+    int arg;                    // -1 when a load or store has no variable offset
+    int64_t disp;
+} IrVecNode;
+
+typedef struct IrVecKernel {
+    IrVecNode *nodes;
+    int count;
+} IrVecKernel;
 
 typedef struct IrInst {
-    IrKind kind;
+    IrOp op;
+    BinOpKind binop;            // IR_BIN
+    int dst;                    // defined value, -1 if none
+    int *args;
+    int argCount;
+    int argCap;
+    int64_t imm;                // IR_CONST value, IR_PARAM index, frame slot
+    char *sym;                  // IR_CALL / IR_FUNC_ADDR symbol, IR_CALL_IND
+                                // most frequent profiled target (owned)
+    struct IrBlock *target;     // IR_JMP / IR_BR taken target
+    struct IrBlock *elseTarget; // IR_BR fall-through target
+    IrVecKernel *vec;           // IR_VEC_LOOP body (owned)
+    int64_t count[2];           // profile: IR_BR times taken / not taken,
+                                // IR_CALL_IND calls that went to sym / elsewhere
     struct IrInst *next;
 } IrInst;
 
+typedef struct IrBlock {
+    int id;                     // index in IrFunction.blocks
+    IrInst *first;
+    IrInst *last;
+    struct IrBlock **preds;
+    int predCount;
+    int predCap;
+} IrBlock;
+
 typedef struct IrFunction {
-    char *name;
-    IrInst *insts;
+    char *name;                 // symbol name (main is emitted as lang_main)
+    int paramCount;
+    int slotCount;              // frame slots for address-taken locals
+    int valueCount;
+    IrBlock **blocks;
+    int blockCount;
+    int blockCap;
+    int64_t entryCount;         // profile: times the function was entered
     struct IrFunction *next;
 } IrFunction;
 
 typedef struct IrModule {
     IrFunction *functions;
+    int maxParamCount;
+    int profileCounters;        // counters used by IR_COUNT (-fprofile-generate)
+    uint64_t profileChecksum;   // identifies the instrumented program
+    int profiled;               // entryCount and count[] come from a profile
 } IrModule;
 
+// The functions of a module in module order, with a hash of their names so
+// that call symbols resolve in constant time. Functions added to the module
+// later are not in it.
+typedef struct {
+    IrFunction **fns;
+    int count;
+    int *slots;                 // function index + 1, 0 for an empty slot
+    int slotMask;
+} IrFunctionTable;
+
 IrModule *newIrModule(void);
+IrFunction *newIrFunction(const char *name, int paramCount);
+IrBlock *irNewBlock(IrFunction *fn);
+int irNewValue(IrFunction *fn);
+IrInst *irNewInst(IrOp op);
+void irAddArg(IrInst *in, int value);
+void irAddPred(IrBlock *b, IrBlock *pred);
+int irPredIndex(IrBlock *b, IrBlock *pred);
+void irRemovePred(IrBlock *b, IrBlock *pred);   // also drops the phi operands
 
-#endif
+void irAppend(IrBlock *b, IrInst *in);
+void irPrepend(IrBlock *b, IrInst *in);
+void irInsertAfter(IrBlock *b, IrInst *pos, IrInst *in);
+void irInsertBeforeTerminator(IrBlock *b, IrInst *in);
+IrInst *irTerminator(IrBlock *b);
+int irSuccessors(IrBlock *b, IrBlock **out);
+
+void irBuildFunctionTable(IrModule *m, IrFunctionTable *t);
+int irFindFunction(const IrFunctionTable *t, const char *sym);  // -1 if not a function of m
+void irFreeFunctionTable(IrFunctionTable *t);
+
+int irIsTerminator(IrOp op);
+int irHasSideEffects(IrInst *in);
 
+// cleanup and SSA utilities
+void irRemoveNops(IrFunction *fn);
+void irRemoveUnreachable(IrFunction *fn);
+void irReplaceValues(IrFunction *fn, int *repl);
+int irSimplifyPhis(IrFunction *fn);
+void irRenumberBlocks(IrFunction *fn);
+void irSortRpo(IrFunction *fn);
+void irSplitCriticalEdges(IrFunction *fn);
+void irDestructSsa(IrFunction *fn);
+
+void irDumpFunction(FILE *out, IrFunction *fn);
+void irDumpModule(FILE *out, IrModule *m);
+
+#endif
@@ -0,0 +1,214 @@
+#include "layout.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    int from;
+    int to;
+    double weight;
+} CallEdge;
+
+typedef struct {
+    IrFunctionTable funcs;
+    int *size;              // per function: instructions, a stand-in for code size
+    double *heat;           // per function
+    char *cold;             // per function
+    CallEdge *edges;
+    int edgeCount;
+    int edgeCap;
+    int *head;              // per function: first function of its chain
+    int *next;              // per function: next in its chain, -1 at the end
+    int *tail;              // per chain head: last function of the chain
+    int *chainSize;         // per chain head
+} Layout;
+
+// Loop depth of every block: a back edge from t to h puts the blocks from h
+// to t of the reverse postorder inside one more loop.
+static int *loopDepths(IrFunction *fn) {
+    irRenumberBlocks(fn);
+    int *depth = calloc((size_t)(fn->blockCount ? fn->blockCount : 1), sizeof(int));
+    for (int h = 0; h < fn->blockCount; h++) {
+        IrBlock *b = fn->blocks[h];
+        for (int k = 0; k < b->predCount; k++) {
+            int t = b->preds[k]->id;
+            for (int i = h; i <= t; i++) depth[i]++;
+        }
+    }
+    return depth;
+}
+
+static void addEdge(Layout *l, int from, int to, double weight) {
+    if (l->edgeCount == l->edgeCap) {
+        l->edgeCap = l->edgeCap ? l->edgeCap * 2 : 64;
+        l->edges = realloc(l->edges, sizeof(CallEdge) * (size_t)l->edgeCap);
+    }
+    l->edges[l->edgeCount].from = from;
+    l->edges[l->edgeCount].to = to;
+    l->edges[l->edgeCount].weight = weight;
+    l->edgeCount++;
+}
+
+// Static edge weights, one edge per caller/callee pair, and the functions
+// main can reach.
+static void buildCallGraph(Layout *l, char *reached) {
+    int n = l->funcs.count;
+    double *weightTo = malloc(sizeof(double) * (size_t)n);
+    for (int f = 0; f < n; f++) {
+        IrFunction *fn = l->funcs.fns[f];
+        int *depth = loopDepths(fn);
+        memset(weightTo, 0, sizeof(double) * (size_t)n);
+        l->size[f] = 0;
+        for (int i = 0; i < fn->blockCount; i++) {
+            int d = depth[i] < 4 ? depth[i] : 4;
+            for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+                l->size[f]++;
+                if (in->op != IR_CALL) continue;
+                int k = irFindFunction(&l->funcs, in->sym);
+                if (k >= 0 && k != f) weightTo[k] += (double)(1 << (3 * d));
+            }
+        }
+        for (int k = 0; k < n; k++) {
+            if (weightTo[k] > 0) addEdge(l, f, k, weightTo[k]);
+        }
+        free(depth);
+    }
+    free(weightTo);
+
+    // reachability through calls and taken addresses
+    int *stack = malloc(sizeof(int) * (size_t)n);
+    int sp = 0;
+    int root = irFindFunction(&l->funcs, "lang_main");
+    if (root < 0) {
+        memset(reached, 1, (size_t)n);
+    } else {
+        reached[root] = 1;
+        stack[sp++] = root;
+    }
+    while (sp) {
+        IrFunction *fn = l->funcs.fns[stack[--sp]];
+        for (int i = 0; i < fn->blockCount; i++) {
+            for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+                if (in->op != IR_CALL && in->op != IR_FUNC_ADDR) continue;
+                int k = irFindFunction(&l->funcs, in->sym);
+                if (k >= 0 && !reached[k]) { reached[k] = 1; stack[sp++] = k; }
+            }
+        }
+    }
+    free(stack);
+}
+
+static void measureHeat(Layout *l, IrModule *m) {
+    int n = l->funcs.count;
+    double *staticIn = calloc((size_t)n, sizeof(double));
+    for (int e = 0; e < l->edgeCount; e++) staticIn[l->edges[e].to] += l->edges[e].weight;
+    for (int f = 0; f < n; f++) l->heat[f] = m->profiled ? (double)l->funcs.fns[f]->entryCount : staticIn[f];
+    if (m->profiled) {
+        // share each callee's entries among its call sites
+        for (int e = 0; e < l->edgeCount; e++) {
+            CallEdge *c = &l->edges[e];
+            c->weight = (double)l->funcs.fns[c->to]->entryCount * c->weight / staticIn[c->to];
+        }
+    }
+    free(staticIn);
+}
+
+static int heavierEdge(const void *a, const void *b) {
+    const CallEdge *x = a, *y = b;
+    if (x->weight != y->weight) return x->weight > y->weight ? -1 : 1;
+    if (x->from != y->from) return x->from - y->from;
+    return x->to - y->to;
+}
+
+// Appends chain b to chain a.
+static void joinChains(Layout *l, int a, int b) {
+    l->next[l->tail[a]] = b;
+    l->tail[a] = l->tail[b];
+    l->chainSize[a] += l->chainSize[b];
+    for (int f = b; f >= 0; f = l->next[f]) l->head[f] = a;
+}
+
+static void buildChains(Layout *l) {
+    for (int f = 0; f < l->funcs.count; f++) {
+        l->head[f] = f;
+        l->next[f] = -1;
+        l->tail[f] = f;
+        l->chainSize[f] = l->size[f];
+    }
+    qsort(l->edges, (size_t)l->edgeCount, sizeof(CallEdge), heavierEdge);
+    for (int e = 0; e < l->edgeCount; e++) {
+        CallEdge *c = &l->edges[e];
+        if (c->weight <= 0 || l->cold[c->from] || l->cold[c->to]) continue;
+        int a = l->head[c->from], b = l->head[c->to];
+        if (a == b || l->chainSize[a] + l->chainSize[b] > LAYOUT_MAX_CHAIN) continue;
+        // keep the caller in front of the callee unless that leaves the
+        // callee further away
+        if (c->to != b && c->from == a && l->tail[b] == c->to) joinChains(l, b, a);
+        else joinChains(l, a, b);
+    }
+}
+
+static double chainHeat(Layout *l, int h) {
+    double heat = 0;
+    for (int f = h; f >= 0; f = l->next[f]) {
+        if (l->heat[f] > heat) heat = l->heat[f];
+    }
+    return heat;
+}
+
+IrFunction **layoutFunctions(IrModule *m) {
+    Layout layout;
+    Layout *l = &layout;
+    memset(l, 0, sizeof(*l));
+    irBuildFunctionTable(m, &l->funcs);
+    int n = l->funcs.count;
+    IrFunction **order = malloc(sizeof(IrFunction*) * (size_t)(n ? n : 1));
+    if (n == 0) {
+        irFreeFunctionTable(&l->funcs);
+        return order;
+    }
+    l->size = malloc(sizeof(int) * (size_t)n);
+    l->heat = malloc(sizeof(double) * (size_t)n);
+    l->cold = malloc((size_t)n);
+    l->head = malloc(sizeof(int) * (size_t)n);
+    l->next = malloc(sizeof(int) * (size_t)n);
+    l->tail = malloc(sizeof(int) * (size_t)n);
+    l->chainSize = malloc(sizeof(int) * (size_t)n);
+    char *reached = calloc((size_t)n, 1);
+    buildCallGraph(l, reached);
+    measureHeat(l, m);
+    for (int f = 0; f < n; f++) l->cold[f] = !reached[f] || (m->profiled && l->funcs.fns[f]->entryCount == 0);
+    buildChains(l);
+
+    // chains hottest first (selection keeps ties in source order), then the
+    // cold functions
+    char *placed = calloc((size_t)n, 1);
+    int at = 0;
+    for (;;) {
+        int best = -1;
+        double bestHeat = 0;
+        for (int f = 0; f < n; f++) {
+            if (l->head[f] != f || placed[f] || l->cold[f]) continue;
+            double heat = chainHeat(l, f);
+            if (best < 0 || heat > bestHeat) { best = f; bestHeat = heat; }
+        }
+        if (best < 0) break;
+        placed[best] = 1;
+        for (int f = best; f >= 0; f = l->next[f]) order[at++] = l->funcs.fns[f];
+    }
+    for (int f = 0; f < n; f++) {
+        if (l->cold[f]) order[at++] = l->funcs.fns[f];
+    }
+
+    free(placed);
+    free(reached);
+    irFreeFunctionTable(&l->funcs);
+    free(l->size);
+    free(l->heat);
+    free(l->cold);
+    free(l->edges);
+    free(l->head);
+    free(l->next);
+    free(l->tail);
+    free(l->chainSize);
+    return order;
+}
@@ -0,0 +1,28 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include "ir.h"
+
+// Function layout for the emitted .text (Pettis & Hansen).
+//
+// Every direct call site weighs 8^d, where d is the depth of the loops
+// around it (up to 4). With a profile, a callee's entry count is shared out
+// among its callers in proportion to those weights. Call graph edges are
+// then taken heaviest first, and the chains holding their two ends are
+// joined as long as the result stays within LAYOUT_MAX_CHAIN instructions,
+// about a page of code, so functions that call each other often end up next
+// to each other.
+//
+// Chains follow each other from the hottest down: by entry count with a
+// profile, and by the weight of the calls into them otherwise. Cold
+// functions go last, in source order: those main cannot reach through calls
+// or function addresses (all their calls were inlined, say), and those that
+// never ran when profiled.
+
+#define LAYOUT_MAX_CHAIN 1024
+
+// Returns the functions of m in emission order (malloc'd, one entry per
+// function).
+IrFunction **layoutFunctions(IrModule *m);
+
+#endif
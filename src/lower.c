@@ -1,9 +1,609 @@
 #include "lower.h"
+#include "utils.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-int lowerProgram(Program *p) {
-    // minimal: no-op lowering (AST used directly by codegen)
-    (void)p;
-    return 1;
+// SSA construction follows Braun et al., "Simple and Efficient Construction
+// of Static Single Assignment Form": variables are looked up per block while
+// the CFG is being built, and phis are created lazily. A block is sealed once
+// all of its predecessors are known; reads in unsealed blocks (loop headers)
+// create incomplete phis that get their operands when the block is sealed.
+
+typedef struct FnSig {
+    char *name;
+    int paramCount;
+    struct FnSig *next;
+} FnSig;
+
+typedef struct {
+    int *defs;      // current SSA value per variable, -1 if none yet
+    int sealed;
+} BlockState;
+
+typedef struct {
+    IrBlock *block;
+    int var;
+    IrInst *phi;
+} IncompletePhi;
+
+typedef struct {
+    IrModule *mod;
+    FnSig *sigs;
+    IrFunction *fn;
+    IrBlock *cur;
+    char **vars;            // parameters first, then locals in first-assignment order
+    int varCount;
+    int varCap;
+    int memoryLocals;       // 1 when locals live in frame slots instead of SSA values
+    int zeroValue;
+    BlockState *states;
+    int stateCap;
+    IncompletePhi *incomplete;
+    int incompleteCount;
+    int incompleteCap;
+} LowerCtx;
+
+static const char *symbolFor(const char *name) {
+    return strcmp(name, "main") == 0 ? "lang_main" : name;
+}
+
+static FnSig *findSig(LowerCtx *c, const char *name) {
+    for (FnSig *s = c->sigs; s; s = s->next) if (strcmp(s->name, name) == 0) return s;
+    return NULL;
+}
+
+static int findVar(LowerCtx *c, const char *name) {
+    for (int i = 0; i < c->varCount; i++) if (strcmp(c->vars[i], name) == 0) return i;
+    return -1;
+}
+
+static void addVar(LowerCtx *c, const char *name) {
+    if (findVar(c, name) >= 0) return;
+    if (c->varCount == c->varCap) {
+        c->varCap = c->varCap ? c->varCap * 2 : 16;
+        c->vars = realloc(c->vars, sizeof(char*) * (size_t)c->varCap);
+    }
+    c->vars[c->varCount++] = strDup(name);
+}
+
+static void collectAssignedVars(LowerCtx *c, Stmt *s) {
+    for (Stmt *p = s; p; p = p->next) {
+        if (p->kind == NODE_STMT_ASSIGN) addVar(c, p->assign.lhs);
+        else if (p->kind == NODE_STMT_BLOCK) collectAssignedVars(c, p->blockBody);
+        else if (p->kind == NODE_STMT_IF) {
+            collectAssignedVars(c, p->ifStmt.thenBranch);
+            if (p->ifStmt.elseBranch) collectAssignedVars(c, p->ifStmt.elseBranch);
+        } else if (p->kind == NODE_STMT_WHILE) collectAssignedVars(c, p->whileStmt.body);
+    }
+}
+
+static int exprTakesLocalAddr(LowerCtx *c, Expr *e) {
+    if (!e) return 0;
+    switch (e->kind) {
+        case EX_INT: case EX_VAR: return 0;
+        case EX_ADDR: return findVar(c, e->addrName) >= 0;
+        case EX_INDEX: return exprTakesLocalAddr(c, e->index.arr) || exprTakesLocalAddr(c, e->index.index);
+        case EX_BINOP: return exprTakesLocalAddr(c, e->binop.left) || exprTakesLocalAddr(c, e->binop.right);
+        case EX_CALL:
+            if (exprTakesLocalAddr(c, e->call.fn)) return 1;
+            for (int i = 0; i < e->call.argCount; i++) if (exprTakesLocalAddr(c, e->call.args[i])) return 1;
+            return 0;
+    }
+    return 0;
+}
+
+static int stmtTakesLocalAddr(LowerCtx *c, Stmt *s) {
+    for (Stmt *p = s; p; p = p->next) {
+        switch (p->kind) {
+            case NODE_STMT_ASSIGN: if (exprTakesLocalAddr(c, p->assign.rhs)) return 1; break;
+            case NODE_STMT_RETURN: return exprTakesLocalAddr(c, p->retExpr);   // the rest is unreachable
+            case NODE_STMT_EXPR: if (exprTakesLocalAddr(c, p->exprStmt)) return 1; break;
+            case NODE_STMT_BLOCK: if (stmtTakesLocalAddr(c, p->blockBody)) return 1; break;
+            case NODE_STMT_IF:
+                if (exprTakesLocalAddr(c, p->ifStmt.cond)) return 1;
+                if (stmtTakesLocalAddr(c, p->ifStmt.thenBranch)) return 1;
+                if (stmtTakesLocalAddr(c, p->ifStmt.elseBranch)) return 1;
+                break;
+            case NODE_STMT_WHILE:
+                if (exprTakesLocalAddr(c, p->whileStmt.cond)) return 1;
+                if (stmtTakesLocalAddr(c, p->whileStmt.body)) return 1;
+                break;
+            default: break;
+        }
+    }
+    return 0;
+}
+
+static IrBlock *newBlock(LowerCtx *c, int sealed) {
+    IrBlock *b = irNewBlock(c->fn);
+    if (b->id >= c->stateCap) {
+        int old = c->stateCap;
+        c->stateCap = c->stateCap ? c->stateCap * 2 : 16;
+        while (c->stateCap <= b->id) c->stateCap *= 2;
+        c->states = realloc(c->states, sizeof(BlockState) * (size_t)c->stateCap);
+        memset(&c->states[old], 0, sizeof(BlockState) * (size_t)(c->stateCap - old));
+    }
+    BlockState *st = &c->states[b->id];
+    st->defs = malloc(sizeof(int) * (size_t)(c->varCount ? c->varCount : 1));
+    for (int i = 0; i < c->varCount; i++) st->defs[i] = -1;
+    st->sealed = sealed;
+    return b;
+}
+
+static IrInst *emit(LowerCtx *c, IrOp op, int hasDst) {
+    IrInst *in = irNewInst(op);
+    if (hasDst) in->dst = irNewValue(c->fn);
+    irAppend(c->cur, in);
+    return in;
+}
+
+static int emitConst(LowerCtx *c, int64_t v) {
+    IrInst *in = emit(c, IR_CONST, 1);
+    in->imm = v;
+    return in->dst;
+}
+
+static int isTerminated(LowerCtx *c) { return irTerminator(c->cur) != NULL; }
+
+static void emitJmp(LowerCtx *c, IrBlock *to) {
+    IrInst *j = emit(c, IR_JMP, 0);
+    j->target = to;
+    irAddPred(to, c->cur);
+}
+
+// Locals that are read before any assignment observe 0.
+static int zeroValue(LowerCtx *c) {
+    if (c->zeroValue >= 0) return c->zeroValue;
+    IrBlock *entry = c->fn->blocks[0];
+    IrInst *pos = NULL;
+    for (IrInst *p = entry->first; p && p->op == IR_PARAM; p = p->next) pos = p;
+    IrInst *in = irNewInst(IR_CONST);
+    in->dst = irNewValue(c->fn);
+    in->imm = 0;
+    irInsertAfter(entry, pos, in);
+    c->zeroValue = in->dst;
+    return in->dst;
+}
+
+static void writeVariable(LowerCtx *c, int var, IrBlock *b, int value) {
+    c->states[b->id].defs[var] = value;
+}
+
+static int readVariable(LowerCtx *c, int var, IrBlock *b);
+
+static IrInst *newPhi(LowerCtx *c, IrBlock *b) {
+    IrInst *phi = irNewInst(IR_PHI);
+    phi->dst = irNewValue(c->fn);
+    irPrepend(b, phi);
+    return phi;
+}
+
+static void addPhiOperands(LowerCtx *c, int var, IrInst *phi, IrBlock *b) {
+    for (int i = 0; i < b->predCount; i++) irAddArg(phi, readVariable(c, var, b->preds[i]));
+}
+
+static int readVariableRecursive(LowerCtx *c, int var, IrBlock *b) {
+    int val;
+    if (!c->states[b->id].sealed) {
+        IrInst *phi = newPhi(c, b);
+        if (c->incompleteCount == c->incompleteCap) {
+            c->incompleteCap = c->incompleteCap ? c->incompleteCap * 2 : 16;
+            c->incomplete = realloc(c->incomplete, sizeof(IncompletePhi) * (size_t)c->incompleteCap);
+        }
+        c->incomplete[c->incompleteCount].block = b;
+        c->incomplete[c->incompleteCount].var = var;
+        c->incomplete[c->incompleteCount].phi = phi;
+        c->incompleteCount++;
+        val = phi->dst;
+    } else if (b->predCount == 0) {
+        val = zeroValue(c);
+    } else if (b->predCount == 1) {
+        val = readVariable(c, var, b->preds[0]);
+    } else {
+        IrInst *phi = newPhi(c, b);
+        writeVariable(c, var, b, phi->dst);
+        addPhiOperands(c, var, phi, b);
+        val = phi->dst;
+    }
+    writeVariable(c, var, b, val);
+    return val;
+}
+
+static int readVariable(LowerCtx *c, int var, IrBlock *b) {
+    int v = c->states[b->id].defs[var];
+    if (v >= 0) return v;
+    return readVariableRecursive(c, var, b);
+}
+
+static void sealBlock(LowerCtx *c, IrBlock *b) {
+    for (int i = 0; i < c->incompleteCount; i++) {
+        if (c->incomplete[i].block != b) continue;
+        addPhiOperands(c, c->incomplete[i].var, c->incomplete[i].phi, b);
+        c->incomplete[i] = c->incomplete[--c->incompleteCount];
+        i--;
+    }
+    c->states[b->id].sealed = 1;
+}
+
+static int readLocal(LowerCtx *c, int var) {
+    if (!c->memoryLocals) return readVariable(c, var, c->cur);
+    IrInst *in = emit(c, IR_LOAD_LOCAL, 1);
+    in->imm = var;
+    return in->dst;
+}
+
+static void writeLocal(LowerCtx *c, int var, int value) {
+    if (!c->memoryLocals) { writeVariable(c, var, c->cur, value); return; }
+    IrInst *in = emit(c, IR_STORE_LOCAL, 0);
+    in->imm = var;
+    irAddArg(in, value);
+}
+
+static int lowerExpr(LowerCtx *c, Expr *e);
+
+static int isBuiltinCall(Expr *e, const char *name) {
+    return e->call.fn->kind == EX_VAR && strcmp(e->call.fn->varName, name) == 0;
+}
+
+// Bulk mem builtins, flush() and the input builtins, and the runtime routine
+// behind each.
+// Missing arguments are 0; extra ones are still evaluated, left to right, and
+// then dropped.
+static const struct {
+    const char *name;
+    const char *sym;
+    int argCount;
+    int hasResult;      // else the call is worth 0, like a store
+} memBuiltins[] = {
+    { "memcopy", "__rt_memCopy", 3, 0 },
+    { "memfill", "__rt_memFill", 3, 0 },
+    { "memsum", "__rt_memSum", 2, 1 },
+    { "memcmp64", "__rt_memCmp64", 3, 1 },
+    { "flush", "__rt_outFlush", 0, 0 },
+    { "read_int", "__rt_readInt", 0, 1 },
+    { "read_ints", "__rt_readInts", 2, 1 },
+};
+
+static int lowerMemBuiltin(LowerCtx *c, Expr *e, int k) {
+    int vals[3];
+    for (int i = 0; i < e->call.argCount; i++) {
+        int v = lowerExpr(c, e->call.args[i]);
+        if (i < memBuiltins[k].argCount) vals[i] = v;
+    }
+    for (int i = e->call.argCount; i < memBuiltins[k].argCount; i++) vals[i] = emitConst(c, 0);
+    IrInst *call = emit(c, IR_CALL, memBuiltins[k].hasResult);
+    call->sym = strDup(memBuiltins[k].sym);
+    for (int i = 0; i < memBuiltins[k].argCount; i++) irAddArg(call, vals[i]);
+    return memBuiltins[k].hasResult ? call->dst : emitConst(c, 0);
+}
+
+static int lowerCall(LowerCtx *c, Expr *e) {
+    if (isBuiltinCall(e, "__mem_store")) {
+        int idx = lowerExpr(c, e->call.args[0]);
+        int val = lowerExpr(c, e->call.args[1]);
+        IrInst *st = emit(c, IR_STORE_MEM, 0);
+        irAddArg(st, idx);
+        irAddArg(st, val);
+        return emitConst(c, 0);
+    }
+    if (isBuiltinCall(e, "__index_store")) {
+        int base = lowerExpr(c, e->call.args[0]);
+        int idx = lowerExpr(c, e->call.args[1]);
+        int val = lowerExpr(c, e->call.args[2]);
+        IrInst *st = emit(c, IR_STORE, 0);
+        irAddArg(st, base);
+        irAddArg(st, idx);
+        irAddArg(st, val);
+        return emitConst(c, 0);
+    }
+    if (isBuiltinCall(e, "print")) {
+        if (e->call.argCount > 0) {
+            int v = lowerExpr(c, e->call.args[0]);
+            IrInst *call = emit(c, IR_CALL, 0);
+            call->sym = strDup("__rt_printInt");
+            irAddArg(call, v);
+        }
+        return emitConst(c, 0);
+    }
+    for (int k = 0; k < (int)(sizeof(memBuiltins) / sizeof(memBuiltins[0])); k++) {
+        if (isBuiltinCall(e, memBuiltins[k].name)) return lowerMemBuiltin(c, e, k);
+    }
+
+    // Predictable arity behavior: a known direct callee gets missing
+    // arguments padded with 0 up to its parameter count, anything else up to
+    // the largest parameter count in the program.
+    FnSig *sig = NULL;
+    int direct = 0;
+    if (e->call.fn->kind == EX_VAR) {
+        sig = findSig(c, e->call.fn->varName);
+        direct = sig != NULL || findVar(c, e->call.fn->varName) < 0;
+    }
+    int argCount = e->call.argCount;
+    int targetParamCount = sig ? sig->paramCount : c->mod->maxParamCount;
+    int effective = argCount > targetParamCount ? argCount : targetParamCount;
+    int *vals = malloc(sizeof(int) * (size_t)(effective ? effective : 1));
+
+    // evaluation order: stack arguments last-to-first, then register arguments
+    for (int i = effective - 1; i >= 6; --i) {
+        vals[i] = i < argCount ? lowerExpr(c, e->call.args[i]) : emitConst(c, 0);
+    }
+    int regCount = effective < 6 ? effective : 6;
+    for (int i = 0; i < regCount; i++) {
+        vals[i] = i < argCount ? lowerExpr(c, e->call.args[i]) : emitConst(c, 0);
+    }
+
+    IrInst *call;
+    if (direct) {
+        call = emit(c, IR_CALL, 1);
+        call->sym = strDup(symbolFor(e->call.fn->varName));
+    } else {
+        int target = lowerExpr(c, e->call.fn);
+        call = emit(c, IR_CALL_IND, 1);
+        irAddArg(call, target);
+    }
+    for (int i = 0; i < effective; i++) irAddArg(call, vals[i]);
+    free(vals);
+    return call->dst;
+}
+
+// Sethi-Ullman number: how many values must be live at once to evaluate e.
+static int exprNeed(Expr *e) {
+    if (!e) return 1;
+    switch (e->kind) {
+        case EX_BINOP: {
+            int l = exprNeed(e->binop.left);
+            int r = exprNeed(e->binop.right);
+            return l == r ? l + 1 : (l > r ? l : r);
+        }
+        case EX_INDEX: {
+            int b = exprNeed(e->index.arr);
+            int i = exprNeed(e->index.index);
+            return b == i ? b + 1 : (b > i ? b : i);
+        }
+        default:
+            return 1;
+    }
+}
+
+static int exprHasCall(Expr *e) {
+    if (!e) return 0;
+    switch (e->kind) {
+        case EX_CALL: return 1;
+        case EX_BINOP: return exprHasCall(e->binop.left) || exprHasCall(e->binop.right);
+        case EX_INDEX: return exprHasCall(e->index.arr) || exprHasCall(e->index.index);
+        default: return 0;
+    }
 }
 
+// whether evaluating e may fault (division, loads through computed addresses)
+static int exprCanTrap(Expr *e) {
+    if (!e) return 0;
+    switch (e->kind) {
+        case EX_CALL: case EX_INDEX: return 1;
+        case EX_BINOP:
+            if (e->binop.op == BIN_DIV || e->binop.op == BIN_MOD) return 1;
+            return exprCanTrap(e->binop.left) || exprCanTrap(e->binop.right);
+        default: return 0;
+    }
+}
+
+// The operands of a binary operator may be evaluated in either order when
+// neither has side effects and at most one of them can fault.
+static int canSwapOperands(Expr *l, Expr *r) {
+    if (exprHasCall(l) || exprHasCall(r)) return 0;
+    return !(exprCanTrap(l) && exprCanTrap(r));
+}
+
+static int lowerExpr(LowerCtx *c, Expr *e) {
+    if (!e) return emitConst(c, 0);
+    switch (e->kind) {
+        case EX_INT:
+            return emitConst(c, e->intValue);
+        case EX_VAR: {
+            int var = findVar(c, e->varName);
+            if (var >= 0) return readLocal(c, var);
+            return emitConst(c, 0);
+        }
+        case EX_ADDR: {
+            int var = findVar(c, e->addrName);
+            if (var >= 0) {
+                IrInst *in = emit(c, IR_LOCAL_ADDR, 1);
+                in->imm = var;
+                return in->dst;
+            }
+            IrInst *in = emit(c, IR_FUNC_ADDR, 1);
+            in->sym = strDup(symbolFor(e->addrName));
+            return in->dst;
+        }
+        case EX_INDEX: {
+            if (e->index.arr->kind == EX_VAR && strcmp(e->index.arr->varName, "mem") == 0) {
+                int idx = lowerExpr(c, e->index.index);
+                IrInst *in = emit(c, IR_LOAD_MEM, 1);
+                irAddArg(in, idx);
+                return in->dst;
+            }
+            int base = lowerExpr(c, e->index.arr);
+            int idx = lowerExpr(c, e->index.index);
+            IrInst *in = emit(c, IR_LOAD, 1);
+            irAddArg(in, base);
+            irAddArg(in, idx);
+            return in->dst;
+        }
+        case EX_CALL:
+            return lowerCall(c, e);
+        case EX_BINOP: {
+            int l, r;
+            // evaluate the operand that needs more registers first, so fewer
+            // values stay live while the other one is computed
+            if (exprNeed(e->binop.right) > exprNeed(e->binop.left) &&
+                canSwapOperands(e->binop.left, e->binop.right)) {
+                r = lowerExpr(c, e->binop.right);
+                l = lowerExpr(c, e->binop.left);
+            } else {
+                l = lowerExpr(c, e->binop.left);
+                r = lowerExpr(c, e->binop.right);
+            }
+            IrInst *in = emit(c, IR_BIN, 1);
+            in->binop = e->binop.op;
+            irAddArg(in, l);
+            irAddArg(in, r);
+            return in->dst;
+        }
+    }
+    return emitConst(c, 0);
+}
+
+static void lowerStmtList(LowerCtx *c, Stmt *s);
+
+// Evaluates a loop condition in the current block and branches to body or exit.
+static void lowerLoopTest(LowerCtx *c, Expr *cond, IrBlock *body, IrBlock *exit) {
+    int v = lowerExpr(c, cond);
+    IrBlock *from = c->cur;
+    IrInst *br = emit(c, IR_BR, 0);
+    irAddArg(br, v);
+    br->target = body;
+    br->elseTarget = exit;
+    irAddPred(body, from);
+    irAddPred(exit, from);
+}
+
+static void lowerStmt(LowerCtx *c, Stmt *s) {
+    switch (s->kind) {
+        case NODE_STMT_ASSIGN: {
+            int v = lowerExpr(c, s->assign.rhs);
+            writeLocal(c, findVar(c, s->assign.lhs), v);
+            return;
+        }
+        case NODE_STMT_RETURN: {
+            int v = lowerExpr(c, s->retExpr);
+            IrInst *r = emit(c, IR_RET, 0);
+            irAddArg(r, v);
+            // code after a return in an enclosing statement keeps lowering
+            // into a detached block that irRemoveUnreachable drops afterwards
+            c->cur = newBlock(c, 1);
+            return;
+        }
+        case NODE_STMT_EXPR:
+            lowerExpr(c, s->exprStmt);
+            return;
+        case NODE_STMT_BLOCK:
+            lowerStmtList(c, s->blockBody);
+            return;
+        case NODE_STMT_IF: {
+            int cond = lowerExpr(c, s->ifStmt.cond);
+            IrBlock *from = c->cur;
+            IrBlock *thenB = newBlock(c, 0);
+            IrBlock *elseB = s->ifStmt.elseBranch ? newBlock(c, 0) : NULL;
+            IrBlock *join = newBlock(c, 0);
+            IrInst *br = emit(c, IR_BR, 0);
+            irAddArg(br, cond);
+            br->target = thenB;
+            br->elseTarget = elseB ? elseB : join;
+            irAddPred(thenB, from);
+            irAddPred(br->elseTarget, from);
+            sealBlock(c, thenB);
+            if (elseB) sealBlock(c, elseB);
+
+            c->cur = thenB;
+            lowerStmt(c, s->ifStmt.thenBranch);
+            if (!isTerminated(c)) emitJmp(c, join);
+            if (elseB) {
+                c->cur = elseB;
+                lowerStmt(c, s->ifStmt.elseBranch);
+                if (!isTerminated(c)) emitJmp(c, join);
+            }
+            sealBlock(c, join);
+            c->cur = join;
+            return;
+        }
+        case NODE_STMT_WHILE: {
+            // Rotated: the condition is tested once on entry and again at the
+            // bottom of the body, so an iteration runs a single branch.
+            IrBlock *body = newBlock(c, 0);
+            IrBlock *exit = newBlock(c, 0);
+            lowerLoopTest(c, s->whileStmt.cond, body, exit);
+            c->cur = body;
+            lowerStmt(c, s->whileStmt.body);
+            if (!isTerminated(c)) lowerLoopTest(c, s->whileStmt.cond, body, exit);
+            sealBlock(c, body);
+            sealBlock(c, exit);
+            c->cur = exit;
+            return;
+        }
+        default:
+            return;
+    }
+}
+
+// Statements after a return in the same list are never lowered.
+static void lowerStmtList(LowerCtx *c, Stmt *s) {
+    for (Stmt *p = s; p; p = p->next) {
+        lowerStmt(c, p);
+        if (p->kind == NODE_STMT_RETURN) return;
+    }
+}
+
+static IrFunction *lowerFunction(LowerCtx *c, Function *f) {
+    c->fn = newIrFunction(symbolFor(f->name), f->paramCount);
+    c->varCount = 0;
+    c->zeroValue = -1;
+    c->incompleteCount = 0;
+    for (int i = 0; i < f->paramCount; i++) addVar(c, f->params[i]);
+    collectAssignedVars(c, f->body);
+    c->memoryLocals = stmtTakesLocalAddr(c, f->body);
+
+    c->cur = newBlock(c, 1);
+    int *params = malloc(sizeof(int) * (size_t)(f->paramCount ? f->paramCount : 1));
+    for (int i = 0; i < f->paramCount; i++) {
+        IrInst *in = emit(c, IR_PARAM, 1);
+        in->imm = i;
+        params[i] = in->dst;
+    }
+    if (c->memoryLocals) {
+        // parameters and locals keep the classic [rbp-8*(i+1)] slot layout
+        c->fn->slotCount = c->varCount;
+        for (int i = 0; i < c->varCount; i++) {
+            writeLocal(c, i, i < f->paramCount ? params[i] : emitConst(c, 0));
+        }
+    } else {
+        for (int i = 0; i < f->paramCount; i++) writeLocal(c, i, params[i]);
+    }
+    free(params);
+
+    lowerStmtList(c, f->body);
+    if (!isTerminated(c)) {
+        int zero = emitConst(c, 0);
+        IrInst *r = emit(c, IR_RET, 0);
+        irAddArg(r, zero);
+    }
+
+    for (int i = 0; i < c->fn->blockCount; i++) free(c->states[i].defs);
+    irRemoveUnreachable(c->fn);
+    irSortRpo(c->fn);
+    irSimplifyPhis(c->fn);
+    return c->fn;
+}
+
+IrModule *lowerProgram(Program *p) {
+    LowerCtx c;
+    memset(&c, 0, sizeof(c));
+    c.mod = newIrModule();
+    for (Function *f = p->functions; f; f = f->next) {
+        FnSig *s = malloc(sizeof(FnSig));
+        s->name = strDup(f->name);
+        s->paramCount = f->paramCount;
+        s->next = c.sigs;
+        c.sigs = s;
+        if (f->paramCount > c.mod->maxParamCount) c.mod->maxParamCount = f->paramCount;
+    }
+    IrFunction **tail = &c.mod->functions;
+    for (Function *f = p->functions; f; f = f->next) {
+        IrFunction *fn = lowerFunction(&c, f);
+        tail[0] = fn;
+        tail = &fn->next;
+    }
+    free(c.states);
+    free(c.incomplete);
+    return c.mod;
+}
@@ -2,9 +2,11 @@
 #define LOWER_H
 
 #include "ast.h"
+#include "ir.h"
 
-// placeholder lowering step (AST -> IR), currently a passthrough for minimal compiler
-int lowerProgram(Program *p);
+// AST -> SSA IR. Locals of functions that never take the address of a local
+// become SSA values; functions that do (`&x`) keep every local in its frame
+// slot, since pointer indexing may reach any slot of the frame.
+IrModule *lowerProgram(Program *p);
 
 #endif
-
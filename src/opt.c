@@ -0,0 +1,29 @@
+#include "opt.h"
+
+static void optimizeFunction(FunctionPurity *purity, IrFunction *fn) {
+    eliminateTailRecursion(fn);
+    foldConstants(fn);
+    hoistLoopInvariants(fn, purity);
+    eliminateDeadCode(fn);
+    updatePurity(purity, fn);
+}
+
+void optimizeModule(IrModule *m, const OptOptions *opts) {
+    FunctionPurity *purity = analyzePurity(m);
+    for (IrFunction *fn = m->functions; fn; fn = fn->next) optimizeFunction(purity, fn);
+    if (opts[0].devirtualize && devirtualizeCalls(m)) {
+        // direct calls may now reach functions that were not called before
+        freePurity(purity);
+        purity = analyzePurity(m);
+    }
+    inlineFunctions(m, opts[0].inlineLimit, purity);
+    freePurity(purity);
+    for (IrFunction *fn = m->functions; fn; fn = fn->next) {
+        // the loops left for the scalar remainder are not unrolled again
+        int changed = opts[0].vectorize && vectorizeLoops(fn);
+        changed |= unrollLoops(fn, opts[0].unrollFactor, opts[0].unrollBudget);
+        if (!changed) continue;
+        foldConstants(fn);
+        eliminateDeadCode(fn);
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef OPT_H
+#define OPT_H
+
+#include "ir.h"
+
+// Optimization passes over the SSA IR. Every pass keeps the invariants
+// documented in ir.h and returns nonzero when it changed the function.
+
+typedef struct {
+    int inlineLimit;        // inliner size budget, 0 disables inlining
+    int unrollFactor;       // copies per unrolled iteration, below 2 disables unrolling
+    int unrollBudget;       // instructions an unrolled loop body may grow to
+    int vectorize;          // turn loops over mem into vector kernels
+    int devirtualize;       // turn indirect calls with a known target into direct calls
+} OptOptions;
+
+#define OPT_DEFAULT_INLINE_LIMIT 24
+#define OPT_DEFAULT_UNROLL_FACTOR 4
+#define OPT_DEFAULT_UNROLL_BUDGET 64
+
+// Runs the whole pipeline on every function of the module.
+void optimizeModule(IrModule *m, const OptOptions *opts);
+
+// opt_fold.c: sparse conditional constant propagation, branch folding and
+// algebraic simplification.
+int foldConstants(IrFunction *fn);
+
+// opt_licm.c: which functions of a module are pure, and which of those
+// always return. analyzePurity walks the whole call graph once;
+// updatePurity re-evaluates one function after a pass changed it.
+typedef struct FunctionPurity FunctionPurity;
+FunctionPurity *analyzePurity(IrModule *m);
+void updatePurity(FunctionPurity *p, IrFunction *fn);
+void freePurity(FunctionPurity *p);
+
+// opt_licm.c: moves loop-invariant computations into loop preheaders. Calls
+// are only moved when the callee is pure.
+int hoistLoopInvariants(IrFunction *fn, const FunctionPurity *purity);
+
+// opt_dce.c: removes stores to frame slots that are never read again and
+// computations whose results are unused.
+int eliminateDeadCode(IrFunction *fn);
+
+// opt_tailrec.c: turns self tail calls into a loop back to the function
+// start.
+int eliminateTailRecursion(IrFunction *fn);
+
+// opt_devirt.c: turns indirect calls whose target can only be one function
+// into direct calls, and guards those that may also go elsewhere with a
+// comparison against it. Function addresses are followed through locals,
+// mem, parameters and return values across the whole module.
+int devirtualizeCalls(IrModule *m);
+
+// opt_inline.c: bottom-up inlining of direct calls whose callee size, less
+// the expected benefit, fits within limit.
+int inlineFunctions(IrModule *m, int limit, FunctionPurity *purity);
+
+// A counted single-block loop B, as the unroller and the vectorizer see it:
+//     B: i = phi(i0, i'), ...; ...; i' = i + step; br (i' <op> bound), B, exit
+typedef struct {
+    IrInst *iv;             // the induction phi
+    IrInst *next;           // i'
+    IrInst *cmp;            // the exit test, possibly written as bound <op'> i'
+    int64_t step;           // nonzero, |step| <= 2^20
+    BinOpKind op;           // LT/LE when counting up, GT/GE when counting down
+    int bound;              // loop-invariant value
+    int back;               // index of the back edge in B's preds
+} CountedLoop;
+
+// opt_unroll.c: recognizes a counted loop in b. defs maps every value below
+// valueLimit to its defining instruction.
+int matchCountedLoop(IrInst **defs, int valueLimit, IrBlock *b, CountedLoop *out);
+
+// opt_unroll.c: unrolls counted single-block loops by up to factor copies,
+// fewer when the copies would exceed budget instructions. The original loop
+// runs the remaining iterations.
+int unrollLoops(IrFunction *fn, int factor, int budget);
+
+// opt_vectorize.c: turns counted loops that add and subtract mem elements
+// into IR_VEC_LOOP kernels, behind runtime trip count and overlap checks.
+// The original loop runs the remaining iterations.
+int vectorizeLoops(IrFunction *fn);
+
+// Evaluates a op b with the semantics of the generated code (64-bit
+// wrapping arithmetic, truncating idiv, 0/1 comparisons). Returns 0 when the
+// operation would trap at runtime (division by zero, INT64_MIN / -1) and
+// must be left in place.
+int foldBinOp(BinOpKind op, int64_t a, int64_t b, int64_t *out);
+
+#endif
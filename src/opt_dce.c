@@ -0,0 +1,225 @@
+#include "opt.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Dead code elimination.
+//
+// Stores to frame slots are removed when no later read can see them: the
+// slot is overwritten or the function returns first. This includes the zero
+// every local gets at entry in a function that takes `&x`, so only locals
+// that may be read before their first assignment keep it. When the function
+// takes the address of a slot, loads through pointers may read any slot, and
+// so may calls once such an address can reach the callee.
+//
+// Values are then marked live starting from the instructions with an effect,
+// and everything left unmarked is deleted. Unlike a use count this also
+// removes cycles of phis that only feed each other, such as a counter that is
+// incremented in a loop but never read. Division by something that may be 0
+// or -1 stays, since it may trap.
+
+static int isSafeDivisor(IrInst **defs, int v) {
+    IrInst *d = defs[v];
+    return d && d->op == IR_CONST && d->imm != 0 && d->imm != -1;
+}
+
+static int isRemovable(IrInst *in, IrInst **defs) {
+    switch (in->op) {
+        case IR_CONST: case IR_COPY: case IR_PHI: case IR_FUNC_ADDR: case IR_LOCAL_ADDR:
+        case IR_LOAD_LOCAL: case IR_LOAD_MEM: case IR_LOAD:
+            return 1;
+        case IR_BIN:
+            return (in->binop != BIN_DIV && in->binop != BIN_MOD) || isSafeDivisor(defs, in->args[1]);
+        default:
+            return 0;
+    }
+}
+
+// Whether a frame address (IR_LOCAL_ADDR, or a value computed from one) can
+// reach a callee: passed to a call or stored anywhere but a frame slot.
+// Returning one is fine, the frame is gone by then. An address kept in a
+// slot taints what is loaded back from it, and every pointer load once any
+// slot holds one.
+static int frameAddressEscapes(IrFunction *fn) {
+    int nv = fn->valueCount;
+    char *isAddr = calloc((size_t)(nv ? nv : 1), 1);
+    char *slotAddr = calloc((size_t)(fn->slotCount ? fn->slotCount : 1), 1);
+    int anySlotAddr = 0;
+    int escapes = 0;
+    int changed = 1;
+    while (changed && !escapes) {
+        changed = 0;
+        for (int i = 0; !escapes && i < fn->blockCount; i++) {
+            for (IrInst *in = fn->blocks[i]->first; !escapes && in; in = in->next) {
+                int fromAddr = 0;
+                switch (in->op) {
+                    case IR_LOCAL_ADDR: fromAddr = 1; break;
+                    case IR_LOAD_LOCAL: fromAddr = slotAddr[in->imm]; break;
+                    case IR_LOAD: fromAddr = anySlotAddr; break;
+                    case IR_BIN: case IR_COPY: case IR_PHI:
+                        for (int k = 0; k < in->argCount; k++) fromAddr |= isAddr[in->args[k]];
+                        break;
+                    case IR_STORE_LOCAL:
+                        if (isAddr[in->args[0]] && !slotAddr[in->imm]) {
+                            slotAddr[in->imm] = 1;
+                            anySlotAddr = 1;
+                            changed = 1;
+                        }
+                        break;
+                    case IR_STORE_MEM: escapes = isAddr[in->args[1]]; break;
+                    case IR_STORE: escapes = isAddr[in->args[2]]; break;
+                    case IR_CALL: case IR_CALL_IND: case IR_VEC_LOOP:
+                        for (int k = 0; k < in->argCount; k++) escapes |= isAddr[in->args[k]];
+                        break;
+                    default:
+                        break;
+                }
+                if (fromAddr && in->dst >= 0 && !isAddr[in->dst]) {
+                    isAddr[in->dst] = 1;
+                    changed = 1;
+                }
+            }
+        }
+    }
+    free(isAddr);
+    free(slotAddr);
+    return escapes;
+}
+
+static int readsAnySlot(IrInst *in, int callsRead) {
+    return in->op == IR_LOAD || (callsRead && (in->op == IR_CALL || in->op == IR_CALL_IND));
+}
+
+// Walks b backward from the slots live at its end. With sweep set, stores to
+// slots that are dead at that point become NOPs. Returns the number removed.
+static int walkSlots(IrBlock *b, char *live, int ns, int addrTaken, int callsRead, int sweep) {
+    int count = 0;
+    for (IrInst *in = b->first; in; in = in->next) count++;
+    IrInst **insts = malloc(sizeof(IrInst*) * (size_t)(count ? count : 1));
+    count = 0;
+    for (IrInst *in = b->first; in; in = in->next) insts[count++] = in;
+    int removed = 0;
+    for (int k = count - 1; k >= 0; k--) {
+        IrInst *in = insts[k];
+        if (in->op == IR_STORE_LOCAL) {
+            if (sweep && !live[in->imm]) {
+                in->op = IR_NOP;
+                in->argCount = 0;
+                removed++;
+            }
+            live[in->imm] = 0;
+        } else if (in->op == IR_LOAD_LOCAL) {
+            live[in->imm] = 1;
+        } else if (addrTaken && readsAnySlot(in, callsRead)) {
+            memset(live, 1, (size_t)ns);
+        }
+    }
+    free(insts);
+    return removed;
+}
+
+static void liveOut(IrBlock *b, const char *liveIn, char *live, int ns) {
+    memset(live, 0, (size_t)ns);
+    IrBlock *succ[2];
+    int sc = irSuccessors(b, succ);
+    for (int k = 0; k < sc; k++) {
+        for (int s = 0; s < ns; s++) live[s] |= liveIn[succ[k]->id * ns + s];
+    }
+}
+
+// Backward liveness of frame slots to a fixed point, then one more walk per
+// block to drop the stores nobody reads.
+static int removeDeadSlotStores(IrFunction *fn) {
+    int ns = fn->slotCount;
+    int nb = fn->blockCount;
+    if (ns == 0) return 0;
+    int addrTaken = 0;
+    for (int i = 0; i < nb; i++) {
+        for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+            if (in->op == IR_LOCAL_ADDR) addrTaken = 1;
+        }
+    }
+    int callsRead = addrTaken && frameAddressEscapes(fn);
+    irRenumberBlocks(fn);
+    char *liveIn = calloc((size_t)nb * (size_t)ns, 1);
+    char *live = malloc((size_t)ns);
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = nb - 1; i >= 0; i--) {
+            liveOut(fn->blocks[i], liveIn, live, ns);
+            walkSlots(fn->blocks[i], live, ns, addrTaken, callsRead, 0);
+            if (memcmp(live, &liveIn[i * ns], (size_t)ns) != 0) {
+                memcpy(&liveIn[i * ns], live, (size_t)ns);
+                changed = 1;
+            }
+        }
+    }
+    int removed = 0;
+    for (int i = 0; i < nb; i++) {
+        liveOut(fn->blocks[i], liveIn, live, ns);
+        removed += walkSlots(fn->blocks[i], live, ns, addrTaken, callsRead, 1);
+    }
+    free(liveIn);
+    free(live);
+    if (removed) irRemoveNops(fn);
+    return removed > 0;
+}
+
+static int removeDeadValues(IrFunction *fn) {
+    int nv = fn->valueCount;
+    IrInst **defs = calloc((size_t)(nv ? nv : 1), sizeof(IrInst*));
+    char *live = calloc((size_t)(nv ? nv : 1), 1);
+    int *work = malloc(sizeof(int) * (size_t)(nv ? nv : 1));
+    char *removable = calloc((size_t)(nv ? nv : 1), 1);
+    int sp = 0;
+    for (int i = 0; i < fn->blockCount; i++) {
+        for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+            if (in->dst >= 0) defs[in->dst] = in;
+        }
+    }
+    // decided up front: sweeping a divisor's constant must not make the
+    // division look unsafe afterwards
+    for (int i = 0; i < fn->blockCount; i++) {
+        for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+            if (in->dst >= 0) removable[in->dst] = (char)isRemovable(in, defs);
+        }
+    }
+    for (int i = 0; i < fn->blockCount; i++) {
+        for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+            if (in->op == IR_PARAM || in->op == IR_NOP || (in->dst >= 0 && removable[in->dst])) continue;
+            for (int k = 0; k < in->argCount; k++) {
+                int a = in->args[k];
+                if (!live[a]) { live[a] = 1; work[sp++] = a; }
+            }
+        }
+    }
+    while (sp) {
+        IrInst *in = defs[work[--sp]];
+        if (!in) continue;
+        for (int k = 0; k < in->argCount; k++) {
+            int a = in->args[k];
+            if (!live[a]) { live[a] = 1; work[sp++] = a; }
+        }
+    }
+    int removed = 0;
+    for (int i = 0; i < fn->blockCount; i++) {
+        for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+            if (in->dst < 0 || live[in->dst] || !removable[in->dst]) continue;
+            in->op = IR_NOP;
+            in->argCount = 0;
+            removed = 1;
+        }
+    }
+    if (removed) irRemoveNops(fn);
+    free(defs);
+    free(removable);
+    free(live);
+    free(work);
+    return removed;
+}
+
+int eliminateDeadCode(IrFunction *fn) {
+    int changed = removeDeadSlotStores(fn);
+    changed |= removeDeadValues(fn);
+    return changed;
+}
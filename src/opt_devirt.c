@@ -0,0 +1,529 @@
+#include "opt.h"
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+// Devirtualization of indirect calls.
+//
+// Every value that may end up as a call target is described by the functions
+// it may point to: one function, or several, possibly together with anything
+// else (0, an integer, a pointer loaded from somewhere unknown). Function
+// addresses flow through copies, phis, frame slots, `mem` and, across
+// functions, through parameters and return values:
+//
+// - a parameter of f holds what the direct calls of f pass for it, as long as
+//   &f is only ever compared, so no indirect call can reach f;
+// - a direct call of f yields what f may return;
+// - `mem[k]` holds what is stored to `mem[k]`, what is stored at computed
+//   indices, and 0 before the first store. Frame slots likewise hold what is
+//   stored to them, or whatever a store through a pointer left there.
+// - a load of `mem[k]` that follows a store to `mem[k]` on a straight path,
+//   with nothing in between that may write `mem`, holds exactly the value
+//   stored, so `mem[0] = &add; mem[0](x, y)` calls add.
+//
+// Parameters, return values and `mem` depend on each other, so they are
+// computed together to a fixed point. An indirect call whose target can only
+// be one function becomes a direct call. When the target is one function or
+// something else (a dispatch table in `mem`, say), the call is split:
+//
+//     b:    br (t == &f), hit, miss
+//     hit:  r1 = f(args); jmp cont
+//     miss: r2 = (*t)(args); jmp cont
+//     cont: r = phi(r1, r2); ...
+//
+// Either way the direct call only passes f's own parameters, and the inliner
+// can take it from there. With a profile, a call the analysis cannot pin to
+// one function is split the same way on its most frequent target, as long
+// as that target took most of the calls.
+
+typedef struct {
+    const char *sym;        // the one function seen, NULL if none
+    char other;             // may also hold something that is not a function
+    char multi;             // more than one function seen
+} Target;
+
+typedef struct {
+    int64_t index;
+    Target t;
+} MemSlot;
+
+typedef struct {
+    Target var;             // stored at computed indices
+    MemSlot *slots;         // stored at constant indices
+    int slotCount;
+    int slotCap;
+} MemTargets;
+
+typedef struct {
+    IrFunctionTable funcs;
+    IrInst ***defs;         // per function, per value below valueLimit[]
+    IrBlock ***blockOf;     // per function, per value below valueLimit[]
+    int *valueLimit;
+    int **seen;             // per function, per value: stamp of the last visit
+    int stamp;
+    char *escapes;          // per function: &f is used for more than comparisons
+    char *writesMem;        // per function: may store to mem, directly or in a call
+    Target **params;        // per function, per parameter
+    Target *rets;           // per function
+    MemTargets mem;
+} DevirtCtx;
+
+static void join(Target *t, const Target *u) {
+    if (u->sym) {
+        if (!t->sym) t->sym = u->sym;
+        else if (strcmp(t->sym, u->sym) != 0) t->multi = 1;
+    }
+    t->other |= u->other;
+    t->multi |= u->multi;
+}
+
+static int sameTarget(const Target *a, const Target *b) {
+    if ((a->sym == NULL) != (b->sym == NULL)) return 0;
+    if (a->sym && strcmp(a->sym, b->sym) != 0) return 0;
+    return a->other == b->other && a->multi == b->multi;
+}
+
+static Target *memSlot(MemTargets *mem, int64_t index) {
+    for (int i = 0; i < mem->slotCount; i++) {
+        if (mem->slots[i].index == index) return &mem->slots[i].t;
+    }
+    if (mem->slotCount == mem->slotCap) {
+        mem->slotCap = mem->slotCap ? mem->slotCap * 2 : 8;
+        mem->slots = realloc(mem->slots, sizeof(MemSlot) * (size_t)mem->slotCap);
+    }
+    MemSlot *s = &mem->slots[mem->slotCount++];
+    memset(s, 0, sizeof(*s));
+    s->index = index;
+    return &s->t;
+}
+
+static int sameMem(MemTargets *a, MemTargets *b) {
+    if (a->slotCount != b->slotCount || !sameTarget(&a->var, &b->var)) return 0;
+    for (int i = 0; i < a->slotCount; i++) {
+        if (a->slots[i].index != b->slots[i].index || !sameTarget(&a->slots[i].t, &b->slots[i].t)) return 0;
+    }
+    return 1;
+}
+
+static IrInst *defOf(DevirtCtx *c, int f, int v) {
+    return v < c->valueLimit[f] ? c->defs[f][v] : NULL;
+}
+
+static int constIndex(DevirtCtx *c, int f, int v, int64_t *out) {
+    IrInst *d = defOf(c, f, v);
+    if (!d || d->op != IR_CONST) return 0;
+    *out = d->imm;
+    return 1;
+}
+
+static int mayWriteMem(DevirtCtx *c, IrInst *in) {
+    switch (in->op) {
+        case IR_STORE_MEM: case IR_STORE: case IR_CALL_IND: case IR_VEC_LOOP:
+            return 1;
+        case IR_CALL: {
+            int k = irFindFunction(&c->funcs, in->sym);
+            if (k >= 0) return c->writesMem[k];
+            return strcmp(in->sym, "__rt_printInt") != 0 && strcmp(in->sym, "__rt_outFlush") != 0;
+        }
+        default:
+            return 0;
+    }
+}
+
+static void markMemWriters(DevirtCtx *c) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int f = 0; f < c->funcs.count; f++) {
+            IrFunction *fn = c->funcs.fns[f];
+            for (int i = 0; !c->writesMem[f] && i < fn->blockCount; i++) {
+                for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+                    if (!mayWriteMem(c, in)) continue;
+                    c->writesMem[f] = 1;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// The value stored to mem[k] on the straight path that ends at the load,
+// or -1 when something on the way may write mem or the path has joins.
+static int forwardedStore(DevirtCtx *c, int f, IrInst *load, int64_t k) {
+    IrBlock *b = c->blockOf[f][load->dst];
+    IrInst *stop = load;
+    for (int depth = 0; depth < 16; depth++) {
+        int value = -1;
+        int clobbered = 0;
+        for (IrInst *in = b->first; in != stop; in = in->next) {
+            int64_t j;
+            if (in->op == IR_STORE_MEM && constIndex(c, f, in->args[0], &j)) {
+                if (j == k) { value = in->args[1]; clobbered = 0; }
+            } else if (mayWriteMem(c, in)) {
+                value = -1;
+                clobbered = 1;
+            }
+        }
+        if (value >= 0) return value;
+        if (clobbered || b->predCount != 1) return -1;
+        b = b->preds[0];
+        stop = NULL;
+    }
+    return -1;
+}
+
+static void resolveValue(DevirtCtx *c, int f, int v, Target *out);
+
+static void resolveLoadMem(DevirtCtx *c, int f, IrInst *d, Target *out) {
+    int64_t k;
+    if (constIndex(c, f, d->args[0], &k)) {
+        int stored = forwardedStore(c, f, d, k);
+        if (stored >= 0) {
+            resolveValue(c, f, stored, out);
+            return;
+        }
+    }
+    out->other = 1;
+    join(out, &c->mem.var);
+    if (constIndex(c, f, d->args[0], &k)) {
+        for (int i = 0; i < c->mem.slotCount; i++) {
+            if (c->mem.slots[i].index == k) join(out, &c->mem.slots[i].t);
+        }
+    } else {
+        for (int i = 0; i < c->mem.slotCount; i++) join(out, &c->mem.slots[i].t);
+    }
+}
+
+static void resolveLoadLocal(DevirtCtx *c, int f, IrInst *d, Target *out) {
+    IrFunction *fn = c->funcs.fns[f];
+    out->other = 1;
+    for (int i = 0; i < fn->blockCount; i++) {
+        for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+            if (in->op == IR_STORE_LOCAL && in->imm == d->imm) resolveValue(c, f, in->args[0], out);
+        }
+    }
+}
+
+// Joins what value v of function f may point to into out. Values already
+// visited in this query add nothing new, which also ends cycles of phis.
+static void resolveValue(DevirtCtx *c, int f, int v, Target *out) {
+    IrInst *d = defOf(c, f, v);
+    if (!d) { out->other = 1; return; }
+    if (c->seen[f][v] == c->stamp) return;
+    c->seen[f][v] = c->stamp;
+    switch (d->op) {
+        case IR_FUNC_ADDR: {
+            Target t = {0};
+            if (irFindFunction(&c->funcs, d->sym) >= 0) t.sym = d->sym; else t.other = 1;
+            join(out, &t);
+            break;
+        }
+        case IR_COPY:
+            resolveValue(c, f, d->args[0], out);
+            break;
+        case IR_PHI:
+            for (int k = 0; k < d->argCount; k++) resolveValue(c, f, d->args[k], out);
+            break;
+        case IR_PARAM:
+            if (c->escapes[f] || d->imm >= c->funcs.fns[f]->paramCount) out->other = 1;
+            else join(out, &c->params[f][d->imm]);
+            break;
+        case IR_CALL: {
+            int k = irFindFunction(&c->funcs, d->sym);
+            if (k < 0) out->other = 1; else join(out, &c->rets[k]);
+            break;
+        }
+        case IR_LOAD_MEM:
+            resolveLoadMem(c, f, d, out);
+            break;
+        case IR_LOAD_LOCAL:
+            resolveLoadLocal(c, f, d, out);
+            break;
+        default:
+            out->other = 1;
+            break;
+    }
+}
+
+static Target resolve(DevirtCtx *c, int f, int v) {
+    Target t = {0};
+    c->stamp++;
+    resolveValue(c, f, v, &t);
+    return t;
+}
+
+// escapes[f] unless every use of &f is an == or != comparison. main is
+// called by the runtime.
+static void markEscapes(DevirtCtx *c) {
+    for (int f = 0; f < c->funcs.count; f++) {
+        if (strcmp(c->funcs.fns[f]->name, "lang_main") == 0) c->escapes[f] = 1;
+        IrFunction *fn = c->funcs.fns[f];
+        for (int i = 0; i < fn->blockCount; i++) {
+            for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+                if (in->op == IR_BIN && (in->binop == BIN_EQ || in->binop == BIN_NEQ)) continue;
+                for (int k = 0; k < in->argCount; k++) {
+                    IrInst *d = defOf(c, f, in->args[k]);
+                    if (!d || d->op != IR_FUNC_ADDR) continue;
+                    int j = irFindFunction(&c->funcs, d->sym);
+                    if (j >= 0) c->escapes[j] = 1;
+                }
+            }
+        }
+    }
+}
+
+// One sweep over the module: recomputes parameters, return values and mem
+// from the current ones. Returns nonzero when anything grew.
+static int propagate(DevirtCtx *c) {
+    Target **params = malloc(sizeof(Target*) * (size_t)c->funcs.count);
+    Target *rets = calloc((size_t)c->funcs.count, sizeof(Target));
+    MemTargets mem;
+    memset(&mem, 0, sizeof(mem));
+    for (int f = 0; f < c->funcs.count; f++) {
+        int n = c->funcs.fns[f]->paramCount;
+        params[f] = calloc((size_t)(n ? n : 1), sizeof(Target));
+    }
+    for (int f = 0; f < c->funcs.count; f++) {
+        IrFunction *fn = c->funcs.fns[f];
+        for (int i = 0; i < fn->blockCount; i++) {
+            for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+                if (in->op == IR_RET) {
+                    Target t = resolve(c, f, in->args[0]);
+                    join(&rets[f], &t);
+                } else if (in->op == IR_STORE_MEM) {
+                    Target t = resolve(c, f, in->args[1]);
+                    int64_t k;
+                    join(constIndex(c, f, in->args[0], &k) ? memSlot(&mem, k) : &mem.var, &t);
+                } else if (in->op == IR_CALL) {
+                    int j = irFindFunction(&c->funcs, in->sym);
+                    if (j < 0 || c->escapes[j]) continue;
+                    for (int p = 0; p < c->funcs.fns[j]->paramCount; p++) {
+                        Target t = {0};
+                        if (p < in->argCount) t = resolve(c, f, in->args[p]); else t.other = 1;
+                        join(&params[j][p], &t);
+                    }
+                }
+            }
+        }
+    }
+    int changed = !sameMem(&mem, &c->mem);
+    for (int f = 0; f < c->funcs.count; f++) {
+        changed |= !sameTarget(&rets[f], &c->rets[f]);
+        for (int p = 0; p < c->funcs.fns[f]->paramCount; p++) changed |= !sameTarget(&params[f][p], &c->params[f][p]);
+        free(c->params[f]);
+    }
+    free(c->params);
+    free(c->rets);
+    free(c->mem.slots);
+    c->params = params;
+    c->rets = rets;
+    c->mem = mem;
+    return changed;
+}
+
+static IrInst *newInst(IrOp op, int dst) {
+    IrInst *in = irNewInst(op);
+    in->dst = dst;
+    return in;
+}
+
+// Fills the arguments of the direct call `call` to callee from those of the
+// indirect call ind: extra ones are dropped, missing ones become 0 (defined
+// in front of the call in b).
+static void directArgs(IrFunction *fn, IrBlock *b, IrInst *call, IrInst *ind, IrFunction *callee) {
+    IrInst *prev = NULL;
+    for (IrInst *p = b->first; p && p != call; p = p->next) prev = p;
+    for (int i = 0; i < callee->paramCount; i++) {
+        if (i + 1 < ind->argCount) {
+            irAddArg(call, ind->args[i + 1]);
+            continue;
+        }
+        IrInst *z = newInst(IR_CONST, irNewValue(fn));
+        irInsertAfter(b, prev, z);
+        prev = z;
+        irAddArg(call, z->dst);
+    }
+}
+
+static void makeDirect(IrFunction *fn, IrBlock *b, IrInst *in, IrFunction *callee) {
+    IrInst tmp = *in;
+    in->args = NULL;
+    in->argCount = in->argCap = 0;
+    in->op = IR_CALL;
+    in->sym = strDup(callee->name);
+    directArgs(fn, b, in, &tmp, callee);
+    free(tmp.args);
+    free(tmp.sym);
+}
+
+static void replacePred(IrBlock *b, IrBlock *from, IrBlock *to) {
+    for (int i = 0; i < b->predCount; i++) {
+        if (b->preds[i] == from) b->preds[i] = to;
+    }
+}
+
+static void appendJmp(IrBlock *b, IrBlock *target) {
+    IrInst *jmp = irNewInst(IR_JMP);
+    jmp->target = target;
+    irAppend(b, jmp);
+    irAddPred(target, b);
+}
+
+// Splits b around `call` into a direct call of callee when the target is
+// callee and the original call otherwise. Returns the block holding the
+// instructions that followed the call, starting with the result phi.
+static IrBlock *guardCall(IrFunction *fn, IrBlock *b, IrInst *call, IrFunction *callee) {
+    IrBlock *cont = irNewBlock(fn);
+    IrInst *prev = NULL;
+    for (IrInst *p = b->first; p != call; p = p->next) prev = p;
+    cont->first = call->next;
+    cont->last = b->last;
+    if (prev) prev->next = NULL; else b->first = NULL;
+    b->last = prev;
+    call->next = NULL;
+    IrBlock *succ[2];
+    int sc = irSuccessors(cont, succ);
+    for (int i = 0; i < sc; i++) replacePred(succ[i], b, cont);
+
+    IrBlock *hit = irNewBlock(fn);
+    IrBlock *miss = irNewBlock(fn);
+    IrInst *addr = newInst(IR_FUNC_ADDR, irNewValue(fn));
+    addr->sym = strDup(callee->name);
+    irAppend(b, addr);
+    IrInst *eq = newInst(IR_BIN, irNewValue(fn));
+    eq->binop = BIN_EQ;
+    irAddArg(eq, call->args[0]);
+    irAddArg(eq, addr->dst);
+    irAppend(b, eq);
+    IrInst *br = irNewInst(IR_BR);
+    irAddArg(br, eq->dst);
+    br->target = hit;
+    br->elseTarget = miss;
+    memcpy(br->count, call->count, sizeof(br->count));
+    irAppend(b, br);
+    irAddPred(hit, b);
+    irAddPred(miss, b);
+
+    int result = call->dst;
+    IrInst *direct = newInst(IR_CALL, result >= 0 ? irNewValue(fn) : -1);
+    direct->sym = strDup(callee->name);
+    irAppend(hit, direct);
+    directArgs(fn, hit, direct, call, callee);
+    appendJmp(hit, cont);
+    if (result >= 0) call->dst = irNewValue(fn);
+    free(call->sym);
+    call->sym = NULL;
+    memset(call->count, 0, sizeof(call->count));
+    irAppend(miss, call);
+    appendJmp(miss, cont);
+    if (result >= 0) {
+        IrInst *phi = newInst(IR_PHI, result);
+        irAddArg(phi, direct->dst);
+        irAddArg(phi, call->dst);
+        irPrepend(cont, phi);
+    }
+    return cont;
+}
+
+static int rewriteCalls(DevirtCtx *c, int f) {
+    IrFunction *fn = c->funcs.fns[f];
+    int changed = 0;
+    int guarded = 0;
+    int n = fn->blockCount;
+    for (int i = 0; i < n; i++) {
+        IrBlock *b = fn->blocks[i];
+        IrInst *in = b->first;
+        while (in) {
+            if (in->op != IR_CALL_IND) { in = in->next; continue; }
+            Target t = resolve(c, f, in->args[0]);
+            int k = t.sym && !t.multi ? irFindFunction(&c->funcs, t.sym) : -1;
+            if (k < 0 && in->sym && in->count[0] > in->count[1]) {
+                k = irFindFunction(&c->funcs, in->sym);
+                t.other = 1;
+            }
+            if (k < 0) { in = in->next; continue; }
+            changed = 1;
+            if (!t.other) {
+                makeDirect(fn, b, in, c->funcs.fns[k]);
+                in = in->next;
+                continue;
+            }
+            b = guardCall(fn, b, in, c->funcs.fns[k]);
+            guarded = 1;
+            for (IrInst *p = b->first; p; p = p->next) {
+                if (p->dst >= 0 && p->dst < c->valueLimit[f]) c->blockOf[f][p->dst] = b;
+            }
+            in = b->first;
+        }
+    }
+    if (guarded) irSortRpo(fn);
+    return changed;
+}
+
+int devirtualizeCalls(IrModule *m) {
+    DevirtCtx ctx;
+    DevirtCtx *c = &ctx;
+    memset(c, 0, sizeof(*c));
+    int indirect = 0;
+    for (IrFunction *f = m->functions; f; f = f->next) {
+        for (int i = 0; i < f->blockCount; i++) {
+            for (IrInst *in = f->blocks[i]->first; in; in = in->next) indirect |= in->op == IR_CALL_IND;
+        }
+    }
+    if (!indirect) return 0;
+    irBuildFunctionTable(m, &c->funcs);
+    c->defs = malloc(sizeof(IrInst**) * (size_t)c->funcs.count);
+    c->blockOf = malloc(sizeof(IrBlock**) * (size_t)c->funcs.count);
+    c->valueLimit = malloc(sizeof(int) * (size_t)c->funcs.count);
+    c->seen = malloc(sizeof(int*) * (size_t)c->funcs.count);
+    c->escapes = calloc((size_t)c->funcs.count, 1);
+    c->writesMem = calloc((size_t)c->funcs.count, 1);
+    c->params = malloc(sizeof(Target*) * (size_t)c->funcs.count);
+    c->rets = calloc((size_t)c->funcs.count, sizeof(Target));
+    int f = 0;
+    for (IrFunction *fn = m->functions; fn; fn = fn->next, f++) {
+        int nv = fn->valueCount ? fn->valueCount : 1;
+        c->valueLimit[f] = fn->valueCount;
+        c->defs[f] = calloc((size_t)nv, sizeof(IrInst*));
+        c->blockOf[f] = calloc((size_t)nv, sizeof(IrBlock*));
+        c->seen[f] = calloc((size_t)nv, sizeof(int));
+        c->params[f] = calloc((size_t)(fn->paramCount ? fn->paramCount : 1), sizeof(Target));
+        for (int i = 0; i < fn->blockCount; i++) {
+            for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+                if (in->dst < 0) continue;
+                c->defs[f][in->dst] = in;
+                c->blockOf[f][in->dst] = fn->blocks[i];
+            }
+        }
+    }
+    markEscapes(c);
+    markMemWriters(c);
+    while (propagate(c)) {}
+
+    int changed = 0;
+    for (f = 0; f < c->funcs.count; f++) {
+        if (rewriteCalls(c, f)) {
+            eliminateDeadCode(c->funcs.fns[f]);
+            changed = 1;
+        }
+    }
+
+    for (f = 0; f < c->funcs.count; f++) {
+        free(c->defs[f]);
+        free(c->blockOf[f]);
+        free(c->seen[f]);
+        free(c->params[f]);
+    }
+    irFreeFunctionTable(&c->funcs);
+    free(c->defs);
+    free(c->blockOf);
+    free(c->valueLimit);
+    free(c->seen);
+    free(c->escapes);
+    free(c->writesMem);
+    free(c->params);
+    free(c->rets);
+    free(c->mem.slots);
+    return changed;
+}
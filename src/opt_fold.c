@@ -0,0 +1,352 @@
+#include "opt.h"
+#include <stdlib.h>
+
+// Lattice of a value during propagation: undefined (not yet seen), a known
+// constant, or varying.
+typedef enum { LAT_UNDEF, LAT_CONST, LAT_VARYING } LatticeKind;
+
+typedef struct {
+    LatticeKind kind;
+    int64_t value;
+} Lattice;
+
+typedef struct {
+    IrFunction *fn;
+    Lattice *lat;           // per value
+    char *reachable;        // per block
+    char **edgeLive;        // per block, per pred index
+    int changed;
+} FoldCtx;
+
+int foldBinOp(BinOpKind op, int64_t a, int64_t b, int64_t *out) {
+    uint64_t ua = (uint64_t)a;
+    uint64_t ub = (uint64_t)b;
+    switch (op) {
+        case BIN_ADD: *out = (int64_t)(ua + ub); return 1;
+        case BIN_SUB: *out = (int64_t)(ua - ub); return 1;
+        case BIN_MUL: *out = (int64_t)(ua * ub); return 1;
+        case BIN_DIV:
+        case BIN_MOD:
+            // idiv raises #DE for both; keep the runtime trap
+            if (b == 0 || (a == INT64_MIN && b == -1)) return 0;
+            *out = op == BIN_DIV ? a / b : a % b;
+            return 1;
+        case BIN_EQ: *out = a == b; return 1;
+        case BIN_NEQ: *out = a != b; return 1;
+        case BIN_LT: *out = a < b; return 1;
+        case BIN_GT: *out = a > b; return 1;
+        case BIN_LE: *out = a <= b; return 1;
+        case BIN_GE: *out = a >= b; return 1;
+    }
+    return 0;
+}
+
+static void setLattice(FoldCtx *c, int v, LatticeKind kind, int64_t value) {
+    Lattice *l = &c->lat[v];
+    if (l->kind == LAT_VARYING) return;
+    if (kind == LAT_CONST && l->kind == LAT_CONST && l->value != value) kind = LAT_VARYING;
+    if (kind == l->kind && (kind != LAT_CONST || l->value == value)) return;
+    if (kind == LAT_UNDEF) return;
+    l->kind = kind;
+    l->value = value;
+    c->changed = 1;
+}
+
+static void markEdge(FoldCtx *c, IrBlock *from, IrBlock *to) {
+    int k = irPredIndex(to, from);
+    if (!c->edgeLive[to->id][k]) { c->edgeLive[to->id][k] = 1; c->changed = 1; }
+    if (!c->reachable[to->id]) { c->reachable[to->id] = 1; c->changed = 1; }
+}
+
+static void evalInst(FoldCtx *c, IrBlock *b, IrInst *in) {
+    switch (in->op) {
+        case IR_CONST:
+            setLattice(c, in->dst, LAT_CONST, in->imm);
+            return;
+        case IR_COPY: {
+            Lattice a = c->lat[in->args[0]];
+            setLattice(c, in->dst, a.kind, a.value);
+            return;
+        }
+        case IR_PHI:
+            for (int k = 0; k < in->argCount; k++) {
+                if (!c->edgeLive[b->id][k]) continue;
+                Lattice a = c->lat[in->args[k]];
+                setLattice(c, in->dst, a.kind, a.value);
+            }
+            return;
+        case IR_BIN: {
+            Lattice a = c->lat[in->args[0]];
+            Lattice r = c->lat[in->args[1]];
+            int64_t v;
+            if (a.kind == LAT_CONST && r.kind == LAT_CONST) {
+                if (foldBinOp(in->binop, a.value, r.value, &v)) setLattice(c, in->dst, LAT_CONST, v);
+                else setLattice(c, in->dst, LAT_VARYING, 0);
+            } else if (a.kind == LAT_VARYING || r.kind == LAT_VARYING) {
+                setLattice(c, in->dst, LAT_VARYING, 0);
+            }
+            return;
+        }
+        case IR_JMP:
+            markEdge(c, b, in->target);
+            return;
+        case IR_BR: {
+            Lattice cond = c->lat[in->args[0]];
+            if (cond.kind == LAT_CONST) {
+                markEdge(c, b, cond.value ? in->target : in->elseTarget);
+            } else if (cond.kind == LAT_VARYING) {
+                markEdge(c, b, in->target);
+                markEdge(c, b, in->elseTarget);
+            }
+            return;
+        }
+        default:
+            if (in->dst >= 0) setLattice(c, in->dst, LAT_VARYING, 0);
+            return;
+    }
+}
+
+// Inserts a constant definition in the entry block, after the parameters,
+// where it dominates every use.
+static void insertEntryConst(IrFunction *fn, IrInst *in) {
+    IrBlock *entry = fn->blocks[0];
+    IrInst *pos = NULL;
+    for (IrInst *p = entry->first; p && p->op == IR_PARAM; p = p->next) pos = p;
+    irInsertAfter(entry, pos, in);
+}
+
+// Conditional constant propagation (Wegman & Zadeck), run to a fixpoint over
+// the blocks in layout order instead of with SSA worklists. Values proven
+// constant become IR_CONST and branches on constants become jumps.
+static int propagateConstants(IrFunction *fn) {
+    FoldCtx c;
+    int nv = fn->valueCount;
+    int nb = fn->blockCount;
+    irRenumberBlocks(fn);
+    c.fn = fn;
+    c.lat = calloc((size_t)(nv ? nv : 1), sizeof(Lattice));
+    c.reachable = calloc((size_t)nb, 1);
+    c.edgeLive = malloc(sizeof(char*) * (size_t)nb);
+    for (int i = 0; i < nb; i++) c.edgeLive[i] = calloc((size_t)(fn->blocks[i]->predCount + 1), 1);
+    c.reachable[0] = 1;
+    do {
+        c.changed = 0;
+        for (int i = 0; i < nb; i++) {
+            if (!c.reachable[i]) continue;
+            IrBlock *b = fn->blocks[i];
+            for (IrInst *in = b->first; in; in = in->next) evalInst(&c, b, in);
+        }
+    } while (c.changed);
+
+    int rewrote = 0;
+    for (int i = 0; i < nb; i++) {
+        IrBlock *b = fn->blocks[i];
+        if (!c.reachable[i]) continue;
+        IrInst *prev = NULL;
+        IrInst *in = b->first;
+        while (in) {
+            IrInst *next = in->next;
+            int isConst = in->dst >= 0 && c.lat[in->dst].kind == LAT_CONST;
+            if (isConst && (in->op == IR_BIN || in->op == IR_COPY || in->op == IR_PHI)) {
+                int64_t v = c.lat[in->dst].value;
+                in->argCount = 0;
+                if (in->op == IR_PHI) {
+                    // constants may not sit among the phis; move it to the entry block
+                    if (prev) prev->next = next; else b->first = next;
+                    if (b->last == in) b->last = prev;
+                    in->op = IR_CONST;
+                    in->imm = v;
+                    insertEntryConst(fn, in);
+                    rewrote = 1;
+                    in = next;
+                    continue;
+                }
+                in->op = IR_CONST;
+                in->imm = v;
+                rewrote = 1;
+            } else if (in->op == IR_BR && c.lat[in->args[0]].kind == LAT_CONST) {
+                IrBlock *keep = c.lat[in->args[0]].value ? in->target : in->elseTarget;
+                IrBlock *drop = keep == in->target ? in->elseTarget : in->target;
+                irRemovePred(drop, b);
+                in->op = IR_JMP;
+                in->argCount = 0;
+                in->target = keep;
+                in->elseTarget = NULL;
+                rewrote = 1;
+            }
+            prev = in;
+            in = next;
+        }
+    }
+
+    for (int i = 0; i < nb; i++) free(c.edgeLive[i]);
+    free(c.edgeLive);
+    free(c.reachable);
+    free(c.lat);
+    if (rewrote) {
+        irRemoveUnreachable(fn);
+        irSimplifyPhis(fn);
+    }
+    return rewrote;
+}
+
+static int constOf(IrInst **defs, int v, int64_t *out) {
+    if (!defs[v] || defs[v]->op != IR_CONST) return 0;
+    *out = defs[v]->imm;
+    return 1;
+}
+
+static void makeConst(IrInst *in, int64_t v) {
+    in->op = IR_CONST;
+    in->imm = v;
+    in->argCount = 0;
+}
+
+// Rewrites x+0, x-0, x*1, x/1 to x; x*0, x%1, x-x to 0; comparisons of a
+// value with itself to 0/1; and (x + c1) + c2 to x + (c1 + c2).
+static int simplifyAlgebra(IrFunction *fn) {
+    int nv = fn->valueCount;
+    IrInst **defs = calloc((size_t)(nv ? nv : 1), sizeof(IrInst*));
+    int *repl = malloc(sizeof(int) * (size_t)(nv ? nv : 1));
+    for (int v = 0; v < nv; v++) repl[v] = v;
+    for (int i = 0; i < fn->blockCount; i++) {
+        for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+            if (in->dst >= 0) defs[in->dst] = in;
+        }
+    }
+    int changed = 0;
+    for (int i = 0; i < fn->blockCount; i++) {
+        for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+            if (in->op != IR_BIN) continue;
+            int a = in->args[0];
+            int b = in->args[1];
+            int64_t ca = 0, cb = 0;
+            int aConst = constOf(defs, a, &ca);
+            int bConst = constOf(defs, b, &cb);
+            int same = -1;
+            switch (in->binop) {
+                case BIN_ADD:
+                    if (bConst && cb == 0) same = a;
+                    else if (aConst && ca == 0) same = b;
+                    break;
+                case BIN_SUB:
+                    if (bConst && cb == 0) same = a;
+                    else if (a == b) { makeConst(in, 0); changed = 1; }
+                    break;
+                case BIN_MUL:
+                    if (bConst && cb == 1) same = a;
+                    else if (aConst && ca == 1) same = b;
+                    else if ((bConst && cb == 0) || (aConst && ca == 0)) { makeConst(in, 0); changed = 1; }
+                    break;
+                case BIN_DIV:
+                    if (bConst && cb == 1) same = a;
+                    break;
+                case BIN_MOD:
+                    if (bConst && cb == 1) { makeConst(in, 0); changed = 1; }
+                    break;
+                default:
+                    if (a == b) {
+                        int64_t v;
+                        foldBinOp(in->binop, 0, 0, &v);
+                        makeConst(in, v);
+                        changed = 1;
+                    }
+                    break;
+            }
+            if (same >= 0) {
+                repl[in->dst] = same;
+                in->op = IR_NOP;
+                in->argCount = 0;
+                changed = 1;
+                continue;
+            }
+            // reassociate (x +- c1) +- c2 into x + c
+            if (in->op == IR_BIN && (in->binop == BIN_ADD || in->binop == BIN_SUB) && bConst &&
+                defs[a] && defs[a]->op == IR_BIN &&
+                (defs[a]->binop == BIN_ADD || defs[a]->binop == BIN_SUB)) {
+                int64_t c1;
+                IrInst *inner = defs[a];
+                // the inner constant may itself be new in this pass
+                if (inner->args[1] >= nv || !constOf(defs, inner->args[1], &c1)) continue;
+                uint64_t k = inner->binop == BIN_ADD ? (uint64_t)c1 : (uint64_t)0 - (uint64_t)c1;
+                k = in->binop == BIN_ADD ? k + (uint64_t)cb : k - (uint64_t)cb;
+                IrInst *kc = irNewInst(IR_CONST);
+                kc->dst = irNewValue(fn);
+                kc->imm = (int64_t)k;
+                insertEntryConst(fn, kc);
+                in->binop = BIN_ADD;
+                in->args[0] = inner->args[0];
+                in->args[1] = kc->dst;
+                changed = 1;
+            }
+        }
+    }
+    if (changed) {
+        // repl and defs only cover the values that existed before the pass
+        int *full = malloc(sizeof(int) * (size_t)fn->valueCount);
+        for (int v = 0; v < fn->valueCount; v++) full[v] = v < nv ? repl[v] : v;
+        irReplaceValues(fn, full);
+        irRemoveNops(fn);
+        free(full);
+    }
+    free(repl);
+    free(defs);
+    return changed;
+}
+
+// Instructions whose only effect is their result. Division stays unless it
+// provably cannot trap.
+static int isRemovable(IrInst *in, IrInst **defs) {
+    switch (in->op) {
+        case IR_CONST: case IR_COPY: case IR_PHI: case IR_FUNC_ADDR: case IR_LOCAL_ADDR:
+            return 1;
+        case IR_BIN: {
+            int64_t d;
+            if (in->binop != BIN_DIV && in->binop != BIN_MOD) return 1;
+            return constOf(defs, in->args[1], &d) && d != 0 && d != -1;
+        }
+        default:
+            return 0;
+    }
+}
+
+// Deletes the computations folding left without uses.
+static void removeDeadValues(IrFunction *fn) {
+    int nv = fn->valueCount;
+    int *uses = calloc((size_t)(nv ? nv : 1), sizeof(int));
+    IrInst **defs = calloc((size_t)(nv ? nv : 1), sizeof(IrInst*));
+    for (int i = 0; i < fn->blockCount; i++) {
+        for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+            if (in->dst >= 0) defs[in->dst] = in;
+            for (int k = 0; k < in->argCount; k++) uses[in->args[k]]++;
+        }
+    }
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 0; i < fn->blockCount; i++) {
+            for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+                if (in->op == IR_NOP || in->dst < 0 || uses[in->dst] || !isRemovable(in, defs)) continue;
+                for (int k = 0; k < in->argCount; k++) uses[in->args[k]]--;
+                in->op = IR_NOP;
+                in->argCount = 0;
+                changed = 1;
+            }
+        }
+    }
+    irRemoveNops(fn);
+    free(uses);
+    free(defs);
+}
+
+int foldConstants(IrFunction *fn) {
+    int any = 0;
+    for (int round = 0; round < 8; round++) {
+        int changed = propagateConstants(fn);
+        changed |= simplifyAlgebra(fn);
+        if (!changed) break;
+        any = 1;
+    }
+    if (any) removeDeadValues(fn);
+    return any;
+}
@@ -0,0 +1,391 @@
+#include "opt.h"
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+// Inlining of direct calls. Functions are visited bottom-up over the call
+// graph, so a callee has already been optimized (and has had its own calls
+// inlined) when its body is copied into a caller.
+//
+// A call is replaced when the callee's size minus the expected benefit stays
+// within the limit. The size counts the instructions that survive code
+// generation; the benefit is what disappears with the call: the call itself,
+// the argument moves, constant arguments that fold in the copy, and the frame
+// setup of a leaf. Recursive functions are never inlined. With a profile
+// (-fprofile-use) the limit is 0 in callers that never ran, so they only
+// take calls that shrink them, and four times as large for callees entered
+// at least a sixteenth as often as the hottest function.
+//
+// The copy is plain SSA renaming: every callee value gets a fresh caller
+// value, parameters become the call's arguments and frame slots are moved
+// past the caller's own slots, keeping their relative layout.
+
+typedef struct {
+    IrFunctionTable funcs;
+    int *size;              // per function
+    char *leaf;             // per function: no calls at all
+    char *recursive;        // per function: reaches itself in the call graph
+    char *done;             // per function: already visited bottom-up
+    int limit;
+    int64_t hotEntry;       // with a profile: entry count of a hot callee, else 0
+} InlineCtx;
+
+// Callers stop growing past this many instructions.
+#define INLINE_MAX_CALLER_SIZE 4000
+
+static int functionSize(IrFunction *fn) {
+    int n = 0;
+    for (int b = 0; b < fn->blockCount; b++) {
+        for (IrInst *in = fn->blocks[b]->first; in; in = in->next) {
+            if (in->op != IR_PARAM && in->op != IR_CONST && in->op != IR_NOP && in->op != IR_JMP) n++;
+        }
+    }
+    return n;
+}
+
+static int isLeaf(IrFunction *fn) {
+    for (int b = 0; b < fn->blockCount; b++) {
+        for (IrInst *in = fn->blocks[b]->first; in; in = in->next) {
+            if (in->op == IR_CALL || in->op == IR_CALL_IND) return 0;
+        }
+    }
+    return 1;
+}
+
+static int hasReturn(IrFunction *fn) {
+    for (int b = 0; b < fn->blockCount; b++) {
+        if (irTerminator(fn->blocks[b])->op == IR_RET) return 1;
+    }
+    return 0;
+}
+
+// recursive[i] is set when function i can reach itself through direct calls:
+// it calls itself, or its strongly connected component of the call graph
+// (found with Tarjan's algorithm) has other functions in it.
+static void markRecursive(InlineCtx *c) {
+    int n = c->funcs.count;
+    int *start = calloc((size_t)n + 1, sizeof(int));   // callees of i from start[i]
+    for (int i = 0; i < n; i++) {
+        IrFunction *f = c->funcs.fns[i];
+        for (int b = 0; b < f->blockCount; b++) {
+            for (IrInst *in = f->blocks[b]->first; in; in = in->next) {
+                if (in->op == IR_CALL && irFindFunction(&c->funcs, in->sym) >= 0) start[i + 1]++;
+            }
+        }
+    }
+    for (int i = 0; i < n; i++) start[i + 1] += start[i];
+    int *callees = malloc(sizeof(int) * (size_t)(start[n] ? start[n] : 1));
+    for (int i = 0; i < n; i++) {
+        IrFunction *f = c->funcs.fns[i];
+        int e = start[i];
+        for (int b = 0; b < f->blockCount; b++) {
+            for (IrInst *in = f->blocks[b]->first; in; in = in->next) {
+                if (in->op != IR_CALL) continue;
+                int k = irFindFunction(&c->funcs, in->sym);
+                if (k < 0) continue;
+                if (k == i) c->recursive[i] = 1;
+                callees[e++] = k;
+            }
+        }
+    }
+
+    int *index = malloc(sizeof(int) * (size_t)(n ? n : 1));
+    int *low = malloc(sizeof(int) * (size_t)(n ? n : 1));
+    int *next = malloc(sizeof(int) * (size_t)(n ? n : 1));   // next edge to follow
+    int *path = malloc(sizeof(int) * (size_t)(n ? n : 1));   // depth-first path
+    int *open = malloc(sizeof(int) * (size_t)(n ? n : 1));   // not yet in a component
+    char *isOpen = calloc((size_t)(n ? n : 1), 1);
+    for (int i = 0; i < n; i++) index[i] = -1;
+    int counter = 0, openCount = 0;
+    for (int root = 0; root < n; root++) {
+        if (index[root] >= 0) continue;
+        int depth = 0;
+        path[depth++] = root;
+        index[root] = low[root] = counter++;
+        next[root] = start[root];
+        open[openCount++] = root;
+        isOpen[root] = 1;
+        while (depth) {
+            int v = path[depth - 1];
+            if (next[v] < start[v + 1]) {
+                int w = callees[next[v]++];
+                if (index[w] < 0) {
+                    index[w] = low[w] = counter++;
+                    next[w] = start[w];
+                    open[openCount++] = w;
+                    isOpen[w] = 1;
+                    path[depth++] = w;
+                } else if (isOpen[w] && index[w] < low[v]) {
+                    low[v] = index[w];
+                }
+                continue;
+            }
+            depth--;
+            if (depth && low[v] < low[path[depth - 1]]) low[path[depth - 1]] = low[v];
+            if (low[v] != index[v]) continue;
+            int first = openCount - 1;
+            while (open[first] != v) first--;
+            for (int k = first; k < openCount; k++) {
+                isOpen[open[k]] = 0;
+                if (openCount - first > 1) c->recursive[open[k]] = 1;
+            }
+            openCount = first;
+        }
+    }
+    free(isOpen);
+    free(open);
+    free(path);
+    free(next);
+    free(low);
+    free(index);
+    free(callees);
+    free(start);
+}
+
+static int isConstValue(IrFunction *fn, int v) {
+    for (IrInst *in = fn->blocks[0]->first; in; in = in->next) {
+        if (in->dst == v) return in->op == IR_CONST;
+    }
+    return 0;
+}
+
+static int worthInlining(InlineCtx *c, IrFunction *caller, IrInst *call, int k, int callerSize) {
+    IrFunction *callee = c->funcs.fns[k];
+    if (callee == caller || c->recursive[k] || !hasReturn(callee)) return 0;
+    if (callee->blocks[0]->predCount) return 0;
+    if (callerSize + c->size[k] > INLINE_MAX_CALLER_SIZE) return 0;
+    int benefit = 1 + call->argCount;
+    for (int i = 0; i < call->argCount && i < callee->paramCount; i++) {
+        if (isConstValue(caller, call->args[i])) benefit += 2;
+    }
+    if (c->leaf[k]) benefit += 2;
+    int limit = c->limit;
+    if (c->hotEntry && caller->entryCount == 0) limit = 0;
+    else if (c->hotEntry && callee->entryCount >= c->hotEntry) limit *= 4;
+    return c->size[k] - benefit <= limit;
+}
+
+static void replacePred(IrBlock *b, IrBlock *from, IrBlock *to) {
+    for (int i = 0; i < b->predCount; i++) {
+        if (b->preds[i] == from) b->preds[i] = to;
+    }
+}
+
+// Replaces `call` in block b with a copy of the callee. Returns the block
+// holding the instructions that followed the call.
+static IrBlock *inlineCall(IrFunction *fn, IrBlock *b, IrInst *call, IrFunction *callee) {
+    // split b after the call; the continuation takes over b's successors
+    IrBlock *cont = irNewBlock(fn);
+    IrInst *prev = NULL;
+    for (IrInst *p = b->first; p != call; p = p->next) prev = p;
+    cont->first = call->next;
+    cont->last = b->last;
+    if (prev) prev->next = NULL; else b->first = NULL;
+    b->last = prev;
+    IrBlock *succ[2];
+    int sc = irSuccessors(cont, succ);
+    for (int i = 0; i < sc; i++) replacePred(succ[i], b, cont);
+
+    int *vmap = malloc(sizeof(int) * (size_t)(callee->valueCount ? callee->valueCount : 1));
+    IrBlock **bmap = malloc(sizeof(IrBlock*) * (size_t)callee->blockCount);
+    for (int i = 0; i < callee->blockCount; i++) callee->blocks[i]->id = i;
+    for (int i = 0; i < callee->blockCount; i++) {
+        bmap[i] = irNewBlock(fn);
+        for (IrInst *in = callee->blocks[i]->first; in; in = in->next) {
+            if (in->dst < 0) continue;
+            if (in->op == IR_PARAM) {
+                if (in->imm < call->argCount) {
+                    vmap[in->dst] = call->args[in->imm];
+                } else {
+                    IrInst *z = irNewInst(IR_CONST);
+                    z->dst = irNewValue(fn);
+                    irAppend(b, z);
+                    vmap[in->dst] = z->dst;
+                }
+            } else {
+                vmap[in->dst] = irNewValue(fn);
+            }
+        }
+    }
+
+    int slotBase = fn->slotCount;
+    fn->slotCount += callee->slotCount;
+    IrBlock **retBlocks = malloc(sizeof(IrBlock*) * (size_t)callee->blockCount);
+    int *retValues = malloc(sizeof(int) * (size_t)callee->blockCount);
+    int retCount = 0;
+    for (int i = 0; i < callee->blockCount; i++) {
+        IrBlock *src = callee->blocks[i];
+        IrBlock *dst = bmap[i];
+        for (int k = 0; k < src->predCount; k++) irAddPred(dst, bmap[src->preds[k]->id]);
+        for (IrInst *in = src->first; in; in = in->next) {
+            if (in->op == IR_PARAM) continue;
+            IrInst *cp = irNewInst(in->op);
+            cp->binop = in->binop;
+            cp->dst = in->dst >= 0 ? vmap[in->dst] : -1;
+            for (int k = 0; k < in->argCount; k++) irAddArg(cp, vmap[in->args[k]]);
+            cp->imm = in->imm;
+            memcpy(cp->count, in->count, sizeof(cp->count));
+            if (in->op == IR_LOCAL_ADDR || in->op == IR_LOAD_LOCAL || in->op == IR_STORE_LOCAL) {
+                cp->imm += slotBase;
+            }
+            if (in->sym) cp->sym = strDup(in->sym);
+            if (in->target) cp->target = bmap[in->target->id];
+            if (in->elseTarget) cp->elseTarget = bmap[in->elseTarget->id];
+            if (in->op == IR_RET) {
+                retBlocks[retCount] = dst;
+                retValues[retCount++] = cp->args[0];
+                cp->op = IR_JMP;
+                cp->argCount = 0;
+                cp->target = cont;
+            }
+            irAppend(dst, cp);
+        }
+    }
+
+    IrInst *jmp = irNewInst(IR_JMP);
+    jmp->target = bmap[0];
+    irAppend(b, jmp);
+    irAddPred(bmap[0], b);
+    for (int i = 0; i < retCount; i++) irAddPred(cont, retBlocks[i]);
+
+    if (call->dst >= 0) {
+        int result = retValues[0];
+        if (retCount > 1) {
+            IrInst *phi = irNewInst(IR_PHI);
+            phi->dst = irNewValue(fn);
+            for (int i = 0; i < retCount; i++) irAddArg(phi, retValues[i]);
+            irPrepend(cont, phi);
+            result = phi->dst;
+        }
+        int *repl = malloc(sizeof(int) * (size_t)fn->valueCount);
+        for (int v = 0; v < fn->valueCount; v++) repl[v] = v;
+        repl[call->dst] = result;
+        irReplaceValues(fn, repl);
+        free(repl);
+    }
+
+    free(call->args);
+    free(call->sym);
+    free(call);
+    free(vmap);
+    free(bmap);
+    free(retBlocks);
+    free(retValues);
+    return cont;
+}
+
+// Folds a block into its only predecessor when that predecessor jumps to it
+// unconditionally, undoing the splits left behind by inlining.
+static void mergeBlocks(IrFunction *fn) {
+    irRenumberBlocks(fn);
+    char *gone = calloc((size_t)fn->blockCount, 1);
+    for (int i = 0; i < fn->blockCount; i++) {
+        IrBlock *b = fn->blocks[i];
+        if (gone[i]) continue;
+        for (;;) {
+            IrInst *t = irTerminator(b);
+            if (t->op != IR_JMP) break;
+            IrBlock *s = t->target;
+            if (s == b || s->id == 0 || s->predCount != 1 || (s->first && s->first->op == IR_PHI)) break;
+            IrInst *prev = NULL;
+            for (IrInst *p = b->first; p != t; p = p->next) prev = p;
+            if (prev) prev->next = s->first; else b->first = s->first;
+            b->last = s->last;
+            free(t);
+            IrBlock *succ[2];
+            int sc = irSuccessors(b, succ);
+            for (int k = 0; k < sc; k++) replacePred(succ[k], s, b);
+            s->first = s->last = NULL;
+            s->predCount = 0;
+            gone[s->id] = 1;
+        }
+    }
+    int w = 0;
+    for (int i = 0; i < fn->blockCount; i++) {
+        if (gone[i]) {
+            free(fn->blocks[i]->preds);
+            free(fn->blocks[i]);
+        } else {
+            fn->blocks[w++] = fn->blocks[i];
+        }
+    }
+    fn->blockCount = w;
+    irRenumberBlocks(fn);
+    free(gone);
+}
+
+static int inlineCalls(InlineCtx *c, IrFunction *fn) {
+    int size = functionSize(fn);
+    int inlined = 0;
+    int n = fn->blockCount;
+    for (int i = 0; i < n; i++) {
+        IrBlock *b = fn->blocks[i];
+        IrInst *in = b->first;
+        while (in) {
+            int k = in->op == IR_CALL ? irFindFunction(&c->funcs, in->sym) : -1;
+            if (k >= 0 && worthInlining(c, fn, in, k, size)) {
+                size += c->size[k];
+                b = inlineCall(fn, b, in, c->funcs.fns[k]);
+                in = b->first;
+                inlined = 1;
+                continue;
+            }
+            in = in->next;
+        }
+    }
+    if (!inlined) return 0;
+    mergeBlocks(fn);
+    irSortRpo(fn);
+    irSimplifyPhis(fn);
+    return 1;
+}
+
+// Post-order walk of the call graph: callees are finished before callers.
+static void visit(InlineCtx *c, FunctionPurity *purity, int k) {
+    c->done[k] = 1;
+    IrFunction *fn = c->funcs.fns[k];
+    for (int b = 0; b < fn->blockCount; b++) {
+        for (IrInst *in = fn->blocks[b]->first; in; in = in->next) {
+            if (in->op != IR_CALL) continue;
+            int j = irFindFunction(&c->funcs, in->sym);
+            if (j >= 0 && !c->done[j]) visit(c, purity, j);
+        }
+    }
+    if (inlineCalls(c, fn)) {
+        foldConstants(fn);
+        hoistLoopInvariants(fn, purity);
+        eliminateDeadCode(fn);
+        updatePurity(purity, fn);
+    }
+    c->size[k] = functionSize(fn);
+    c->leaf[k] = (char)isLeaf(fn);
+}
+
+int inlineFunctions(IrModule *m, int limit, FunctionPurity *purity) {
+    if (limit <= 0 || !m->functions) return 0;
+    InlineCtx c;
+    memset(&c, 0, sizeof(c));
+    c.limit = limit;
+    for (IrFunction *f = m->functions; f; f = f->next) {
+        if (m->profiled && f->entryCount / 16 + 1 > c.hotEntry) c.hotEntry = f->entryCount / 16 + 1;
+    }
+    irBuildFunctionTable(m, &c.funcs);
+    c.size = malloc(sizeof(int) * (size_t)c.funcs.count);
+    c.leaf = malloc((size_t)c.funcs.count);
+    c.recursive = calloc((size_t)c.funcs.count, 1);
+    c.done = calloc((size_t)c.funcs.count, 1);
+    for (int i = 0; i < c.funcs.count; i++) {
+        c.size[i] = functionSize(c.funcs.fns[i]);
+        c.leaf[i] = (char)isLeaf(c.funcs.fns[i]);
+    }
+    markRecursive(&c);
+    for (int i = 0; i < c.funcs.count; i++) {
+        if (!c.done[i]) visit(&c, purity, i);
+    }
+    irFreeFunctionTable(&c.funcs);
+    free(c.size);
+    free(c.leaf);
+    free(c.recursive);
+    free(c.done);
+    return 1;
+}
@@ -0,0 +1,405 @@
+#include "opt.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Loop-invariant code motion. Natural loops are found from back edges
+// (latch -> header where the header dominates the latch), each loop gets a
+// preheader, and instructions whose operands do not change inside the loop
+// are moved there.
+//
+// Pure arithmetic can be moved from anywhere in the loop. Instructions that
+// may trap, fault or not return (loads, division by a non-constant, calls)
+// are only moved from the header, and only while nothing with a visible
+// effect comes before them there: the header runs at the start of every
+// iteration, so the instruction would have run first anyway.
+
+typedef struct {
+    IrFunction *fn;
+    const FunctionPurity *purity;
+    int *idom;              // per block id below blockLimit
+    int blockLimit;         // blocks that existed before preheaders were added
+    char *inLoop;           // per block id, for the loop being processed
+    char *loopValue;        // per value: defined inside the loop
+    char *slotStored;       // per frame slot, stored inside the loop
+    int loopCalls;          // impure or indirect call inside the loop
+    int loopMemStores;      // IR_STORE_MEM inside the loop
+    int loopPtrStores;      // IR_STORE inside the loop
+    int loopSlotStores;     // IR_STORE_LOCAL inside the loop
+} LicmCtx;
+
+enum { PURE_NO, PURE_YES, PURE_TOTAL };
+
+struct FunctionPurity {
+    IrFunctionTable funcs;
+    char *pure;             // per function in module order: PURE_*
+};
+
+static int isSafeDivisor(IrInst **defs, int v) {
+    IrInst *d = defs[v];
+    return d && d->op == IR_CONST && d->imm != 0 && d->imm != -1;
+}
+
+// What the body of f allows with its calls left aside: PURE_NO when it
+// touches memory other than its frame, PURE_YES when it may loop or trap on
+// a division, else PURE_TOTAL.
+static int bodyPurity(IrFunction *f) {
+    IrInst **defs = calloc((size_t)(f->valueCount ? f->valueCount : 1), sizeof(IrInst*));
+    for (int b = 0; b < f->blockCount; b++) {
+        for (IrInst *in = f->blocks[b]->first; in; in = in->next) {
+            if (in->dst >= 0) defs[in->dst] = in;
+        }
+    }
+    int r = PURE_TOTAL;
+    for (int b = 0; r != PURE_NO && b < f->blockCount; b++) {
+        IrBlock *blk = f->blocks[b];
+        for (int k = 0; k < blk->predCount; k++) if (blk->preds[k]->id >= b) r = PURE_YES;
+        for (IrInst *in = blk->first; r != PURE_NO && in; in = in->next) {
+            switch (in->op) {
+                case IR_LOAD_MEM: case IR_STORE_MEM: case IR_LOAD: case IR_STORE:
+                case IR_CALL_IND: case IR_COUNT:
+                    r = PURE_NO;
+                    break;
+                case IR_BIN:
+                    if ((in->binop == BIN_DIV || in->binop == BIN_MOD) && !isSafeDivisor(defs, in->args[1])) r = PURE_YES;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    free(defs);
+    return r;
+}
+
+// A function is pure when it only reads its arguments and its own frame and
+// only calls pure functions: everything starts pure and the callers of an
+// impure function are dropped in turn, so mutual recursion stays pure. A
+// pure function also always returns when it has no loop, cannot trap on a
+// division and only calls functions that always return: those are found
+// callees first, so recursion never qualifies.
+FunctionPurity *analyzePurity(IrModule *m) {
+    FunctionPurity *p = malloc(sizeof(FunctionPurity));
+    irBuildFunctionTable(m, &p->funcs);
+    int n = p->funcs.count;
+    p->pure = malloc((size_t)(n ? n : 1));
+    char *body = malloc((size_t)(n ? n : 1));
+    int *pending = calloc((size_t)(n ? n : 1), sizeof(int)); // calls of i to functions not yet total
+    int *callerStart = calloc((size_t)n + 1, sizeof(int)); // callers[] of k from callerStart[k]
+    int edges = 0;
+    for (int i = 0; i < n; i++) {
+        IrFunction *f = p->funcs.fns[i];
+        body[i] = (char)bodyPurity(f);
+        for (int b = 0; b < f->blockCount; b++) {
+            for (IrInst *in = f->blocks[b]->first; in; in = in->next) {
+                if (in->op != IR_CALL) continue;
+                int k = irFindFunction(&p->funcs, in->sym);
+                if (k < 0) body[i] = PURE_NO;
+                else { edges++; pending[i]++; callerStart[k + 1]++; }
+            }
+        }
+    }
+    for (int i = 0; i < n; i++) callerStart[i + 1] += callerStart[i];
+    int *callers = malloc(sizeof(int) * (size_t)(edges ? edges : 1));
+    int *fill = malloc(sizeof(int) * (size_t)(n ? n : 1));
+    memcpy(fill, callerStart, sizeof(int) * (size_t)n);
+    for (int i = 0; i < n; i++) {
+        IrFunction *f = p->funcs.fns[i];
+        for (int b = 0; b < f->blockCount; b++) {
+            for (IrInst *in = f->blocks[b]->first; in; in = in->next) {
+                if (in->op != IR_CALL) continue;
+                int k = irFindFunction(&p->funcs, in->sym);
+                if (k >= 0) callers[fill[k]++] = i;
+            }
+        }
+    }
+
+    int *stack = malloc(sizeof(int) * (size_t)(n ? n : 1));
+    int sp = 0;
+    for (int i = 0; i < n; i++) {
+        p->pure[i] = body[i] == PURE_NO ? PURE_NO : PURE_YES;
+        if (p->pure[i] == PURE_NO) stack[sp++] = i;
+    }
+    while (sp) {
+        int f = stack[--sp];
+        for (int e = callerStart[f]; e < callerStart[f + 1]; e++) {
+            int g = callers[e];
+            if (p->pure[g] != PURE_NO) { p->pure[g] = PURE_NO; stack[sp++] = g; }
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (p->pure[i] == PURE_YES && body[i] == PURE_TOTAL && pending[i] == 0) {
+            p->pure[i] = PURE_TOTAL;
+            stack[sp++] = i;
+        }
+    }
+    while (sp) {
+        int f = stack[--sp];
+        for (int e = callerStart[f]; e < callerStart[f + 1]; e++) {
+            int g = callers[e];
+            if (--pending[g] == 0 && p->pure[g] == PURE_YES && body[g] == PURE_TOTAL) {
+                p->pure[g] = PURE_TOTAL;
+                stack[sp++] = g;
+            }
+        }
+    }
+    free(stack);
+    free(fill);
+    free(callers);
+    free(callerStart);
+    free(pending);
+    free(body);
+    return p;
+}
+
+// Inlining, folding and dead code removal only ever take effects out of a
+// function, so fn can only have become purer, and what its callers were
+// found to be still holds.
+void updatePurity(FunctionPurity *p, IrFunction *fn) {
+    int i = irFindFunction(&p->funcs, fn->name);
+    if (i < 0 || p->funcs.fns[i] != fn) return;
+    int r = bodyPurity(fn);
+    for (int b = 0; r != PURE_NO && b < fn->blockCount; b++) {
+        for (IrInst *in = fn->blocks[b]->first; r != PURE_NO && in; in = in->next) {
+            if (in->op != IR_CALL) continue;
+            int k = irFindFunction(&p->funcs, in->sym);
+            int callee = k < 0 ? PURE_NO : k == i ? PURE_YES : p->pure[k];
+            if (callee < r) r = callee;
+        }
+    }
+    if (r > p->pure[i]) p->pure[i] = (char)r;
+}
+
+void freePurity(FunctionPurity *p) {
+    irFreeFunctionTable(&p->funcs);
+    free(p->pure);
+    free(p);
+}
+
+static int callPurity(LicmCtx *c, IrInst *in) {
+    if (in->op != IR_CALL) return PURE_NO;
+    int k = irFindFunction(&c->purity->funcs, in->sym);
+    return k >= 0 ? c->purity->pure[k] : PURE_NO;
+}
+
+static int intersect(int *idom, int a, int b) {
+    while (a != b) {
+        while (a > b) a = idom[a];
+        while (b > a) b = idom[b];
+    }
+    return a;
+}
+
+// Cooper, Harvey and Kennedy's iterative dominators over the block order,
+// which is a reverse postorder.
+static void computeDominators(IrFunction *fn, int *idom) {
+    for (int i = 0; i < fn->blockCount; i++) idom[i] = -1;
+    idom[0] = 0;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 1; i < fn->blockCount; i++) {
+            IrBlock *b = fn->blocks[i];
+            int d = -1;
+            for (int k = 0; k < b->predCount; k++) {
+                int p = b->preds[k]->id;
+                if (idom[p] < 0) continue;
+                d = d < 0 ? p : intersect(idom, d, p);
+            }
+            if (d != idom[i]) { idom[i] = d; changed = 1; }
+        }
+    }
+}
+
+static int dominates(int *idom, int a, int b) {
+    while (b != a && b != 0) b = idom[b];
+    return b == a;
+}
+
+// Blocks of the natural loop of header h: h plus everything that reaches one
+// of its latches without going through h.
+static void collectLoop(LicmCtx *c, IrBlock *h) {
+    IrFunction *fn = c->fn;
+    memset(c->inLoop, 0, (size_t)(2 * c->blockLimit));
+    IrBlock **stack = malloc(sizeof(IrBlock*) * (size_t)fn->blockCount);
+    int sp = 0;
+    c->inLoop[h->id] = 1;
+    for (int k = 0; k < h->predCount; k++) {
+        IrBlock *p = h->preds[k];
+        if (p->id >= c->blockLimit || c->inLoop[p->id] || !dominates(c->idom, h->id, p->id)) continue;
+        c->inLoop[p->id] = 1;
+        stack[sp++] = p;
+    }
+    while (sp) {
+        IrBlock *b = stack[--sp];
+        for (int k = 0; k < b->predCount; k++) {
+            IrBlock *p = b->preds[k];
+            if (!c->inLoop[p->id]) { c->inLoop[p->id] = 1; stack[sp++] = p; }
+        }
+    }
+    free(stack);
+}
+
+// The single block outside the loop that jumps to h, made into a block of its
+// own when it also goes elsewhere. NULL when h has several outside preds.
+static IrBlock *getPreheader(LicmCtx *c, IrBlock *h) {
+    int outside = -1;
+    for (int k = 0; k < h->predCount; k++) {
+        if (c->inLoop[h->preds[k]->id]) continue;
+        if (outside >= 0) return NULL;
+        outside = k;
+    }
+    if (outside < 0) return NULL;
+    IrBlock *p = h->preds[outside];
+    IrInst *term = irTerminator(p);
+    if (term && term->op == IR_JMP) return p;
+    if (!term || term->op != IR_BR) return NULL;
+    IrBlock *pre = irNewBlock(c->fn);
+    IrInst *j = irNewInst(IR_JMP);
+    j->target = h;
+    irAppend(pre, j);
+    irAddPred(pre, p);
+    if (term->target == h) term->target = pre;
+    if (term->elseTarget == h) term->elseTarget = pre;
+    h->preds[outside] = pre;
+    return pre;
+}
+
+static void scanLoopEffects(LicmCtx *c) {
+    IrFunction *fn = c->fn;
+    memset(c->loopValue, 0, (size_t)fn->valueCount);
+    memset(c->slotStored, 0, (size_t)(fn->slotCount ? fn->slotCount : 1));
+    c->loopCalls = c->loopMemStores = c->loopPtrStores = c->loopSlotStores = 0;
+    for (int i = 0; i < fn->blockCount; i++) {
+        if (!c->inLoop[i]) continue;
+        for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+            if (in->dst >= 0) c->loopValue[in->dst] = 1;
+            switch (in->op) {
+                case IR_STORE_LOCAL:
+                    c->slotStored[in->imm] = 1;
+                    c->loopSlotStores = 1;
+                    break;
+                case IR_STORE_MEM: c->loopMemStores = 1; break;
+                case IR_STORE: c->loopPtrStores = 1; break;
+                case IR_CALL_IND: c->loopCalls = 1; break;
+                case IR_CALL: if (callPurity(c, in) == PURE_NO) c->loopCalls = 1; break;
+                default: break;
+            }
+        }
+    }
+}
+
+// 0: cannot move; 1: can move from anywhere in the loop; 2: can move only
+// from the head of the header (may trap or not return).
+static int movability(LicmCtx *c, IrInst *in, IrInst **defs) {
+    for (int k = 0; k < in->argCount; k++) if (c->loopValue[in->args[k]]) return 0;
+    switch (in->op) {
+        case IR_CONST: case IR_COPY: case IR_FUNC_ADDR: case IR_LOCAL_ADDR:
+            return 1;
+        case IR_BIN:
+            if (in->binop != BIN_DIV && in->binop != BIN_MOD) return 1;
+            return isSafeDivisor(defs, in->args[1]) ? 1 : 2;
+        case IR_LOAD_LOCAL:
+            // a pointer to any local can reach every frame slot (doc.md 5.5.1)
+            return c->slotStored[in->imm] || c->loopCalls || c->loopPtrStores ? 0 : 1;
+        case IR_LOAD_MEM:
+            return c->loopCalls || c->loopMemStores || c->loopPtrStores ? 0 : 2;
+        case IR_LOAD:
+            return c->loopCalls || c->loopMemStores || c->loopPtrStores || c->loopSlotStores ? 0 : 2;
+        case IR_CALL:
+            return callPurity(c, in) == PURE_TOTAL ? 1 : callPurity(c, in) == PURE_YES ? 2 : 0;
+        default:
+            return 0;
+    }
+}
+
+// Whether an instruction that stays in the header may trap or has an effect,
+// after which nothing that may trap can be moved in front of it.
+static int isBarrier(LicmCtx *c, IrInst *in, IrInst **defs) {
+    switch (in->op) {
+        case IR_CALL:
+            return callPurity(c, in) != PURE_TOTAL;
+        case IR_LOAD_MEM: case IR_LOAD:
+            return 1;
+        case IR_BIN:
+            if (in->binop != BIN_DIV && in->binop != BIN_MOD) return 0;
+            return !isSafeDivisor(defs, in->args[1]);
+        default:
+            return irHasSideEffects(in);
+    }
+}
+
+static int hoistLoop(LicmCtx *c, IrBlock *h, IrInst **defs) {
+    IrBlock *pre = getPreheader(c, h);
+    if (!pre) return 0;
+    scanLoopEffects(c);
+    int moved = 0;
+    for (int i = 0; i < c->fn->blockCount; i++) {
+        if (!c->inLoop[i]) continue;
+        IrBlock *b = c->fn->blocks[i];
+        int headOnly = b == h;      // nothing with an effect seen yet in the header
+        IrInst *prev = NULL;
+        IrInst *in = b->first;
+        while (in) {
+            IrInst *next = in->next;
+            int m = in->op == IR_PHI || irIsTerminator(in->op) ? 0 : movability(c, in, defs);
+            if (m == 1 || (m == 2 && headOnly)) {
+                if (prev) prev->next = next; else b->first = next;
+                if (b->last == in) b->last = prev;
+                irInsertBeforeTerminator(pre, in);
+                c->loopValue[in->dst] = 0;
+                moved = 1;
+            } else {
+                if (isBarrier(c, in, defs)) headOnly = 0;
+                prev = in;
+            }
+            in = next;
+        }
+    }
+    return moved;
+}
+
+int hoistLoopInvariants(IrFunction *fn, const FunctionPurity *purity) {
+    if (fn->blockCount == 0) return 0;
+    irSortRpo(fn);
+    LicmCtx c;
+    memset(&c, 0, sizeof(c));
+    c.fn = fn;
+    c.purity = purity;
+    int n = fn->blockCount;
+    c.idom = malloc(sizeof(int) * (size_t)n);
+    c.blockLimit = n;
+    c.inLoop = malloc((size_t)(2 * n));     // each header adds at most one preheader
+    c.loopValue = malloc((size_t)(fn->valueCount ? fn->valueCount : 1));
+    c.slotStored = malloc((size_t)(fn->slotCount ? fn->slotCount : 1));
+    IrInst **defs = calloc((size_t)(fn->valueCount ? fn->valueCount : 1), sizeof(IrInst*));
+    for (int i = 0; i < n; i++) {
+        for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+            if (in->dst >= 0) defs[in->dst] = in;
+        }
+    }
+    computeDominators(fn, c.idom);
+
+    // Headers in reverse layout order: inner loops come first, and what
+    // they hoist into their preheader can then leave the outer loop too.
+    // New preheaders are appended after the first n blocks and only get
+    // their ids fixed by the final sort.
+    int moved = 0;
+    for (int i = n - 1; i >= 1; i--) {
+        IrBlock *h = fn->blocks[i];
+        int isHeader = 0;
+        for (int k = 0; k < h->predCount; k++) {
+            if (h->preds[k]->id < n && dominates(c.idom, i, h->preds[k]->id)) isHeader = 1;
+        }
+        if (!isHeader) continue;
+        collectLoop(&c, h);
+        moved |= hoistLoop(&c, h, defs);
+    }
+    irSortRpo(fn);
+    free(defs);
+    free(c.slotStored);
+    free(c.loopValue);
+    free(c.inLoop);
+    free(c.idom);
+    return moved;
+}
@@ -0,0 +1,103 @@
+#include "opt.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Self tail recursion to loops. `return f(args)` inside f becomes a jump back
+// to a new loop header right after the parameters, where one phi per
+// parameter merges the incoming values with the arguments of each tail call.
+// Functions with frame slots are left alone: a pointer to the caller's frame
+// may be among the arguments, and the loop would reuse that frame.
+
+static int isSelfTailCall(IrFunction *fn, IrInst *in) {
+    IrInst *ret = in->next;
+    return in->op == IR_CALL && strcmp(in->sym, fn->name) == 0 && in->dst >= 0 &&
+           ret && ret->op == IR_RET && ret->args[0] == in->dst;
+}
+
+int eliminateTailRecursion(IrFunction *fn) {
+    if (fn->slotCount || fn->blockCount == 0) return 0;
+    int sites = 0;
+    for (int i = 0; i < fn->blockCount; i++) {
+        for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+            if (isSelfTailCall(fn, in)) sites++;
+        }
+    }
+    if (!sites) return 0;
+
+    // entry keeps the params and jumps to the header, which takes the rest
+    IrBlock *entry = fn->blocks[0];
+    IrBlock *header = irNewBlock(fn);
+    IrInst *lastParam = NULL;
+    for (IrInst *in = entry->first; in && in->op == IR_PARAM; in = in->next) lastParam = in;
+    header->first = lastParam ? lastParam->next : entry->first;
+    header->last = entry->last;
+    if (lastParam) lastParam->next = NULL; else entry->first = NULL;
+    entry->last = lastParam;
+    IrBlock *succ[2];
+    int sc = irSuccessors(header, succ);
+    for (int i = 0; i < sc; i++) {
+        for (int k = 0; k < succ[i]->predCount; k++) {
+            if (succ[i]->preds[k] == entry) succ[i]->preds[k] = header;
+        }
+    }
+    IrInst *jmp = irNewInst(IR_JMP);
+    jmp->target = header;
+    irAppend(entry, jmp);
+    irAddPred(header, entry);
+
+    // every use of a param now reads the header phi
+    int *phiOf = malloc(sizeof(int) * (size_t)(fn->paramCount ? fn->paramCount : 1));
+    int *repl = malloc(sizeof(int) * (size_t)(fn->valueCount + fn->paramCount));
+    for (int v = 0; v < fn->valueCount + fn->paramCount; v++) repl[v] = v;
+    for (int i = 0; i < fn->paramCount; i++) phiOf[i] = -1;
+    for (IrInst *in = entry->first; in && in->op == IR_PARAM; in = in->next) {
+        phiOf[in->imm] = irNewValue(fn);
+        repl[in->dst] = phiOf[in->imm];
+    }
+    irReplaceValues(fn, repl);
+    free(repl);
+    IrInst *pos = NULL;
+    for (IrInst *in = entry->first; in && in->op == IR_PARAM; in = in->next) {
+        IrInst *phi = irNewInst(IR_PHI);
+        phi->dst = phiOf[in->imm];
+        irAddArg(phi, in->dst);
+        irInsertAfter(header, pos, phi);
+        pos = phi;
+    }
+
+    // tail calls jump to the header with their arguments
+    int n = fn->blockCount;
+    for (int i = 0; i < n; i++) {
+        IrBlock *b = fn->blocks[i];
+        IrInst *prev = NULL;
+        for (IrInst *in = b->first; in; prev = in, in = in->next) {
+            if (!isSelfTailCall(fn, in)) continue;
+            for (IrInst *phi = header->first; phi && phi->op == IR_PHI; phi = phi->next) {
+                int k = -1;
+                for (int p = 0; p < fn->paramCount; p++) if (phiOf[p] == phi->dst) k = p;
+                if (k < in->argCount) {
+                    irAddArg(phi, in->args[k]);
+                } else {
+                    IrInst *z = irNewInst(IR_CONST);
+                    z->dst = irNewValue(fn);
+                    irInsertAfter(b, prev, z);
+                    prev = z;
+                    irAddArg(phi, z->dst);
+                }
+            }
+            IrInst *ret = in->next;
+            IrInst *j = irNewInst(IR_JMP);
+            j->target = header;
+            if (prev) prev->next = j; else b->first = j;
+            b->last = j;
+            irAddPred(header, b);
+            free(in->args); free(in->sym); free(in);
+            free(ret->args); free(ret);
+            break;
+        }
+    }
+    free(phiOf);
+    irSortRpo(fn);
+    irSimplifyPhis(fn);
+    return 1;
+}
@@ -0,0 +1,269 @@
+#include "opt.h"
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+// Unrolling of counted single-block loops.
+//
+// A rotated `while (i < n) { ...; i = i + s; }` with constant step s and
+// loop-invariant n ends up as one block B that branches back to itself:
+//
+//     B: i = phi(i0, i'), ...; body; i' = i + s; br (i' < n), B, exit
+//
+// It becomes
+//
+//     G:  br (n <= INT64_MAX - U*s), G', B      // i + U*s cannot wrap
+//     G': br (i0 <= n), C, B
+//     C:  i = phi(i0, i + U*s), ...; br (i + U*s < n), U, B
+//     U:  U copies of the body, for i, i+s, ..., i+(U-1)*s; jmp C
+//     B:  the original loop, entered from G and C
+//
+// C only runs the unrolled body while at least one more iteration is left
+// over for B, so the original loop still runs at least once on every path,
+// handles the remainder and stays the only way out.
+
+typedef struct {
+    IrFunction *fn;
+    IrInst **defs;          // per value, for values that existed before unrolling
+    int valueLimit;
+} UnrollCtx;
+
+static IrInst *defOf(UnrollCtx *c, int v) { return v < c->valueLimit ? c->defs[v] : NULL; }
+
+static int constOf(UnrollCtx *c, int v, int64_t *out) {
+    IrInst *d = defOf(c, v);
+    if (!d || d->op != IR_CONST) return 0;
+    *out = d->imm;
+    return 1;
+}
+
+static int definedIn(UnrollCtx *c, IrBlock *b, int v) {
+    IrInst *d = defOf(c, v);
+    if (!d) return 0;
+    for (IrInst *in = b->first; in; in = in->next) if (in == d) return 1;
+    return 0;
+}
+
+static int bodySize(IrBlock *b) {
+    int n = 0;
+    for (IrInst *in = b->first; in; in = in->next) {
+        if (in->op != IR_PHI && in->op != IR_CONST && !irIsTerminator(in->op)) n++;
+    }
+    return n;
+}
+
+static IrInst *newInst(IrOp op, int dst) {
+    IrInst *in = irNewInst(op);
+    in->dst = dst;
+    return in;
+}
+
+static int appendConst(IrFunction *fn, IrBlock *b, int64_t v) {
+    IrInst *in = newInst(IR_CONST, irNewValue(fn));
+    in->imm = v;
+    irAppend(b, in);
+    return in->dst;
+}
+
+static int appendBin(IrFunction *fn, IrBlock *b, BinOpKind op, int l, int r) {
+    IrInst *in = newInst(IR_BIN, irNewValue(fn));
+    in->binop = op;
+    irAddArg(in, l);
+    irAddArg(in, r);
+    irAppend(b, in);
+    return in->dst;
+}
+
+static void appendBr(IrBlock *b, int cond, IrBlock *taken, IrBlock *other) {
+    IrInst *br = irNewInst(IR_BR);
+    irAddArg(br, cond);
+    br->target = taken;
+    br->elseTarget = other;
+    irAppend(b, br);
+    irAddPred(taken, b);
+    irAddPred(other, b);
+}
+
+static int mapValue(int *map, int v) { return map[v] >= 0 ? map[v] : v; }
+
+int matchCountedLoop(IrInst **defs, int valueLimit, IrBlock *b, CountedLoop *out) {
+    UnrollCtx ctx;
+    UnrollCtx *c = &ctx;
+    c->fn = NULL;
+    c->defs = defs;
+    c->valueLimit = valueLimit;
+    if (b->predCount != 2 || (b->preds[0] != b && b->preds[1] != b) || b->preds[0] == b->preds[1]) return 0;
+    IrInst *t = irTerminator(b);
+    if (t->op != IR_BR || t->target != b) return 0;
+    IrInst *cmp = defOf(c, t->args[0]);
+    if (!cmp || cmp->op != IR_BIN || !definedIn(c, b, cmp->dst)) return 0;
+    int l = cmp->args[0], r = cmp->args[1];
+    BinOpKind k = cmp->binop;
+    if (definedIn(c, b, r)) {
+        // bound on the left: n > i' is i' < n
+        int tmp = l; l = r; r = tmp;
+        switch (k) {
+            case BIN_LT: k = BIN_GT; break;
+            case BIN_LE: k = BIN_GE; break;
+            case BIN_GT: k = BIN_LT; break;
+            case BIN_GE: k = BIN_LE; break;
+            default: return 0;
+        }
+    }
+    if (definedIn(c, b, r)) return 0;
+    IrInst *next = defOf(c, l);
+    if (!next || next->op != IR_BIN || !definedIn(c, b, l)) return 0;
+    if (next->binop != BIN_ADD && next->binop != BIN_SUB) return 0;
+    int64_t s;
+    IrInst *phi;
+    if (constOf(c, next->args[1], &s)) {
+        phi = defOf(c, next->args[0]);
+        if (next->binop == BIN_SUB) s = -s;
+    } else if (next->binop == BIN_ADD && constOf(c, next->args[0], &s)) {
+        phi = defOf(c, next->args[1]);
+    } else {
+        return 0;
+    }
+    if (!phi || phi->op != IR_PHI || !definedIn(c, b, phi->dst)) return 0;
+    int back = b->preds[0] == b ? 0 : 1;
+    if (phi->args[back] != next->dst) return 0;
+    if (s > 0 && s <= (1 << 20) && (k == BIN_LT || k == BIN_LE)) { /* counting up */ }
+    else if (s < 0 && s >= -(1 << 20) && (k == BIN_GT || k == BIN_GE)) { /* counting down */ }
+    else return 0;
+    out->iv = phi;
+    out->next = next;
+    out->cmp = cmp;
+    out->step = s;
+    out->op = k;
+    out->bound = r;
+    out->back = back;
+    return 1;
+}
+
+static void unrollLoop(UnrollCtx *c, IrBlock *b, const CountedLoop *loop, int factor) {
+    IrFunction *fn = c->fn;
+    IrInst *iv = loop->iv;
+    int64_t step = loop->step;
+    BinOpKind op = loop->op;
+    int bound = loop->bound;
+    int back = loop->back;
+    IrBlock *pre = b->preds[1 - back];
+    int phiCount = 0;
+    for (IrInst *p = b->first; p && p->op == IR_PHI; p = p->next) phiCount++;
+    IrInst **phis = malloc(sizeof(IrInst*) * (size_t)(phiCount ? phiCount : 1));
+    int *init = malloc(sizeof(int) * (size_t)(phiCount ? phiCount : 1));
+    int *latch = malloc(sizeof(int) * (size_t)(phiCount ? phiCount : 1));
+    int *checkPhi = malloc(sizeof(int) * (size_t)(phiCount ? phiCount : 1));
+    int *next = malloc(sizeof(int) * (size_t)(phiCount ? phiCount : 1));
+    int j = 0;
+    int ivInit = -1;
+    for (IrInst *p = b->first; p && p->op == IR_PHI; p = p->next, j++) {
+        phis[j] = p;
+        init[j] = p->args[1 - back];
+        latch[j] = p->args[back];
+        if (p == iv) ivInit = init[j];
+    }
+
+    // pre now enters through the guards; b's phis are rebuilt below
+    IrBlock *guard = irNewBlock(fn);
+    IrBlock *start = irNewBlock(fn);
+    IrBlock *check = irNewBlock(fn);
+    IrBlock *body = irNewBlock(fn);
+    IrInst *pt = irTerminator(pre);
+    if (pt->target == b) pt->target = guard;
+    if (pt->op == IR_BR && pt->elseTarget == b) pt->elseTarget = guard;
+    irAddPred(guard, pre);
+    irRemovePred(b, pre);
+
+    int64_t span = step * factor;
+    BinOpKind within = span > 0 ? BIN_LE : BIN_GE;
+    int safe = appendConst(fn, guard, span > 0 ? INT64_MAX - span : INT64_MIN - span);
+    appendBr(guard, appendBin(fn, guard, within, bound, safe), start, b);
+    appendBr(start, appendBin(fn, start, within, ivInit, bound), check, b);
+
+    // header of the unrolled loop: one phi per phi of b
+    IrInst *pos = NULL;
+    int ivCheck = -1;
+    for (j = 0; j < phiCount; j++) {
+        IrInst *q = newInst(IR_PHI, irNewValue(fn));
+        irAddArg(q, init[j]);
+        irInsertAfter(check, pos, q);
+        pos = q;
+        checkPhi[j] = q->dst;
+        if (phis[j] == iv) ivCheck = q->dst;
+    }
+    int last = appendBin(fn, check, BIN_ADD, ivCheck, appendConst(fn, check, span));
+    appendBr(check, appendBin(fn, check, op, last, bound), body, b);
+
+    // the copies; map[] holds each original value's current copy
+    int *map = malloc(sizeof(int) * (size_t)c->valueLimit);
+    for (int v = 0; v < c->valueLimit; v++) map[v] = -1;
+    for (j = 0; j < phiCount; j++) map[phis[j]->dst] = checkPhi[j];
+    for (int k = 0; k < factor; k++) {
+        for (IrInst *in = b->first; in; in = in->next) {
+            if (in->op == IR_PHI || irIsTerminator(in->op)) continue;
+            IrInst *cp = newInst(in->op, in->dst >= 0 ? irNewValue(fn) : -1);
+            cp->binop = in->binop;
+            cp->imm = in->imm;
+            memcpy(cp->count, in->count, sizeof(cp->count));
+            if (in->sym) cp->sym = strDup(in->sym);
+            for (int a = 0; a < in->argCount; a++) irAddArg(cp, mapValue(map, in->args[a]));
+            irAppend(body, cp);
+            if (in->dst >= 0) map[in->dst] = cp->dst;
+        }
+        for (j = 0; j < phiCount; j++) next[j] = mapValue(map, latch[j]);
+        for (j = 0; j < phiCount; j++) map[phis[j]->dst] = next[j];
+    }
+    IrInst *jmp = irNewInst(IR_JMP);
+    jmp->target = check;
+    irAppend(body, jmp);
+    irAddPred(check, body);
+    j = 0;
+    for (IrInst *q = check->first; q && q->op == IR_PHI; q = q->next, j++) irAddArg(q, next[j]);
+
+    // b's preds are now b, guard, start and check, in that order
+    for (j = 0; j < phiCount; j++) {
+        irAddArg(phis[j], init[j]);
+        irAddArg(phis[j], init[j]);
+        irAddArg(phis[j], checkPhi[j]);
+    }
+
+    free(phis);
+    free(init);
+    free(latch);
+    free(checkPhi);
+    free(next);
+    free(map);
+}
+
+int unrollLoops(IrFunction *fn, int factor, int budget) {
+    if (factor < 2 || fn->blockCount == 0) return 0;
+    UnrollCtx c;
+    c.fn = fn;
+    c.valueLimit = fn->valueCount;
+    c.defs = calloc((size_t)(c.valueLimit ? c.valueLimit : 1), sizeof(IrInst*));
+    for (int i = 0; i < fn->blockCount; i++) {
+        for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+            if (in->dst >= 0) c.defs[in->dst] = in;
+        }
+    }
+    int changed = 0;
+    int n = fn->blockCount;
+    for (int i = 0; i < n; i++) {
+        IrBlock *b = fn->blocks[i];
+        CountedLoop loop;
+        if (!matchCountedLoop(c.defs, c.valueLimit, b, &loop)) continue;
+        int size = bodySize(b);
+        int u = factor;
+        while (u >= 2 && size * u > budget) u--;
+        if (u < 2) continue;
+        unrollLoop(&c, b, &loop, u);
+        changed = 1;
+    }
+    free(c.defs);
+    if (changed) {
+        irSortRpo(fn);
+        irSimplifyPhis(fn);
+    }
+    return changed;
+}
@@ -0,0 +1,425 @@
+#include "opt.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Vectorization of counted loops over mem.
+//
+// A loop that steps i by 1 up to a bound and only loads, adds, subtracts
+// and stores mem elements at i plus a loop-invariant offset, optionally
+// summing them up in one accumulator:
+//
+//     B: i = phi(i0, i'), s = phi(s0, s'); x = mem[i + a] + mem[i + 2];
+//        mem[i + c] = x; s' = s + x; i' = i + 1; br (i' < n), B, exit
+//
+// becomes
+//
+//     G:  br (i0 < n), G', B
+//     G': r = n - i0 (+ 1 for <=); br (r > 4), G1, B
+//     Gk: br (accesses k and k' overlap harmlessly), Gk+1, B
+//     V:  q = (r - 1) / 4; s1 = vecloop(i0, q, s0, ...); jmp B
+//     B:  the original loop, entered with i = i0 + 4*q and s = s1 from V
+//
+// The kernel runs 4 iterations at a time, each statement for all 4 lanes
+// before the next. That only differs from the scalar order when a store and
+// another access are 1 to 3 elements apart: such constant distances reject
+// the loop and variable ones are checked in the Gk blocks. Like the
+// unroller, B still runs at least once and stays the only way out.
+
+#define VEC_LANES 4
+#define VEC_MAX_REGS 7          // nodes holding a vector; SSE2 needs two xmm each
+#define VEC_MAX_BASES 3         // distinct offsets (none counts as one), each kept in a register
+#define VEC_MAX_CHECKS 8
+#define VEC_MAX_DISP (1 << 20)
+
+enum { KIND_NONE, KIND_INDEX, KIND_VECTOR, KIND_ACC };
+
+typedef struct {
+    IrFunction *fn;
+    IrInst **defs;          // per value, for values that existed before vectorizing
+    int valueLimit;
+    char *inLoop;           // per value: defined in the loop block
+    char *kind;             // per value defined in the loop
+    int64_t *disp;          // KIND_INDEX: i + disp (+ var)
+    int *var;               // KIND_INDEX: variable offset, -1 if none
+    int *node;              // KIND_VECTOR: node computing the value
+    IrVecNode *nodes;
+    int nodeCount;
+    int *args;              // operands of the kernel after the fixed ones
+    int argCount;
+    int firstArg;           // 3 with an accumulator (args[2] is its initial value), else 2
+} VecCtx;
+
+typedef struct {
+    int store, other;       // node indices
+} OverlapCheck;
+
+static IrInst *newInst(IrOp op, int dst) {
+    IrInst *in = irNewInst(op);
+    in->dst = dst;
+    return in;
+}
+
+static int appendConst(IrFunction *fn, IrBlock *b, int64_t v) {
+    IrInst *in = newInst(IR_CONST, irNewValue(fn));
+    in->imm = v;
+    irAppend(b, in);
+    return in->dst;
+}
+
+static int appendBin(IrFunction *fn, IrBlock *b, BinOpKind op, int l, int r) {
+    IrInst *in = newInst(IR_BIN, irNewValue(fn));
+    in->binop = op;
+    irAddArg(in, l);
+    irAddArg(in, r);
+    irAppend(b, in);
+    return in->dst;
+}
+
+static void appendBr(IrBlock *b, int cond, IrBlock *taken, IrBlock *other) {
+    IrInst *br = irNewInst(IR_BR);
+    irAddArg(br, cond);
+    br->target = taken;
+    br->elseTarget = other;
+    irAppend(b, br);
+    irAddPred(taken, b);
+    irAddPred(other, b);
+}
+
+static int isInvariant(VecCtx *c, int v) {
+    return v >= c->valueLimit || !c->inLoop[v] || c->defs[v]->op == IR_CONST;
+}
+
+static int constOf(VecCtx *c, int v, int64_t *out) {
+    IrInst *d = v < c->valueLimit ? c->defs[v] : NULL;
+    if (!d || d->op != IR_CONST) return 0;
+    *out = d->imm;
+    return 1;
+}
+
+static int addNode(VecCtx *c, IrVecOp op, int a, int b, int arg, int64_t disp) {
+    IrVecNode *n = &c->nodes[c->nodeCount];
+    n->op = op;
+    n->a = a;
+    n->b = b;
+    n->arg = arg;
+    n->disp = disp;
+    return c->nodeCount++;
+}
+
+static int argIndex(VecCtx *c, int v) {
+    for (int k = 0; k < c->argCount; k++) if (c->args[k] == v) return c->firstArg + k;
+    c->args[c->argCount++] = v;
+    return c->firstArg + c->argCount - 1;
+}
+
+// node for a vector or loop-invariant operand, -1 for anything else
+static int operandNode(VecCtx *c, int v) {
+    if (!isInvariant(c, v)) return c->kind[v] == KIND_VECTOR ? c->node[v] : -1;
+    int arg = argIndex(c, v);
+    for (int k = 0; k < c->nodeCount; k++) {
+        if (c->nodes[k].op == VEC_SPLAT && c->nodes[k].arg == arg) return k;
+    }
+    return addNode(c, VEC_SPLAT, -1, -1, arg, 0);
+}
+
+static int isIndex(VecCtx *c, int v) {
+    return v < c->valueLimit && c->inLoop[v] && c->kind[v] == KIND_INDEX;
+}
+
+// i + disp + var plus the invariant x (negated for SUB); 0 when the result
+// no longer has that form
+static int offsetIndex(VecCtx *c, int dst, int from, int x, int negate) {
+    int64_t k;
+    int64_t disp = c->disp[from];
+    int var = c->var[from];
+    if (constOf(c, x, &k) && k >= -VEC_MAX_DISP && k <= VEC_MAX_DISP) {
+        disp += negate ? -k : k;
+        if (disp < -VEC_MAX_DISP || disp > VEC_MAX_DISP) return 0;
+    } else if (!negate && var < 0) {
+        // large constants too: disp ends up in a disp32
+        var = x;
+    } else {
+        return 0;
+    }
+    c->kind[dst] = KIND_INDEX;
+    c->disp[dst] = disp;
+    c->var[dst] = var;
+    return 1;
+}
+
+static int classifyBin(VecCtx *c, IrInst *in) {
+    if (in->binop != BIN_ADD && in->binop != BIN_SUB) return 0;
+    int l = in->args[0], r = in->args[1];
+    if (isIndex(c, l) && isInvariant(c, r)) return offsetIndex(c, in->dst, l, r, in->binop == BIN_SUB);
+    if (in->binop == BIN_ADD && isInvariant(c, l) && isIndex(c, r)) return offsetIndex(c, in->dst, r, l, 0);
+    if (isInvariant(c, l) && isInvariant(c, r)) return 0;   // left in the loop by LICM
+    int a = operandNode(c, l);
+    int b = operandNode(c, r);
+    if (a < 0 || b < 0) return 0;
+    c->kind[in->dst] = KIND_VECTOR;
+    c->node[in->dst] = addNode(c, in->binop == BIN_ADD ? VEC_ADD : VEC_SUB, a, b, -1, 0);
+    return 1;
+}
+
+static int memNode(VecCtx *c, IrVecOp op, int index, int value) {
+    if (!isIndex(c, index)) return -1;
+    int arg = c->var[index] >= 0 ? argIndex(c, c->var[index]) : -1;
+    return addNode(c, op, value, -1, arg, c->disp[index]);
+}
+
+static int buildKernel(VecCtx *c, IrBlock *b, const CountedLoop *loop) {
+    for (IrInst *in = b->first; in; in = in->next) {
+        if (in->op == IR_PHI || in->op == IR_CONST || irIsTerminator(in->op) || in == loop->cmp) continue;
+        if (in == loop->next) {
+            c->kind[in->dst] = KIND_INDEX;
+            c->disp[in->dst] = 1;
+            c->var[in->dst] = -1;
+            continue;
+        }
+        if (in->dst >= 0 && c->kind[in->dst] == KIND_ACC) {
+            // a step of the accumulator chain, which is one of the args
+            int x = c->inLoop[in->args[0]] && c->kind[in->args[0]] == KIND_ACC ? in->args[1] : in->args[0];
+            int n = operandNode(c, x);
+            if (n < 0) return 0;
+            addNode(c, in->binop == BIN_ADD ? VEC_ACC_ADD : VEC_ACC_SUB, n, -1, -1, 0);
+            continue;
+        }
+        switch (in->op) {
+            case IR_LOAD_MEM: {
+                int n = memNode(c, VEC_LOAD, in->args[0], -1);
+                if (n < 0) return 0;
+                c->kind[in->dst] = KIND_VECTOR;
+                c->node[in->dst] = n;
+                break;
+            }
+            case IR_STORE_MEM: {
+                int v = operandNode(c, in->args[1]);
+                if (v < 0 || memNode(c, VEC_STORE, in->args[0], v) < 0) return 0;
+                break;
+            }
+            case IR_BIN:
+                if (!classifyBin(c, in)) return 0;
+                break;
+            default:
+                return 0;
+        }
+    }
+    int regs = 0, effects = 0;
+    int bases[VEC_MAX_BASES + 1];
+    int baseCount = 0;
+    for (int k = 0; k < c->nodeCount; k++) {
+        IrVecNode *n = &c->nodes[k];
+        if (n->op == VEC_STORE || n->op == VEC_ACC_ADD || n->op == VEC_ACC_SUB) effects++;
+        else regs++;
+        if (n->op != VEC_LOAD && n->op != VEC_STORE) continue;
+        int seen = 0;
+        for (int j = 0; j < baseCount; j++) if (bases[j] == n->arg) seen = 1;
+        if (!seen && baseCount <= VEC_MAX_BASES) bases[baseCount++] = n->arg;
+    }
+    return effects && regs <= VEC_MAX_REGS && baseCount <= VEC_MAX_BASES;
+}
+
+// Pairs of accesses whose distance is only known at runtime. Returns -1 when
+// a constant distance of 1 to 3 elements (or too many checks) rules the loop
+// out.
+static int collectChecks(VecCtx *c, OverlapCheck *checks) {
+    int count = 0;
+    for (int s = 0; s < c->nodeCount; s++) {
+        if (c->nodes[s].op != VEC_STORE) continue;
+        for (int x = 0; x < c->nodeCount; x++) {
+            IrVecNode *o = &c->nodes[x];
+            if (x == s || (o->op != VEC_LOAD && o->op != VEC_STORE)) continue;
+            if (o->op == VEC_STORE && x < s) continue;      // pair already seen
+            if (o->arg == c->nodes[s].arg) {
+                int64_t d = c->nodes[s].disp - o->disp;
+                if (d != 0 && d > -VEC_LANES && d < VEC_LANES) return -1;
+                continue;
+            }
+            if (count == VEC_MAX_CHECKS) return -1;
+            checks[count].store = s;
+            checks[count].other = x;
+            count++;
+        }
+    }
+    return count;
+}
+
+// the kernel operand, copied into blk when it is a constant of the loop
+static int outsideValue(VecCtx *c, IrBlock *blk, int v) {
+    if (v < c->valueLimit && c->inLoop[v]) return appendConst(c->fn, blk, c->defs[v]->imm);
+    return v;
+}
+
+// element index of access n, less i
+static int accessOffset(VecCtx *c, IrBlock *blk, IrVecNode *n) {
+    int disp = appendConst(c->fn, blk, n->disp);
+    if (n->arg < 0) return disp;
+    return appendBin(c->fn, blk, BIN_ADD, outsideValue(c, blk, c->args[n->arg - c->firstArg]), disp);
+}
+
+static void vectorizeLoop(VecCtx *c, IrBlock *b, const CountedLoop *loop, IrInst *red,
+                          OverlapCheck *checks, int checkCount) {
+    IrFunction *fn = c->fn;
+    IrBlock *pre = b->preds[1 - loop->back];
+    int ivInit = loop->iv->args[1 - loop->back];
+    int redInit = red ? red->args[1 - loop->back] : -1;
+
+    IrBlock *guard = irNewBlock(fn);
+    IrInst *pt = irTerminator(pre);
+    if (pt->target == b) pt->target = guard;
+    if (pt->op == IR_BR && pt->elseTarget == b) pt->elseTarget = guard;
+    irAddPred(guard, pre);
+    irRemovePred(b, pre);
+
+    // r = iterations left. B may be entered with i0 past the bound, and
+    // r only holds when n - i0 does not wrap, which shows as r <= 0.
+    IrBlock *count = irNewBlock(fn);
+    appendBr(guard, appendBin(fn, guard, loop->op, ivInit, loop->bound), count, b);
+    int r = appendBin(fn, count, BIN_SUB, loop->bound, ivInit);
+    if (loop->op == BIN_LE) r = appendBin(fn, count, BIN_ADD, r, appendConst(fn, count, 1));
+    IrBlock *from = count;
+    int cond = appendBin(fn, count, BIN_GT, r, appendConst(fn, count, VEC_LANES));
+    for (int k = 0; k < checkCount; k++) {
+        IrBlock *check = irNewBlock(fn);
+        appendBr(from, cond, check, b);
+        int d = appendBin(fn, check, BIN_SUB, accessOffset(c, check, &c->nodes[checks[k].store]),
+                          accessOffset(c, check, &c->nodes[checks[k].other]));
+        // same element, or at least a whole trip apart (the tests are 0/1)
+        int same = appendBin(fn, check, BIN_EQ, d, appendConst(fn, check, 0));
+        int above = appendBin(fn, check, BIN_GE, d, appendConst(fn, check, VEC_LANES));
+        int below = appendBin(fn, check, BIN_LE, d, appendConst(fn, check, -VEC_LANES));
+        cond = appendBin(fn, check, BIN_ADD, appendBin(fn, check, BIN_ADD, same, above), below);
+        from = check;
+    }
+    IrBlock *body = irNewBlock(fn);
+    appendBr(from, cond, body, b);
+
+    int trips = appendBin(fn, body, BIN_DIV, appendBin(fn, body, BIN_SUB, r, appendConst(fn, body, 1)),
+                          appendConst(fn, body, VEC_LANES));
+    IrInst *vec = newInst(IR_VEC_LOOP, red ? irNewValue(fn) : -1);
+    irAddArg(vec, ivInit);
+    irAddArg(vec, trips);
+    if (red) irAddArg(vec, redInit);
+    for (int k = 0; k < c->argCount; k++) irAddArg(vec, outsideValue(c, body, c->args[k]));
+    vec->vec = calloc(1, sizeof(IrVecKernel));
+    vec->vec->nodes = malloc(sizeof(IrVecNode) * (size_t)c->nodeCount);
+    memcpy(vec->vec->nodes, c->nodes, sizeof(IrVecNode) * (size_t)c->nodeCount);
+    vec->vec->count = c->nodeCount;
+    irAppend(body, vec);
+    int ivEnd = appendBin(fn, body, BIN_ADD, ivInit,
+                          appendBin(fn, body, BIN_MUL, trips, appendConst(fn, body, VEC_LANES)));
+    IrInst *jmp = irNewInst(IR_JMP);
+    jmp->target = b;
+    irAppend(body, jmp);
+    irAddPred(b, body);
+
+    // the guards enter B with the initial values, the kernel with its results
+    for (IrInst *p = b->first; p && p->op == IR_PHI; p = p->next) {
+        for (int k = p->argCount; k < b->predCount; k++) {
+            if (b->preds[k] != body) irAddArg(p, p == loop->iv ? ivInit : redInit);
+            else irAddArg(p, p == loop->iv ? ivEnd : vec->dst);
+        }
+    }
+}
+
+// Finds the accumulator of b: every phi but i must be s = phi(s0, s') where
+// s' is s plus or minus a chain of values, each step (t + x, x + t or t - x)
+// being the only use of the previous one in b. The steps are marked
+// KIND_ACC. Returns 0 when b has any other phi.
+static int findAccumulator(VecCtx *c, IrBlock *b, const CountedLoop *loop, IrInst **red) {
+    *red = NULL;
+    for (IrInst *p = b->first; p && p->op == IR_PHI; p = p->next) {
+        if (p == loop->iv) continue;
+        if (*red) return 0;
+        *red = p;
+        c->kind[p->dst] = KIND_ACC;
+        int cur = p->dst;
+        for (;;) {
+            IrInst *user = NULL;
+            int uses = 0;
+            for (IrInst *in = b->first; in; in = in->next) {
+                for (int k = 0; k < in->argCount; k++) if (in->args[k] == cur) { uses++; user = in; }
+            }
+            if (uses != 1) return 0;
+            if (user == p) break;
+            if (user->op != IR_BIN || (user->binop != BIN_ADD && user->binop != BIN_SUB)) return 0;
+            if (user->binop == BIN_SUB && user->args[0] != cur) return 0;
+            c->kind[user->dst] = KIND_ACC;
+            cur = user->dst;
+        }
+        if (cur == p->dst) return 0;
+    }
+    return 1;
+}
+
+static int tryVectorize(VecCtx *c, IrBlock *b) {
+    CountedLoop loop;
+    if (!matchCountedLoop(c->defs, c->valueLimit, b, &loop)) return 0;
+    if (loop.step != 1 || (loop.op != BIN_LT && loop.op != BIN_LE)) return 0;
+    int instCount = 0;
+    for (IrInst *in = b->first; in; in = in->next) {
+        instCount++;
+        if (in->dst < 0) continue;
+        c->inLoop[in->dst] = 1;
+        c->kind[in->dst] = KIND_NONE;
+    }
+    c->kind[loop.iv->dst] = KIND_INDEX;
+    c->disp[loop.iv->dst] = 0;
+    c->var[loop.iv->dst] = -1;
+    c->nodes = malloc(sizeof(IrVecNode) * (size_t)(2 * instCount));
+    c->nodeCount = 0;
+    c->args = malloc(sizeof(int) * (size_t)(2 * instCount));
+    c->argCount = 0;
+
+    int done = 0;
+    IrInst *red;
+    OverlapCheck checks[VEC_MAX_CHECKS];
+    if (findAccumulator(c, b, &loop, &red)) {
+        c->firstArg = red ? 3 : 2;
+        int checkCount;
+        if (buildKernel(c, b, &loop) && (checkCount = collectChecks(c, checks)) >= 0) {
+            vectorizeLoop(c, b, &loop, red, checks, checkCount);
+            done = 1;
+        }
+    }
+    for (IrInst *in = b->first; in; in = in->next) {
+        if (in->dst >= 0 && in->dst < c->valueLimit) c->inLoop[in->dst] = 0;
+    }
+    free(c->nodes);
+    free(c->args);
+    return done;
+}
+
+int vectorizeLoops(IrFunction *fn) {
+    if (fn->blockCount == 0) return 0;
+    VecCtx c;
+    memset(&c, 0, sizeof(c));
+    c.fn = fn;
+    c.valueLimit = fn->valueCount;
+    size_t nv = (size_t)(c.valueLimit ? c.valueLimit : 1);
+    c.defs = calloc(nv, sizeof(IrInst*));
+    c.inLoop = calloc(nv, 1);
+    c.kind = calloc(nv, 1);
+    c.disp = calloc(nv, sizeof(int64_t));
+    c.var = calloc(nv, sizeof(int));
+    c.node = calloc(nv, sizeof(int));
+    for (int i = 0; i < fn->blockCount; i++) {
+        for (IrInst *in = fn->blocks[i]->first; in; in = in->next) {
+            if (in->dst >= 0) c.defs[in->dst] = in;
+        }
+    }
+    int changed = 0;
+    int n = fn->blockCount;
+    for (int i = 0; i < n; i++) changed |= tryVectorize(&c, fn->blocks[i]);
+    free(c.defs);
+    free(c.inLoop);
+    free(c.kind);
+    free(c.disp);
+    free(c.var);
+    free(c.node);
+    if (changed) {
+        irSortRpo(fn);
+        irSimplifyPhis(fn);
+    }
+    return changed;
+}
@@ -0,0 +1,203 @@
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+// Both sides walk the lowered module the same way: the instrumented build
+// numbers its counters in this order, and the optimizing build finds the
+// instruction each counter belongs to by walking it again.
+
+typedef struct {
+    IrFunction *fn;
+    IrBlock *block;
+    IrInst *in;             // IR_BR or IR_CALL_IND, NULL for the function entry
+    int counter;            // the first of its counters
+} ProfileSite;
+
+typedef struct {
+    ProfileSite *sites;
+    int count;
+    int cap;
+    const char *targets[PROFILE_MAX_TARGETS];   // functions whose address is taken
+    int targetCount;
+    int counters;
+    uint64_t checksum;
+} ProfilePlan;
+
+static void hashBytes(uint64_t *h, const void *p, size_t n) {
+    // FNV-1a
+    const unsigned char *s = p;
+    for (size_t i = 0; i < n; i++) {
+        *h ^= s[i];
+        *h *= 0x100000001B3ull;
+    }
+}
+
+static void addSite(ProfilePlan *plan, IrFunction *fn, IrBlock *b, IrInst *in, int counters) {
+    if (plan->count == plan->cap) {
+        plan->cap = plan->cap ? plan->cap * 2 : 64;
+        plan->sites = realloc(plan->sites, sizeof(ProfileSite) * (size_t)plan->cap);
+    }
+    ProfileSite *s = &plan->sites[plan->count++];
+    s->fn = fn;
+    s->block = b;
+    s->in = in;
+    s->counter = plan->counters;
+    plan->counters += counters;
+    char kind = in ? (char)in->op : 'e';
+    hashBytes(&plan->checksum, &kind, 1);
+}
+
+static int addressTaken(IrModule *m, const char *name) {
+    for (IrFunction *f = m->functions; f; f = f->next) {
+        for (int i = 0; i < f->blockCount; i++) {
+            for (IrInst *in = f->blocks[i]->first; in; in = in->next) {
+                if (in->op == IR_FUNC_ADDR && strcmp(in->sym, name) == 0) return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void planSites(IrModule *m, ProfilePlan *plan) {
+    memset(plan, 0, sizeof(*plan));
+    plan->checksum = 0xCBF29CE484222325ull;
+    for (IrFunction *f = m->functions; f && plan->targetCount < PROFILE_MAX_TARGETS; f = f->next) {
+        if (!addressTaken(m, f->name)) continue;
+        plan->targets[plan->targetCount++] = f->name;
+        hashBytes(&plan->checksum, f->name, strlen(f->name) + 1);
+    }
+    for (IrFunction *f = m->functions; f; f = f->next) {
+        hashBytes(&plan->checksum, f->name, strlen(f->name) + 1);
+        addSite(plan, f, f->blocks[0], NULL, 1);
+        for (int i = 0; i < f->blockCount; i++) {
+            for (IrInst *in = f->blocks[i]->first; in; in = in->next) {
+                if (in->op == IR_BR) addSite(plan, f, f->blocks[i], in, 2);
+                if (in->op == IR_CALL_IND) addSite(plan, f, f->blocks[i], in, 1 + plan->targetCount);
+            }
+        }
+    }
+}
+
+static IrInst *newCount(int counter, int arg) {
+    IrInst *in = irNewInst(IR_COUNT);
+    in->imm = counter;
+    if (arg >= 0) irAddArg(in, arg);
+    return in;
+}
+
+static IrInst *before(IrBlock *b, IrInst *pos) {
+    IrInst *prev = NULL;
+    for (IrInst *p = b->first; p != pos; p = p->next) prev = p;
+    return prev;
+}
+
+// Counts the edge from b to s, in s itself when b is its only predecessor
+// and in a new block on the edge otherwise.
+static void countEdge(IrFunction *fn, IrBlock *b, IrInst *br, IrBlock *s, int counter) {
+    if (s->predCount == 1) {
+        IrInst *pos = NULL;
+        for (IrInst *p = s->first; p && p->op == IR_PHI; p = p->next) pos = p;
+        irInsertAfter(s, pos, newCount(counter, -1));
+        return;
+    }
+    IrBlock *e = irNewBlock(fn);
+    irAppend(e, newCount(counter, -1));
+    IrInst *jmp = irNewInst(IR_JMP);
+    jmp->target = s;
+    irAppend(e, jmp);
+    irAddPred(e, b);
+    if (br->target == s) br->target = e; else br->elseTarget = e;
+    for (int i = 0; i < s->predCount; i++) {
+        if (s->preds[i] == b) s->preds[i] = e;
+    }
+}
+
+void instrumentModule(IrModule *m) {
+    ProfilePlan plan;
+    planSites(m, &plan);
+    for (int i = 0; i < plan.count; i++) {
+        ProfileSite *s = &plan.sites[i];
+        IrFunction *fn = s->fn;
+        if (!s->in) {
+            IrInst *pos = NULL;
+            for (IrInst *p = s->block->first; p && p->op == IR_PARAM; p = p->next) pos = p;
+            irInsertAfter(s->block, pos, newCount(s->counter, -1));
+        } else if (s->in->op == IR_BR) {
+            IrBlock *taken = s->in->target, *other = s->in->elseTarget;
+            countEdge(fn, s->block, s->in, taken, s->counter);
+            countEdge(fn, s->block, s->in, other, s->counter + 1);
+        } else {
+            // calls, then one 0/1 comparison per known target
+            IrInst *pos = before(s->block, s->in);
+            IrInst *total = newCount(s->counter, -1);
+            irInsertAfter(s->block, pos, total);
+            pos = total;
+            for (int t = 0; t < plan.targetCount; t++) {
+                IrInst *addr = irNewInst(IR_FUNC_ADDR);
+                addr->dst = irNewValue(fn);
+                addr->sym = strDup(plan.targets[t]);
+                IrInst *eq = irNewInst(IR_BIN);
+                eq->dst = irNewValue(fn);
+                eq->binop = BIN_EQ;
+                irAddArg(eq, s->in->args[0]);
+                irAddArg(eq, addr->dst);
+                IrInst *hit = newCount(s->counter + 1 + t, eq->dst);
+                irInsertAfter(s->block, pos, addr);
+                irInsertAfter(s->block, addr, eq);
+                irInsertAfter(s->block, eq, hit);
+                pos = hit;
+            }
+        }
+    }
+    for (IrFunction *f = m->functions; f; f = f->next) irSortRpo(f);
+    m->profileCounters = plan.counters;
+    m->profileChecksum = plan.checksum;
+    free(plan.sites);
+}
+
+int applyProfile(IrModule *m, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "warning: cannot read profile %s\n", path);
+        return 0;
+    }
+    ProfilePlan plan;
+    planSites(m, &plan);
+    uint64_t header[PROFILE_HEADER_WORDS];
+    uint64_t *counts = malloc(sizeof(uint64_t) * (size_t)(plan.counters ? plan.counters : 1));
+    int ok = fread(header, sizeof(header), 1, f) == 1 && header[0] == PROFILE_MAGIC &&
+             header[1] == plan.checksum && header[2] == (uint64_t)plan.counters &&
+             fread(counts, sizeof(uint64_t), (size_t)plan.counters, f) == (size_t)plan.counters;
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "warning: profile %s does not belong to this program, ignoring it\n", path);
+        free(counts);
+        free(plan.sites);
+        return 0;
+    }
+    for (int i = 0; i < plan.count; i++) {
+        ProfileSite *s = &plan.sites[i];
+        int64_t *c = (int64_t *)&counts[s->counter];
+        if (!s->in) {
+            s->fn->entryCount = c[0];
+        } else if (s->in->op == IR_BR) {
+            s->in->count[0] = c[0];
+            s->in->count[1] = c[1];
+        } else {
+            int best = -1;
+            for (int t = 0; t < plan.targetCount; t++) {
+                if (c[1 + t] > 0 && (best < 0 || c[1 + t] > c[1 + best])) best = t;
+            }
+            if (best < 0) continue;
+            s->in->sym = strDup(plan.targets[best]);
+            s->in->count[0] = c[1 + best];
+            s->in->count[1] = c[0] - c[1 + best];
+        }
+    }
+    m->profiled = 1;
+    free(counts);
+    free(plan.sites);
+    return 1;
+}
@@ -0,0 +1,37 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "ir.h"
+
+// Profile-guided optimization.
+//
+// With -fprofile-generate the lowered module gets IR_COUNT instructions and
+// the runtime writes the counters to a file when main returns. With
+// -fprofile-use that file is read back onto the lowered module of the same
+// program: function entry counts, branch directions and the most frequent
+// target of every indirect call then steer block layout, function order,
+// inlining and devirtualization.
+//
+// Counters are numbered over the functions in module order. Each function
+// has one for its entry, two for each IR_BR (taken, not taken, counted on
+// the edges) and 1 + T for each IR_CALL_IND (all calls, then the calls to
+// each of the first T functions whose address the program takes).
+//
+// The file holds PROFILE_HEADER_WORDS little-endian u64 (PROFILE_MAGIC, a
+// checksum of the program's shape, the counter count) and then the counters.
+
+#define PROFILE_MAGIC 0x31464F525043434Aull     // "JCCPROF1"
+#define PROFILE_HEADER_WORDS 3
+#define PROFILE_MAX_TARGETS 16
+#define PROFILE_DEFAULT_PATH "jcc.prof"
+
+// Adds the counters to a freshly lowered module and sets profileCounters and
+// profileChecksum.
+void instrumentModule(IrModule *m);
+
+// Annotates a freshly lowered module with the counts in path. Returns 0,
+// leaving the module alone, when the file is missing or belongs to another
+// program.
+int applyProfile(IrModule *m, const char *path);
+
+#endif
@@ -0,0 +1,237 @@
+#include "regalloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+typedef struct {
+    int value;
+    int start;
+    int end;
+    int used;
+    int crossesCall;
+} Interval;
+
+// caller-saved first: they cost nothing to use in a function
+static const Reg callerSavedOrder[] = { REG_RCX, REG_R8, REG_R9, REG_RSI, REG_RDI };
+static const Reg calleeSavedOrder[] = { REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15 };
+static const Reg argRegs[6] = { REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9 };
+
+static int isCall(IrInst *in) { return in->op == IR_CALL || in->op == IR_CALL_IND; }
+
+typedef uint64_t Word;
+
+static int wordCount(int bits) { return (bits + 63) / 64; }
+static void bitSet(Word *s, int i) { s[i >> 6] |= (Word)1 << (i & 63); }
+static int bitTest(const Word *s, int i) { return (int)((s[i >> 6] >> (i & 63)) & 1); }
+
+// Backward dataflow: liveIn(b) = use(b) | (liveOut(b) & ~def(b)),
+// liveOut(b) = union of liveIn over successors.
+static void computeLiveness(IrFunction *fn, Word *liveIn, Word *liveOut, int w) {
+    int nb = fn->blockCount;
+    Word *use = calloc((size_t)(nb * w), sizeof(Word));
+    Word *def = calloc((size_t)(nb * w), sizeof(Word));
+    for (int i = 0; i < nb; i++) {
+        Word *u = &use[i * w];
+        Word *d = &def[i * w];
+        for (IrInst *p = fn->blocks[i]->first; p; p = p->next) {
+            for (int k = 0; k < p->argCount; k++) {
+                if (!bitTest(d, p->args[k])) bitSet(u, p->args[k]);
+            }
+            if (p->dst >= 0) bitSet(d, p->dst);
+        }
+    }
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = nb - 1; i >= 0; i--) {
+            IrBlock *succ[2];
+            int sc = irSuccessors(fn->blocks[i], succ);
+            Word *out = &liveOut[i * w];
+            Word *in = &liveIn[i * w];
+            for (int k = 0; k < w; k++) {
+                Word o = 0;
+                for (int s = 0; s < sc; s++) o |= liveIn[succ[s]->id * w + k];
+                Word nin = use[i * w + k] | (o & ~def[i * w + k]);
+                if (o != out[k] || nin != in[k]) changed = 1;
+                out[k] = o;
+                in[k] = nin;
+            }
+        }
+    }
+    free(use);
+    free(def);
+}
+
+static void extend(Interval *iv, int pos) {
+    if (pos < iv->start) iv->start = pos;
+    if (pos > iv->end) iv->end = pos;
+}
+
+static int cmpStart(const void *a, const void *b) {
+    const Interval *x = a;
+    const Interval *y = b;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    return x->value - y->value;
+}
+
+static int isCalleeSaved(int reg) {
+    for (int i = 0; i < 5; i++) if ((int)calleeSavedOrder[i] == reg) return 1;
+    return 0;
+}
+
+void allocateRegisters(IrFunction *fn, RegAlloc *out) {
+    int nv = fn->valueCount;
+    int nb = fn->blockCount;
+    int w = wordCount(nv ? nv : 1);
+    irRenumberBlocks(fn);
+
+    out->regOf = malloc(sizeof(int) * (size_t)(nv ? nv : 1));
+    out->spillSlot = malloc(sizeof(int) * (size_t)(nv ? nv : 1));
+    out->remat = calloc((size_t)(nv ? nv : 1), 1);
+    out->spillCount = 0;
+    out->calleeSavedUsed = 0;
+    for (int v = 0; v < nv; v++) { out->regOf[v] = -1; out->spillSlot[v] = -1; }
+
+    Word *liveIn = calloc((size_t)(nb * w), sizeof(Word));
+    Word *liveOut = calloc((size_t)(nb * w), sizeof(Word));
+    computeLiveness(fn, liveIn, liveOut, w);
+
+    // Number instructions in layout order: uses at 2k, defs at 2k+1. Each
+    // value gets the hull of all points where it is live; holes are ignored.
+    Interval *iv = malloc(sizeof(Interval) * (size_t)(nv ? nv : 1));
+    int *hint = malloc(sizeof(int) * (size_t)(nv ? nv : 1));
+    int *fixedHint = malloc(sizeof(int) * (size_t)(nv ? nv : 1));
+    for (int v = 0; v < nv; v++) {
+        iv[v].value = v; iv[v].start = INT_MAX; iv[v].end = INT_MIN; iv[v].used = 0; iv[v].crossesCall = 0;
+        hint[v] = -1;
+        fixedHint[v] = -1;
+    }
+    int *callPos = NULL;
+    int callCount = 0, callCap = 0;
+    int k = 0;
+    for (int i = 0; i < nb; i++) {
+        IrBlock *b = fn->blocks[i];
+        int blockStart = 2 * k;
+        for (IrInst *p = b->first; p; p = p->next, k++) {
+            for (int a = 0; a < p->argCount; a++) {
+                extend(&iv[p->args[a]], 2 * k);
+                iv[p->args[a]].used = 1;
+            }
+            if (p->dst >= 0) extend(&iv[p->dst], 2 * k + 1);
+            if (p->op == IR_CONST && p->imm >= INT32_MIN && p->imm <= INT32_MAX) out->remat[p->dst] = 1;
+            if (p->op == IR_COPY) {
+                if (hint[p->dst] < 0) hint[p->dst] = p->args[0];
+                if (hint[p->args[0]] < 0) hint[p->args[0]] = p->dst;
+            }
+            // parameters and call arguments prefer their argument register
+            if (p->op == IR_PARAM && p->imm < 6) fixedHint[p->dst] = argRegs[p->imm];
+            if (isCall(p)) {
+                int first = p->op == IR_CALL_IND ? 1 : 0;
+                for (int a = first; a < p->argCount && a - first < 6; a++) {
+                    if (fixedHint[p->args[a]] < 0) fixedHint[p->args[a]] = argRegs[a - first];
+                }
+            }
+            if (isCall(p)) {
+                if (callCount == callCap) {
+                    callCap = callCap ? callCap * 2 : 16;
+                    callPos = realloc(callPos, sizeof(int) * (size_t)callCap);
+                }
+                callPos[callCount++] = 2 * k;
+            }
+        }
+        int blockEnd = 2 * k - 1;
+        for (int v = 0; v < nv; v++) {
+            if (bitTest(&liveIn[i * w], v)) extend(&iv[v], blockStart);
+            if (bitTest(&liveOut[i * w], v)) extend(&iv[v], blockEnd);
+        }
+    }
+    free(liveIn);
+    free(liveOut);
+
+    // a value crosses a call when it is live both before and after it
+    for (int v = 0; v < nv; v++) {
+        if (iv[v].start > iv[v].end) continue;
+        int lo = 0, hi = callCount;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (callPos[mid] <= iv[v].start) lo = mid + 1; else hi = mid;
+        }
+        if (lo < callCount && callPos[lo] + 1 < iv[v].end) iv[v].crossesCall = 1;
+    }
+    free(callPos);
+
+    int n = 0;
+    Interval *order = malloc(sizeof(Interval) * (size_t)(nv ? nv : 1));
+    // values that are never read need no location at all
+    for (int v = 0; v < nv; v++) if (iv[v].used && !out->remat[v]) order[n++] = iv[v];
+    qsort(order, (size_t)n, sizeof(Interval), cmpStart);
+
+    Interval **active = malloc(sizeof(Interval*) * 16);
+    int activeCount = 0;
+    int regBusy[16];
+    memset(regBusy, 0, sizeof(regBusy));
+
+    for (int i = 0; i < n; i++) {
+        Interval *cur = &order[i];
+        // expire intervals that ended before this one starts
+        for (int a = 0; a < activeCount; a++) {
+            if (active[a]->end < cur->start) {
+                regBusy[out->regOf[active[a]->value]] = 0;
+                active[a] = active[--activeCount];
+                a--;
+            }
+        }
+        int reg = -1;
+        int h = hint[cur->value];
+        if (h >= 0 && out->regOf[h] >= 0 && !regBusy[out->regOf[h]] &&
+            (!cur->crossesCall || isCalleeSaved(out->regOf[h]))) {
+            reg = out->regOf[h];
+        }
+        int f = fixedHint[cur->value];
+        if (reg < 0 && f >= 0 && !cur->crossesCall && f != REG_RDX && !regBusy[f]) reg = f;
+        if (reg < 0 && !cur->crossesCall) {
+            for (int r = 0; r < 5; r++) if (!regBusy[callerSavedOrder[r]]) { reg = callerSavedOrder[r]; break; }
+        }
+        if (reg < 0) {
+            for (int r = 0; r < 5; r++) if (!regBusy[calleeSavedOrder[r]]) { reg = calleeSavedOrder[r]; break; }
+        }
+        if (reg < 0) {
+            // no register free: spill whichever interval ends last
+            int victim = -1;
+            for (int a = 0; a < activeCount; a++) {
+                int r = out->regOf[active[a]->value];
+                if (cur->crossesCall && !isCalleeSaved(r)) continue;
+                if (victim < 0 || active[a]->end > active[victim]->end) victim = a;
+            }
+            if (victim >= 0 && active[victim]->end > cur->end) {
+                int v = active[victim]->value;
+                reg = out->regOf[v];
+                out->regOf[v] = -1;
+                out->spillSlot[v] = out->spillCount++;
+                active[victim] = active[--activeCount];
+            } else {
+                out->spillSlot[cur->value] = out->spillCount++;
+                continue;
+            }
+        }
+        out->regOf[cur->value] = reg;
+        regBusy[reg] = 1;
+        if (isCalleeSaved(reg)) out->calleeSavedUsed |= 1u << reg;
+        active[activeCount++] = cur;
+    }
+
+    free(active);
+    free(order);
+    free(iv);
+    free(hint);
+    free(fixedHint);
+}
+
+void freeRegAlloc(RegAlloc *ra) {
+    free(ra->regOf);
+    free(ra->spillSlot);
+    free(ra->remat);
+    ra->regOf = NULL;
+    ra->spillSlot = NULL;
+    ra->remat = NULL;
+}
@@ -0,0 +1,27 @@
+#ifndef REGALLOC_H
+#define REGALLOC_H
+
+#include "ir.h"
+#include "codegen_bytes.h"
+
+// Linear-scan register allocation (Poletto & Sarkar) over an IR function
+// whose phis have already been replaced by copies.
+//
+// rax, rdx, r10 and r11 stay free as codegen scratch registers (results,
+// idiv, addressing). Values that are live across a call only get
+// callee-saved registers; everything that does not fit is spilled to a
+// stack slot below the frame slots of address-taken locals. Constants that
+// fit in a sign-extended imm32 get no location: codegen folds them into the
+// instructions that use them.
+typedef struct {
+    int *regOf;             // per value: Reg, or -1 when spilled or dead
+    int *spillSlot;         // per value: spill slot index, or -1 when in a register or dead
+    char *remat;            // per value: small constant, rematerialized at each use
+    int spillCount;
+    unsigned calleeSavedUsed; // bitmask of callee-saved Regs written by the function
+} RegAlloc;
+
+void allocateRegisters(IrFunction *fn, RegAlloc *out);
+void freeRegAlloc(RegAlloc *ra);
+
+#endif
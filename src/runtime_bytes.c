@@ -1,145 +1,621 @@
 #include "runtime_bytes.h"
 
 // Emits:
-// _start: call lang_main; exit(return)
-// printInt: syscall-only decimal print with newline
+// _start: cpuFeatures = AVX2 usable; call lang_main; outFlush; exit(return)
+// printInt: decimal print with newline, appended to outBuf (or written
+//   straight away without output buffering)
+// memCopy, memFill, memSum, memCmp64: the bulk mem builtins
+// outFlush: the flush() builtin, writes out and empties outBuf
+// readInt, readInts (only when the program reads input): the read_int() and
+//   read_ints() builtins, parsing decimal numbers from stdin through inBuf
+// profileWrite (-fprofile-generate only): writes the counters to the profile
+//   file; _start calls it once main has returned
 //
 // Notes:
 // - We keep it minimal; caller-saved regs only.
 // - printInt expects value in RDI.
+// - The mem routines take element indexes and counts in RDI, RSI, RDX, like
+//   any call. A count <= 0 does nothing.
 
-static void emitMovRegImm64Const(ByteBuf *text, Reg reg, uint64_t imm) {
-    emitMovRegImm64(text, reg, imm);
+// Blocks of at least REP_MIN_WORDS elements are copied and filled with
+// rep movsq/stosq, whose startup cost is paid off by then; from
+// STREAM_MIN_WORDS (4 MiB, more than a core's share of the last level cache)
+// on the stores bypass the cache with movnti, so clearing a big work area does
+// not evict everything else. Smaller blocks use 2x16-byte SSE2 moves.
+#define REP_MIN_WORDS 512
+#define STREAM_MIN_WORDS (1 << 19)
+
+// rel32 branch sites (opcode offsets) of the runtime, in emission order
+typedef struct {
+    size_t sites[128];
+    int count;
+} Branches;
+
+static size_t branchForward(ByteBuf *text, Branches *br, int cc) {
+    // cc < 0: jmp
+    size_t at = cc < 0 ? emitJmpRel32Placeholder(text) : emitJccRel32Placeholder(text, (uint8_t)cc);
+    br[0].sites[br[0].count++] = at - (cc < 0 ? 1 : 2);
+    return at;
+}
+
+static void bindHere(ByteBuf *text, size_t at) {
+    patchRel32(text, at, (int32_t)((int64_t)text[0].size - (int64_t)(at + 4)));
+}
+
+static void branchBack(ByteBuf *text, Branches *br, int cc, size_t target) {
+    size_t at = branchForward(text, br, cc);
+    patchRel32(text, at, (int32_t)((int64_t)target - (int64_t)(at + 4)));
+}
+
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_S = 0x8, CC_NS = 0x9, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+
+// mem[dst] = mem[src] (or `value` when src < 0), moving both indexes up by
+// one, until count reaches 0; count > 0 on entry.
+static void emitScalarTail(ByteBuf *text, PatchList *patches, Branches *br, Reg dst, int src, Reg value, Reg count) {
+    size_t loop = text[0].size;
+    if (src >= 0) {
+        emitMovRegAbsIndex(text, patches, value, src, 8, "__rt_memArray", 0);
+        emitIncReg(text, (Reg)src);
+    }
+    emitMovAbsIndexReg(text, patches, dst, 8, "__rt_memArray", 0, value);
+    emitIncReg(text, dst);
+    emitDecReg(text, count);
+    branchBack(text, br, CC_NE, loop);
+}
+
+// memFill(dst, value, n): mem[dst .. dst+n) = value; returns 0
+static void emitMemFill(ByteBuf *text, PatchList *patches, Branches *br) {
+    emitAluRegImm32(text, ALU_CMP, REG_RDX, REP_MIN_WORDS);
+    size_t jgeBig = branchForward(text, br, CC_GE);
+    // xmm0 = value in both lanes
+    emitMovqXmmReg(text, 0, REG_RSI);
+    emitPackedXmmXmm(text, PACKED_PUNPCKLQDQ, 0, 0);
+    emitAluRegImm(text, ALU_SUB, REG_RDX, 4);
+    size_t jlSmall = branchForward(text, br, CC_L);
+    size_t loop = text[0].size;
+    emitMovdquAbsIndexXmm(text, patches, -1, REG_RDI, "__rt_memArray", 0, 0);
+    emitMovdquAbsIndexXmm(text, patches, -1, REG_RDI, "__rt_memArray", 16, 0);
+    emitAluRegImm(text, ALU_ADD, REG_RDI, 4);
+    emitAluRegImm(text, ALU_SUB, REG_RDX, 4);
+    branchBack(text, br, CC_GE, loop);
+    bindHere(text, jlSmall);
+    emitAluRegImm(text, ALU_ADD, REG_RDX, 4);
+    // tail: rdx < 4 elements left (or the original n when it is below 4)
+    size_t tail = text[0].size;
+    emitTestRegReg(text, REG_RDX, REG_RDX);
+    size_t jleDone = branchForward(text, br, CC_LE);
+    emitScalarTail(text, patches, br, REG_RDI, -1, REG_RSI, REG_RDX);
+    bindHere(text, jleDone);
+    emitXorReg32(text, REG_RAX);
+    emitRet(text);
+
+    bindHere(text, jgeBig);
+    emitAluRegImm32(text, ALU_CMP, REG_RDX, STREAM_MIN_WORDS);
+    size_t jgeStream = branchForward(text, br, CC_GE);
+    emitLeaRegAbsIndex(text, patches, REG_RDI, REG_RDI, 8, "__rt_memArray", 0);
+    emitMovRegReg(text, REG_RAX, REG_RSI);
+    emitMovRegReg(text, REG_RCX, REG_RDX);
+    emitRepStosq(text);
+    emitXorReg32(text, REG_RAX);
+    emitRet(text);
+
+    bindHere(text, jgeStream);
+    emitAluRegImm(text, ALU_SUB, REG_RDX, 4);
+    loop = text[0].size;
+    for (int k = 0; k < 4; k++) emitMovntiAbsIndexReg(text, patches, REG_RDI, 8, "__rt_memArray", 8 * k, REG_RSI);
+    emitAluRegImm(text, ALU_ADD, REG_RDI, 4);
+    emitAluRegImm(text, ALU_SUB, REG_RDX, 4);
+    branchBack(text, br, CC_GE, loop);
+    emitSfence(text);
+    emitAluRegImm(text, ALU_ADD, REG_RDX, 4);
+    branchBack(text, br, -1, tail);
+}
+
+// memCopy(dst, src, n): mem[dst .. dst+n) = mem[src .. src+n) as if through
+// a temporary copy; returns 0
+static void emitMemCopy(ByteBuf *text, PatchList *patches, Branches *br) {
+    emitTestRegReg(text, REG_RDX, REG_RDX);
+    size_t jleDone = branchForward(text, br, CC_LE);
+    // dst - src in [1, n) overlaps the part of src not copied yet when going
+    // up, so that case copies downwards one element at a time
+    emitMovRegReg(text, REG_RCX, REG_RDI);
+    emitSubRegReg(text, REG_RCX, REG_RSI);
+    emitCmpRegReg(text, REG_RCX, REG_RDX);
+    size_t jaeUp = branchForward(text, br, CC_AE);
+    emitTestRegReg(text, REG_RCX, REG_RCX);
+    size_t jeSame = branchForward(text, br, CC_E);
+    emitAddRegReg(text, REG_RDI, REG_RDX);
+    emitAddRegReg(text, REG_RSI, REG_RDX);
+    size_t down = text[0].size;
+    emitDecReg(text, REG_RSI);
+    emitDecReg(text, REG_RDI);
+    emitMovRegAbsIndex(text, patches, REG_RAX, REG_RSI, 8, "__rt_memArray", 0);
+    emitMovAbsIndexReg(text, patches, REG_RDI, 8, "__rt_memArray", 0, REG_RAX);
+    emitDecReg(text, REG_RDX);
+    branchBack(text, br, CC_NE, down);
+    bindHere(text, jeSame);
+    size_t jmpDone = branchForward(text, br, -1);
+
+    bindHere(text, jaeUp);
+    emitAluRegImm32(text, ALU_CMP, REG_RDX, REP_MIN_WORDS);
+    size_t jgeBig = branchForward(text, br, CC_GE);
+    emitAluRegImm(text, ALU_SUB, REG_RDX, 4);
+    size_t jlSmall = branchForward(text, br, CC_L);
+    size_t loop = text[0].size;
+    // both loads first: src may be up to 3 elements above dst
+    emitMovdquXmmAbsIndex(text, patches, 0, -1, REG_RSI, "__rt_memArray", 0);
+    emitMovdquXmmAbsIndex(text, patches, 1, -1, REG_RSI, "__rt_memArray", 16);
+    emitMovdquAbsIndexXmm(text, patches, -1, REG_RDI, "__rt_memArray", 0, 0);
+    emitMovdquAbsIndexXmm(text, patches, -1, REG_RDI, "__rt_memArray", 16, 1);
+    emitAluRegImm(text, ALU_ADD, REG_RSI, 4);
+    emitAluRegImm(text, ALU_ADD, REG_RDI, 4);
+    emitAluRegImm(text, ALU_SUB, REG_RDX, 4);
+    branchBack(text, br, CC_GE, loop);
+    bindHere(text, jlSmall);
+    emitAluRegImm(text, ALU_ADD, REG_RDX, 4);
+    size_t tail = text[0].size;
+    emitTestRegReg(text, REG_RDX, REG_RDX);
+    size_t jleTailDone = branchForward(text, br, CC_LE);
+    emitScalarTail(text, patches, br, REG_RDI, REG_RSI, REG_RAX, REG_RDX);
+    bindHere(text, jleTailDone);
+    bindHere(text, jleDone);
+    bindHere(text, jmpDone);
+    emitXorReg32(text, REG_RAX);
+    emitRet(text);
+
+    bindHere(text, jgeBig);
+    emitAluRegImm32(text, ALU_CMP, REG_RDX, STREAM_MIN_WORDS);
+    size_t jgeStream = branchForward(text, br, CC_GE);
+    emitLeaRegAbsIndex(text, patches, REG_RDI, REG_RDI, 8, "__rt_memArray", 0);
+    emitLeaRegAbsIndex(text, patches, REG_RSI, REG_RSI, 8, "__rt_memArray", 0);
+    emitMovRegReg(text, REG_RCX, REG_RDX);
+    emitRepMovsq(text);
+    emitXorReg32(text, REG_RAX);
+    emitRet(text);
+
+    bindHere(text, jgeStream);
+    emitAluRegImm(text, ALU_SUB, REG_RDX, 4);
+    loop = text[0].size;
+    Reg tmp[4] = { REG_RAX, REG_RCX, REG_R8, REG_R9 };
+    for (int k = 0; k < 4; k++) emitMovRegAbsIndex(text, patches, tmp[k], REG_RSI, 8, "__rt_memArray", 8 * k);
+    for (int k = 0; k < 4; k++) emitMovntiAbsIndexReg(text, patches, REG_RDI, 8, "__rt_memArray", 8 * k, tmp[k]);
+    emitAluRegImm(text, ALU_ADD, REG_RSI, 4);
+    emitAluRegImm(text, ALU_ADD, REG_RDI, 4);
+    emitAluRegImm(text, ALU_SUB, REG_RDX, 4);
+    branchBack(text, br, CC_GE, loop);
+    emitSfence(text);
+    emitAluRegImm(text, ALU_ADD, REG_RDX, 4);
+    branchBack(text, br, -1, tail);
+}
+
+// memSum(src, n): mem[src] + ... + mem[src+n-1], wrapping
+static void emitMemSum(ByteBuf *text, PatchList *patches, Branches *br) {
+    emitPackedXmmXmm(text, PACKED_PXOR, 0, 0);
+    emitPackedXmmXmm(text, PACKED_PXOR, 1, 1);
+    emitAluRegImm(text, ALU_SUB, REG_RSI, 4);
+    size_t jlSmall = branchForward(text, br, CC_L);
+    size_t loop = text[0].size;
+    emitMovdquXmmAbsIndex(text, patches, 2, -1, REG_RDI, "__rt_memArray", 0);
+    emitMovdquXmmAbsIndex(text, patches, 3, -1, REG_RDI, "__rt_memArray", 16);
+    emitPackedXmmXmm(text, PACKED_PADDQ, 0, 2);
+    emitPackedXmmXmm(text, PACKED_PADDQ, 1, 3);
+    emitAluRegImm(text, ALU_ADD, REG_RDI, 4);
+    emitAluRegImm(text, ALU_SUB, REG_RSI, 4);
+    branchBack(text, br, CC_GE, loop);
+    bindHere(text, jlSmall);
+    emitAluRegImm(text, ALU_ADD, REG_RSI, 4);
+    // rax = sum of the four lanes
+    emitPackedXmmXmm(text, PACKED_PADDQ, 0, 1);
+    emitPshufdXmmXmm(text, 1, 0, 0x4E);
+    emitPackedXmmXmm(text, PACKED_PADDQ, 0, 1);
+    emitMovqRegXmm(text, REG_RAX, 0);
+    emitTestRegReg(text, REG_RSI, REG_RSI);
+    size_t jleDone = branchForward(text, br, CC_LE);
+    size_t tail = text[0].size;
+    emitMovRegAbsIndex(text, patches, REG_RCX, REG_RDI, 8, "__rt_memArray", 0);
+    emitAddRegReg(text, REG_RAX, REG_RCX);
+    emitIncReg(text, REG_RDI);
+    emitDecReg(text, REG_RSI);
+    branchBack(text, br, CC_NE, tail);
+    bindHere(text, jleDone);
+    emitRet(text);
+}
+
+// memCmp64(a, b, n): compares mem[a ..] and mem[b ..] element by element as
+// signed values; -1, 0 or 1 as at the first difference
+static void emitMemCmp64(ByteBuf *text, PatchList *patches, Branches *br) {
+    emitXorReg32(text, REG_RAX);
+    emitAluRegImm(text, ALU_SUB, REG_RDX, 4);
+    size_t jlSmall = branchForward(text, br, CC_L);
+    // 4 elements at a time while all of them are equal (pcmpeqd on both
+    // halves of each element)
+    size_t loop = text[0].size;
+    emitMovdquXmmAbsIndex(text, patches, 0, -1, REG_RDI, "__rt_memArray", 0);
+    emitMovdquXmmAbsIndex(text, patches, 1, -1, REG_RSI, "__rt_memArray", 0);
+    emitMovdquXmmAbsIndex(text, patches, 2, -1, REG_RDI, "__rt_memArray", 16);
+    emitMovdquXmmAbsIndex(text, patches, 3, -1, REG_RSI, "__rt_memArray", 16);
+    emitPackedXmmXmm(text, PACKED_PCMPEQD, 0, 1);
+    emitPackedXmmXmm(text, PACKED_PCMPEQD, 2, 3);
+    emitPackedXmmXmm(text, PACKED_PAND, 0, 2);
+    emitPmovmskbRegXmm(text, REG_RCX, 0);
+    emitAluRegImm32(text, ALU_CMP, REG_RCX, 0xFFFF);
+    size_t jneFound = branchForward(text, br, CC_NE);
+    emitAluRegImm(text, ALU_ADD, REG_RDI, 4);
+    emitAluRegImm(text, ALU_ADD, REG_RSI, 4);
+    emitAluRegImm(text, ALU_SUB, REG_RDX, 4);
+    branchBack(text, br, CC_GE, loop);
+    // the scalar loop finds the difference within these 4 or checks the rest
+    bindHere(text, jlSmall);
+    bindHere(text, jneFound);
+    emitAluRegImm(text, ALU_ADD, REG_RDX, 4);
+    emitTestRegReg(text, REG_RDX, REG_RDX);
+    size_t jleEqual = branchForward(text, br, CC_LE);
+    size_t tail = text[0].size;
+    emitMovRegAbsIndex(text, patches, REG_RCX, REG_RDI, 8, "__rt_memArray", 0);
+    emitMovRegAbsIndex(text, patches, REG_R8, REG_RSI, 8, "__rt_memArray", 0);
+    emitCmpRegReg(text, REG_RCX, REG_R8);
+    size_t jneDiff = branchForward(text, br, CC_NE);
+    emitIncReg(text, REG_RDI);
+    emitIncReg(text, REG_RSI);
+    emitDecReg(text, REG_RDX);
+    branchBack(text, br, CC_NE, tail);
+    bindHere(text, jleEqual);
+    emitRet(text);
+    // rax = a > b ? 1 : -1
+    bindHere(text, jneDiff);
+    emitSetccAl(text, CC_G);
+    emitLeaRegBaseIndexScaleDisp(text, REG_RAX, REG_RAX, REG_RAX, 1, -1);
+    emitRet(text);
+}
+
+// printInt(x): formats x right to left into a buffer on the stack, two
+// digits per step: q = x / 100 is a multiply by a reciprocal, and the digit
+// pair for x - 100*q comes from the digitPairs table ("00".."99") in the
+// data segment. The digits are those of |x| as an unsigned number, so
+// INT64_MIN, which neg leaves alone, prints as it should.
+//
+// Stack: the newline at [rbp-17], digits and sign below it (at most 21
+// bytes). The copy into outBuf moves 24 bytes at a time, reading past the
+// newline into the rest of the frame and writing into outBuf's slack.
+static void emitPrintInt(ByteBuf *text, PatchList *patches, Branches *br, int bufferOutput) {
+    emitPushReg(text, REG_RBP);
+    emitMovRegReg(text, REG_RBP, REG_RSP);
+    emitAluRegImm(text, ALU_SUB, REG_RSP, 48);
+    // r9 keeps the sign, rdi becomes |x|
+    emitMovRegReg(text, REG_R9, REG_RDI);
+    emitTestRegReg(text, REG_RDI, REG_RDI);
+    size_t jnsPositive = branchForward(text, br, CC_NS);
+    emitNegReg(text, REG_RDI);
+    bindHere(text, jnsPositive);
+    emitLeaRegMemDisp(text, REG_RSI, REG_RBP, -17);
+    emitMovRegImm(text, REG_RAX, '\n');
+    // mov byte [rsi], al : 88 06
+    emitU8(text, 0x88); emitU8(text, 0x06);
+
+    // while (rdi >= 100): rdx = rdi / 100 = ((rdi >> 2) * 0x28F5C28F5C28F5C3) >> 66
+    emitMovRegImm64(text, REG_RCX, 0x28F5C28F5C28F5C3ull);
+    size_t jmpTest = branchForward(text, br, -1);
+    size_t loop = text[0].size;
+    emitMovRegReg(text, REG_RAX, REG_RDI);
+    emitShiftRegImm(text, SHIFT_SHR, REG_RAX, 2);
+    emitMulRaxReg(text, REG_RCX);
+    emitShiftRegImm(text, SHIFT_SHR, REG_RDX, 2);
+    emitIMulRegRegImm(text, REG_RAX, REG_RDX, 100);
+    emitSubRegReg(text, REG_RDI, REG_RAX);
+    emitMovzxRegWordAbsIndex(text, patches, REG_RAX, REG_RDI, 2, "__rt_digitPairs", 0);
+    emitAluRegImm(text, ALU_SUB, REG_RSI, 2);
+    // mov word [rsi], ax : 66 89 06
+    emitU8(text, 0x66); emitU8(text, 0x89); emitU8(text, 0x06);
+    emitMovRegReg(text, REG_RDI, REG_RDX);
+    bindHere(text, jmpTest);
+    emitAluRegImm(text, ALU_CMP, REG_RDI, 100);
+    branchBack(text, br, CC_AE, loop);
+    // the last one or two digits
+    emitAluRegImm(text, ALU_CMP, REG_RDI, 10);
+    size_t jbOne = branchForward(text, br, CC_B);
+    emitMovzxRegWordAbsIndex(text, patches, REG_RAX, REG_RDI, 2, "__rt_digitPairs", 0);
+    emitAluRegImm(text, ALU_SUB, REG_RSI, 2);
+    emitU8(text, 0x66); emitU8(text, 0x89); emitU8(text, 0x06);
+    size_t jmpSign = branchForward(text, br, -1);
+    bindHere(text, jbOne);
+    emitLeaRegMemDisp(text, REG_RAX, REG_RDI, '0');
+    emitDecReg(text, REG_RSI);
+    emitU8(text, 0x88); emitU8(text, 0x06);
+    bindHere(text, jmpSign);
+    emitTestRegReg(text, REG_R9, REG_R9);
+    size_t jnsNoSign = branchForward(text, br, CC_NS);
+    emitDecReg(text, REG_RSI);
+    emitMovRegImm(text, REG_RAX, '-');
+    emitU8(text, 0x88); emitU8(text, 0x06);
+    bindHere(text, jnsNoSign);
+    // r8 = length
+    emitLeaRegMemDisp(text, REG_R8, REG_RBP, -16);
+    emitSubRegReg(text, REG_R8, REG_RSI);
+
+    if (bufferOutput) {
+        // flush first when the r8 bytes at rsi do not fit, then append them
+        emitMovRegAbsIndex(text, patches, REG_RAX, -1, 1, "__rt_outLen", 0);
+        emitLeaRegBaseIndexScale(text, REG_RDX, REG_RAX, REG_R8, 1);
+        emitAluRegImm32(text, ALU_CMP, REG_RDX, OUTPUT_BUFFER_BYTES);
+        size_t jleFits = branchForward(text, br, CC_LE);
+        emitPushReg(text, REG_RSI);
+        emitPushReg(text, REG_R8);
+        emitCallRel32Patch(text, patches, "__rt_outFlush");  // leaves rax = 0
+        emitPopReg(text, REG_R8);
+        emitPopReg(text, REG_RSI);
+        bindHere(text, jleFits);
+        emitLeaRegAbsIndex(text, patches, REG_RDI, REG_RAX, 1, "__rt_outBuf", 0);
+        for (int k = 0; k < 3; k++) {
+            emitMovRegMemDisp(text, REG_RDX, REG_RSI, 8 * k);
+            emitMovMemDispReg(text, REG_RDI, 8 * k, REG_RDX);
+        }
+        emitAluAbsIndexReg(text, patches, ALU_ADD, -1, 1, "__rt_outLen", 0, REG_R8);
+    } else {
+        // sys_write(1, rsi, r8)
+        emitMovRegImm(text, REG_RAX, 1);
+        emitMovRegImm(text, REG_RDI, 1);
+        emitMovRegReg(text, REG_RDX, REG_R8);
+        emitSyscall(text);
+    }
+    emitLeave(text);
+    emitRet(text);
+}
+
+// outFlush(): write(1, outBuf, outLen) until all of it is out, then
+// outLen = 0; returns 0. Output that cannot be written is dropped, like
+// printInt's own failed writes without buffering.
+static void emitOutFlush(ByteBuf *text, PatchList *patches, Branches *br, int bufferOutput) {
+    if (!bufferOutput) {
+        emitXorReg32(text, REG_RAX);
+        emitRet(text);
+        return;
+    }
+    emitMovRegAbsIndex(text, patches, REG_RDX, -1, 1, "__rt_outLen", 0);
+    emitTestRegReg(text, REG_RDX, REG_RDX);
+    size_t jeEmpty = branchForward(text, br, CC_E);
+    emitMovReg32Imm32Patch(text, patches, REG_RSI, "__rt_outBuf", 0);
+    emitMovRegImm(text, REG_RDI, 1);
+    size_t loop = text[0].size;
+    emitMovRegImm(text, REG_RAX, 1);
+    emitSyscall(text);
+    emitTestRegReg(text, REG_RAX, REG_RAX);
+    size_t jleFailed = branchForward(text, br, CC_LE);
+    emitAddRegReg(text, REG_RSI, REG_RAX);
+    emitSubRegReg(text, REG_RDX, REG_RAX);
+    branchBack(text, br, CC_NE, loop);
+    bindHere(text, jleFailed);
+    emitMovAbsIndexImm32(text, patches, -1, 1, "__rt_outLen", 0, 0);
+    bindHere(text, jeEmpty);
+    emitXorReg32(text, REG_RAX);
+    emitRet(text);
+}
+
+// Refills inBuf with read(0, inBuf, INPUT_BUFFER_BYTES), flushing stdout
+// first so that a prompt shows up before the program waits. Leaves rsi =
+// inBuf and r8 = the end of what was read, so rsi == r8 at end of input (or
+// on an error). Keeps r9 and r10.
+static void emitReadFill(ByteBuf *text, PatchList *patches, Branches *br, int bufferOutput) {
+    if (bufferOutput) emitCallRel32Patch(text, patches, "__rt_outFlush");
+    emitXorReg32(text, REG_RAX);
+    emitXorReg32(text, REG_RDI);
+    emitMovReg32Imm32Patch(text, patches, REG_RSI, "__rt_inBuf", 0);
+    emitMovRegImm(text, REG_RDX, INPUT_BUFFER_BYTES);
+    emitSyscall(text);
+    emitMovRegReg(text, REG_R8, REG_RSI);
+    emitTestRegReg(text, REG_RAX, REG_RAX);
+    size_t jleEnd = branchForward(text, br, CC_LE);
+    emitAddRegReg(text, REG_R8, REG_RAX);
+    bindHere(text, jleEnd);
+}
+
+// readInt(): the next number on stdin, or 0 at end of input; rcx = 1 when
+// there was a number, else 0. Anything but digits separates numbers, and a
+// '-' right in front of the digits makes the number negative. Digits
+// accumulate with 64-bit wrap-around. The byte after the digits is left in
+// inBuf, so "3-4" reads as 3 and -4. The read position lives in inPos/inEnd
+// between calls and in rsi/r8 meanwhile; the number builds up in r10 and
+// its sign in r9, which read() leaves alone.
+static void emitReadInt(ByteBuf *text, PatchList *patches, Branches *br, int bufferOutput) {
+    emitMovRegAbsIndex(text, patches, REG_RSI, -1, 1, "__rt_inPos", 0);
+    emitMovRegAbsIndex(text, patches, REG_R8, -1, 1, "__rt_inEnd", 0);
+    emitXorReg32(text, REG_R9);
+    // skip to the first digit
+    size_t skip = text[0].size;
+    emitCmpRegReg(text, REG_RSI, REG_R8);
+    size_t jbSkipByte = branchForward(text, br, CC_B);
+    emitReadFill(text, patches, br, bufferOutput);
+    emitCmpRegReg(text, REG_RSI, REG_R8);
+    size_t jaeEnd = branchForward(text, br, CC_AE);
+    bindHere(text, jbSkipByte);
+    // movzx rcx, byte [rsi] : 48 0F B6 0E
+    emitU8(text, 0x48); emitU8(text, 0x0F); emitU8(text, 0xB6); emitU8(text, 0x0E);
+    emitIncReg(text, REG_RSI);
+    emitAluRegImm(text, ALU_SUB, REG_RCX, '0');
+    emitAluRegImm(text, ALU_CMP, REG_RCX, 9);
+    size_t jbeFirst = branchForward(text, br, CC_BE);
+    // r9 = (byte == '-')
+    emitXorReg32(text, REG_R9);
+    emitAluRegImm(text, ALU_CMP, REG_RCX, '-' - '0');
+    branchBack(text, br, CC_NE, skip);
+    emitIncReg(text, REG_R9);
+    branchBack(text, br, -1, skip);
+
+    bindHere(text, jbeFirst);
+    emitMovRegReg(text, REG_R10, REG_RCX);
+    size_t digits = text[0].size;
+    emitCmpRegReg(text, REG_RSI, REG_R8);
+    size_t jbDigit = branchForward(text, br, CC_B);
+    emitReadFill(text, patches, br, bufferOutput);
+    emitCmpRegReg(text, REG_RSI, REG_R8);
+    size_t jaeDone = branchForward(text, br, CC_AE);
+    bindHere(text, jbDigit);
+    emitU8(text, 0x48); emitU8(text, 0x0F); emitU8(text, 0xB6); emitU8(text, 0x0E);
+    emitAluRegImm(text, ALU_SUB, REG_RCX, '0');
+    emitAluRegImm(text, ALU_CMP, REG_RCX, 9);
+    size_t jaDone = branchForward(text, br, CC_A);
+    emitIncReg(text, REG_RSI);
+    // r10 = r10 * 10 + digit
+    emitLeaRegBaseIndexScale(text, REG_R10, REG_R10, REG_R10, 4);
+    emitLeaRegBaseIndexScale(text, REG_R10, REG_RCX, REG_R10, 2);
+    branchBack(text, br, -1, digits);
+
+    bindHere(text, jaeDone);
+    bindHere(text, jaDone);
+    emitMovAbsIndexReg(text, patches, -1, 1, "__rt_inPos", 0, REG_RSI);
+    emitMovAbsIndexReg(text, patches, -1, 1, "__rt_inEnd", 0, REG_R8);
+    emitMovRegReg(text, REG_RAX, REG_R10);
+    emitTestRegReg(text, REG_R9, REG_R9);
+    size_t jePositive = branchForward(text, br, CC_E);
+    emitNegReg(text, REG_RAX);
+    bindHere(text, jePositive);
+    emitMovRegImm(text, REG_RCX, 1);
+    emitRet(text);
+
+    bindHere(text, jaeEnd);
+    emitMovAbsIndexReg(text, patches, -1, 1, "__rt_inPos", 0, REG_RSI);
+    emitMovAbsIndexReg(text, patches, -1, 1, "__rt_inEnd", 0, REG_R8);
+    emitXorReg32(text, REG_RAX);
+    emitXorReg32(text, REG_RCX);
+    emitRet(text);
+}
+
+// readInts(dst, n): reads up to n numbers into mem[dst ..]; returns how many
+// were read, fewer than n only at end of input
+static void emitReadInts(ByteBuf *text, PatchList *patches, Branches *br) {
+    emitPushReg(text, REG_RBX);
+    emitPushReg(text, REG_R12);
+    emitPushReg(text, REG_R13);
+    emitMovRegReg(text, REG_RBX, REG_RDI);
+    emitMovRegReg(text, REG_R12, REG_RSI);
+    emitXorReg32(text, REG_R13);
+    size_t loop = text[0].size;
+    emitCmpRegReg(text, REG_R13, REG_R12);
+    size_t jgeDone = branchForward(text, br, CC_GE);
+    emitCallRel32Patch(text, patches, "__rt_readInt");
+    emitTestRegReg(text, REG_RCX, REG_RCX);
+    size_t jeDone = branchForward(text, br, CC_E);
+    emitLeaRegBaseIndexScale(text, REG_RDX, REG_RBX, REG_R13, 1);
+    emitMovAbsIndexReg(text, patches, REG_RDX, 8, "__rt_memArray", 0, REG_RAX);
+    emitIncReg(text, REG_R13);
+    branchBack(text, br, -1, loop);
+    bindHere(text, jgeDone);
+    bindHere(text, jeDone);
+    emitMovRegReg(text, REG_RAX, REG_R13);
+    emitPopReg(text, REG_R13);
+    emitPopReg(text, REG_R12);
+    emitPopReg(text, REG_RBX);
+    emitRet(text);
+}
+
+// profileWrite(): open(profPath, O_WRONLY|O_CREAT|O_TRUNC, 0644), write the
+// profBytes bytes at profData, close. profBytes is a size, not an address,
+// but goes through the same ABS32 patch. Errors are ignored: the program's
+// own result matters more than its profile.
+static void emitProfileWrite(ByteBuf *text, PatchList *patches, Branches *br) {
+    emitMovRegImm(text, REG_RAX, 2);
+    emitMovReg32Imm32Patch(text, patches, REG_RDI, "__rt_profPath", 0);
+    emitMovRegImm(text, REG_RSI, 0x241);
+    emitMovRegImm(text, REG_RDX, 0644);
+    emitSyscall(text);
+    emitTestRegReg(text, REG_RAX, REG_RAX);
+    size_t jsNoFile = branchForward(text, br, CC_S);
+    emitMovRegReg(text, REG_RDI, REG_RAX);
+    emitMovReg32Imm32Patch(text, patches, REG_RSI, "__rt_profData", 0);
+    emitMovReg32Imm32Patch(text, patches, REG_RDX, "__rt_profBytes", 0);
+    // write until everything is out or write fails
+    size_t loop = text[0].size;
+    emitMovRegImm(text, REG_RAX, 1);
+    emitSyscall(text);
+    emitTestRegReg(text, REG_RAX, REG_RAX);
+    size_t jleClose = branchForward(text, br, CC_LE);
+    emitAddRegReg(text, REG_RSI, REG_RAX);
+    emitSubRegReg(text, REG_RDX, REG_RAX);
+    branchBack(text, br, CC_NE, loop);
+    bindHere(text, jleClose);
+    emitMovRegImm(text, REG_RAX, 3);
+    emitSyscall(text);
+    bindHere(text, jsNoFile);
+    emitRet(text);
 }
 
-void emitRuntime(ByteBuf *text, PatchList *patches, RuntimeOffsets *outOffsets) {
+void emitRuntime(ByteBuf *text, PatchList *patches, RuntimeOffsets *outOffsets, int profile, int bufferOutput, int input) {
+    size_t runtimeStart = text[0].size;
+    int patchStart = patches[0].count;
     outOffsets[0].startOffset = text[0].size;
 
     // _start:
+    // AVX2 needs CPUID.1:ECX.OSXSAVE and AVX, the OS saving the SSE and AVX
+    // state (XCR0 bits 1-2) and CPUID.7.0:EBX.AVX2
+    emitMovRegImm(text, REG_RAX, 1);
+    // cpuid : 0F A2
+    emitU8(text, 0x0F); emitU8(text, 0xA2);
+    emitAluRegImm32(text, ALU_AND, REG_RCX, 0x18000000);
+    emitAluRegImm32(text, ALU_CMP, REG_RCX, 0x18000000);
+    size_t jneNoOsxsave = emitJccRel32Placeholder(text, 0x5); // JNE
+    emitXorReg32(text, REG_RCX);
+    // xgetbv : 0F 01 D0
+    emitU8(text, 0x0F); emitU8(text, 0x01); emitU8(text, 0xD0);
+    emitAluRegImm(text, ALU_AND, REG_RAX, 6);
+    emitAluRegImm(text, ALU_CMP, REG_RAX, 6);
+    size_t jneNoState = emitJccRel32Placeholder(text, 0x5); // JNE
+    emitMovRegImm(text, REG_RAX, 7);
+    emitXorReg32(text, REG_RCX);
+    emitU8(text, 0x0F); emitU8(text, 0xA2);
+    emitAluRegImm(text, ALU_AND, REG_RBX, 0x20);
+    size_t jeNoAvx2 = emitJccRel32Placeholder(text, 0x4); // JE
+    emitMovAbsIndexImm32(text, patches, -1, 1, "__rt_cpuFeatures", 0, 1);
+    // patch the three exits to here
+    size_t noAvx2[3] = { jneNoOsxsave, jneNoState, jeNoAvx2 };
+    for (int i = 0; i < 3; i++) {
+        patchRel32(text, noAvx2[i], (int32_t)((int64_t)text[0].size - (int64_t)(noAvx2[i] + 4)));
+    }
+
     // align stack for call: sub rsp, 8
-    emitSubRspImm32(text, 8);
-    // movabs rax, lang_main ; call *rax
-    emitMovRegImm64Patch(text, patches, SEG_TEXT, REG_RAX, "lang_main", 0);
-    emitCallReg(text, REG_RAX);
+    emitAluRegImm(text, ALU_SUB, REG_RSP, 8);
+    // call lang_main
+    emitCallRel32Patch(text, patches, "lang_main");
+    if (profile || bufferOutput) {
+        // keep the result in the slot below the return address meanwhile
+        emitMovMemDispReg(text, REG_RSP, 0, REG_RAX);
+        if (bufferOutput) emitCallRel32Patch(text, patches, "__rt_outFlush");
+        if (profile) emitCallRel32Patch(text, patches, "__rt_profileWrite");
+        emitMovRegMemDisp(text, REG_RAX, REG_RSP, 0);
+    }
     // add rsp, 8
-    emitAddRspImm32(text, 8);
+    emitAluRegImm(text, ALU_ADD, REG_RSP, 8);
     // mov rdi, rax
     emitMovRegReg(text, REG_RDI, REG_RAX);
     // movabs rax, 60 ; syscall
-    emitMovRegImm64Const(text, REG_RAX, 60);
+    emitMovRegImm(text, REG_RAX, 60);
     emitSyscall(text);
 
+    // opcode offsets of the branches above, in emission order
+    Branches br = { { jneNoOsxsave - 2, jneNoState - 2, jeNoAvx2 - 2 }, 3 };
+
     // printInt:
     outOffsets[0].printIntOffset = text[0].size;
-    // prologue: push rbp; mov rbp, rsp; sub rsp, 96 (buffer + locals)
-    emitPushReg(text, REG_RBP);
-    emitMovRegReg(text, REG_RBP, REG_RSP);
-    emitSubRspImm32(text, 96);
-
-    // stack layout:
-    // [rbp-8]  signFlag (0/1)
-    // buffer at [rbp-96 .. rbp-17] (80 bytes), write from end.
-
-    // signFlag = 0
-    emitMovRegImm64Const(text, REG_RAX, 0);
-    emitMovMemDispReg(text, REG_RBP, -8, REG_RAX);
-
-    // if (rdi < 0) { signFlag=1; rdi = -rdi; }
-    emitTestRegReg(text, REG_RDI, REG_RDI);
-    size_t jgeOff = emitJccRel32Placeholder(text, 0xD); // JGE
-    // signFlag=1
-    emitMovRegImm64Const(text, REG_RAX, 1);
-    emitMovMemDispReg(text, REG_RBP, -8, REG_RAX);
-    // neg rdi: 48 F7 DF
-    emitU8(text, 0x48); emitU8(text, 0xF7); emitU8(text, 0xDF);
-    // patch jge to here
-    int32_t relJge = (int32_t)((int64_t)text[0].size - (int64_t)(jgeOff + 4));
-    patchRel32(text, jgeOff, relJge);
-
-    // rsi = &bufEnd (rbp-17): mov rsi, rbp; sub rsi, 17
-    emitMovRegReg(text, REG_RSI, REG_RBP);
-    emitMovRegImm64Const(text, REG_RAX, 17);
-    emitSubRegReg(text, REG_RSI, REG_RAX);
-
-    // write newline at [rsi]
-    emitMovRegImm64Const(text, REG_RAX, (uint64_t)'\n');
-    // mov byte ptr [rsi], al : 88 06
-    emitU8(text, 0x88); emitU8(text, 0x06);
+    emitPrintInt(text, patches, &br, bufferOutput);
 
-    // r8 = 1 (len)
-    emitMovRegImm64Const(text, REG_R8, 1);
+    outOffsets[0].memFillOffset = text[0].size;
+    emitMemFill(text, patches, &br);
+    outOffsets[0].memCopyOffset = text[0].size;
+    emitMemCopy(text, patches, &br);
+    outOffsets[0].memSumOffset = text[0].size;
+    emitMemSum(text, patches, &br);
+    outOffsets[0].memCmp64Offset = text[0].size;
+    emitMemCmp64(text, patches, &br);
+    outOffsets[0].outFlushOffset = text[0].size;
+    emitOutFlush(text, patches, &br, bufferOutput);
+    outOffsets[0].profileWriteOffset = text[0].size;
+    if (profile) emitProfileWrite(text, patches, &br);
+    outOffsets[0].readIntOffset = text[0].size;
+    if (input) emitReadInt(text, patches, &br, bufferOutput);
+    outOffsets[0].readIntsOffset = text[0].size;
+    if (input) emitReadInts(text, patches, &br);
 
-    // if value == 0: store '0'
-    emitCmpRegImm8(text, REG_RDI, 0);
-    size_t jneValue = emitJccRel32Placeholder(text, 0x5); // JNE
-    // --rsi; [rsi]='0'; ++len
-    emitMovRegImm64Const(text, REG_RAX, 1);
-    emitSubRegReg(text, REG_RSI, REG_RAX);
-    emitMovRegImm64Const(text, REG_RAX, (uint64_t)'0');
-    emitU8(text, 0x88); emitU8(text, 0x06);
-    emitMovRegImm64Const(text, REG_RAX, 1);
-    emitAddRegReg(text, REG_R8, REG_RAX);
-    size_t jmpAfterDigits = emitJmpRel32Placeholder(text);
-    // patch jne to digit loop start
-    int32_t relJne = (int32_t)((int64_t)text[0].size - (int64_t)(jneValue + 4));
-    patchRel32(text, jneValue, relJne);
-
-    // digitLoop:
-    size_t digitLoopStart = text[0].size;
-    // rax = rdi
-    emitMovRegReg(text, REG_RAX, REG_RDI);
-    emitCqo(text);
-    // r10 = 10
-    emitMovRegImm64Const(text, REG_R10, 10);
-    emitIDivReg(text, REG_R10); // quotient in rax, remainder in rdx
-    // remainder in rdx, quotient in rax
-    // rdi = rax
-    emitMovRegReg(text, REG_RDI, REG_RAX);
-    // rdx += '0'
-    emitMovRegImm64Const(text, REG_RAX, (uint64_t)'0');
-    emitAddRegReg(text, REG_RDX, REG_RAX);
-    // --rsi
-    emitMovRegImm64Const(text, REG_RAX, 1);
-    emitSubRegReg(text, REG_RSI, REG_RAX);
-    // mov byte [rsi], dl : 88 16
-    emitU8(text, 0x88); emitU8(text, 0x16);
-    // ++len
-    emitMovRegImm64Const(text, REG_RAX, 1);
-    emitAddRegReg(text, REG_R8, REG_RAX);
-    // if (rdi != 0) loop
-    emitCmpRegImm8(text, REG_RDI, 0);
-    size_t jneLoop = emitJccRel32Placeholder(text, 0x5); // JNE
-    int32_t relBack = (int32_t)((int64_t)digitLoopStart - (int64_t)(jneLoop + 4));
-    patchRel32(text, jneLoop, relBack);
-
-    // patch jmpAfterDigits to here
-    int32_t relAfter = (int32_t)((int64_t)text[0].size - (int64_t)(jmpAfterDigits + 4));
-    patchRel32(text, jmpAfterDigits, relAfter);
-
-    // if signFlag: prepend '-'
-    // load signFlag into rax
-    emitMovRegMemDisp(text, REG_RAX, REG_RBP, -8);
-    emitCmpRegImm8(text, REG_RAX, 0);
-    size_t jeNoSign = emitJccRel32Placeholder(text, 0x4); // JE
-    // --rsi; [rsi]='-'; ++len
-    emitMovRegImm64Const(text, REG_RAX, 1);
-    emitSubRegReg(text, REG_RSI, REG_RAX);
-    emitMovRegImm64Const(text, REG_RAX, (uint64_t)'-');
-    emitU8(text, 0x88); emitU8(text, 0x06);
-    emitMovRegImm64Const(text, REG_RAX, 1);
-    emitAddRegReg(text, REG_R8, REG_RAX);
-    int32_t relNoSign = (int32_t)((int64_t)text[0].size - (int64_t)(jeNoSign + 4));
-    patchRel32(text, jeNoSign, relNoSign);
-
-    // sys_write(1, rsi, r8)
-    // rax=1, rdi=1, rdx=len, rsi=bufStart
-    emitMovRegImm64Const(text, REG_RAX, 1);
-    emitMovRegImm64Const(text, REG_RDI, 1);
-    emitMovRegReg(text, REG_RDX, REG_R8);
-    emitSyscall(text);
-
-    // epilogue
-    emitLeave(text);
-    emitRet(text);
+    size_t *moved[9] = { &outOffsets[0].printIntOffset, &outOffsets[0].memFillOffset, &outOffsets[0].memCopyOffset,
+                         &outOffsets[0].memSumOffset, &outOffsets[0].memCmp64Offset, &outOffsets[0].outFlushOffset,
+                         &outOffsets[0].profileWriteOffset, &outOffsets[0].readIntOffset, &outOffsets[0].readIntsOffset };
+    relaxBranches(text, runtimeStart, br.sites, br.count, patches, patchStart, moved, 9, NULL, 0, 0);
 }
 
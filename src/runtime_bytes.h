@@ -6,9 +6,28 @@
 typedef struct {
     size_t startOffset;
     size_t printIntOffset;
+    size_t memFillOffset;
+    size_t memCopyOffset;
+    size_t memSumOffset;
+    size_t memCmp64Offset;
+    size_t outFlushOffset;
+    size_t profileWriteOffset;  // only emitted with profile set
+    size_t readIntOffset;       // only emitted with input set
+    size_t readIntsOffset;
 } RuntimeOffsets;
 
-void emitRuntime(ByteBuf *text, PatchList *patches, RuntimeOffsets *outOffsets);
+// Size of the stdout buffer (outBuf) that printInt fills, and the bytes
+// past its end that printInt's word-sized copies may write.
+#define OUTPUT_BUFFER_BYTES 8192
+#define OUTPUT_BUFFER_SLACK 24
+
+// Size of the stdin buffer (inBuf) that readInt parses from.
+#define INPUT_BUFFER_BYTES 65536
+
+// With bufferOutput, printInt appends to outBuf and outFlush writes it out;
+// otherwise printInt writes each number at once and outFlush does nothing.
+// readInt and readInts are only emitted with input set.
+void emitRuntime(ByteBuf *text, PatchList *patches, RuntimeOffsets *outOffsets, int profile, int bufferOutput, int input);
 
 #endif
 
@@ -101,9 +101,24 @@ static int checkStmt(Stmt *s, Def **defs, Def *funcs) {
 int semaCheck(Program *p) {
     // collect global function names
     Def *funcs = NULL;
-    for (Function *ff = p->functions; ff; ff = ff->next) addDef(&funcs, ff->name);
-    // add builtin 'print' to funcs
+    // runtime routines and data are named __rt_*, so no user function can
+    // take their place
+    for (Function *ff = p->functions; ff; ff = ff->next) {
+        if (strncmp(ff->name, "__rt_", 5) == 0) {
+            fprintf(stderr,"semantic error: function name '%s' is reserved for the runtime\n", ff->name);
+            return 0;
+        }
+        addDef(&funcs, ff->name);
+    }
+    // add builtins 'print', 'flush', the input ones and the bulk mem ones to funcs
     addDef(&funcs, "print");
+    addDef(&funcs, "memcopy");
+    addDef(&funcs, "memfill");
+    addDef(&funcs, "memsum");
+    addDef(&funcs, "memcmp64");
+    addDef(&funcs, "flush");
+    addDef(&funcs, "read_int");
+    addDef(&funcs, "read_ints");
     addDef(&funcs, "__index_store");
 
     for (Function *f = p->functions; f; f=f->next) {